@@ -0,0 +1,78 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * arena.h
+ *
+ * A bump allocator for everything a request carries, its strings and
+ * argv, so that a session frees it all at once instead of string by
+ * string. Allocations never move, as the arena grows by adding blocks,
+ * and the total handed out is capped.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// The first block, which is kept between requests and holds most of them
+#define ARENA_BLOCK_SIZE    4096
+
+struct arena_block;
+
+struct arena {
+    // newest block first
+    struct arena_block *blocks;
+    // bytes handed out since the last reset, at most "limit"
+    size_t used;
+    size_t limit;
+};
+
+/**
+ * arena_init
+ *
+ * Set up an empty arena, which hands out at most "limit" bytes
+ * between resets. Nothing is allocated until it is used.
+ */
+void arena_init(struct arena *arena, size_t limit);
+
+/**
+ * arena_alloc
+ *
+ * Allocate "len" bytes, aligned for a pointer.
+ *
+ * Return Value
+ * on failure, NULL. Either the limit would be exceeded or malloc failed.
+ * on success, the allocation, valid until the next reset
+ */
+void *arena_alloc(struct arena *arena, size_t len);
+
+/**
+ * arena_reset
+ *
+ * Forget every allocation, keeping only a first block of
+ * ARENA_BLOCK_SIZE around for the next request.
+ */
+void arena_reset(struct arena *arena);
+
+/**
+ * arena_release
+ *
+ * Free every block of the arena, which can be used again afterwards.
+ */
+void arena_release(struct arena *arena);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * audit.h
+ *
+ * Binary audit log of the requests served by the daemon. The file is a
+ * header followed by a fixed number of fixed-size records, used as a
+ * ring and mapped shared by the daemon and every process it forks, so
+ * writing a record is a few stores rather than a syscall.
+ *
+ * Writers claim a sequence number by incrementing audit_header.next,
+ * fill the record it maps to and publish it by storing its sequence
+ * number last. Readers skip records whose seq is 0 and order the rest
+ * by seq.
+ */
+
+#ifndef _AUDIT_H_
+#define _AUDIT_H_
+
+#include <stdint.h>
+
+#define AUDIT_MAGIC         0x54415553  /* "SUAT" */
+#define AUDIT_VERSION       1
+
+// Bytes of argv kept per record, space separated and NUL terminated
+#define AUDIT_ARGV_SIZE     208
+
+struct audit_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t records;
+    // sequence number of the next record, starting at 1
+    uint64_t next;
+    uint8_t reserved[40];
+};
+
+struct audit_record {
+    // sequence number, 0 while the record is being written
+    uint64_t seq;
+    // CLOCK_REALTIME the request came in at, in ns
+    int64_t time_ns;
+    uint32_t duration_us;
+    int32_t pid;
+    int32_t uid;
+    int32_t ppid;
+    int32_t code;
+    uint32_t argc;
+    // FNV-1a of all of argv, NULs included
+    uint32_t argv_hash;
+    uint32_t reserved;
+    char argv[AUDIT_ARGV_SIZE];
+};
+
+struct handshake;
+
+/**
+ * audit_open
+ *
+ * Map the audit log at "path" with room for "records" records, creating
+ * or resetting the file if it doesn't match. Has to be called before
+ * forking so that every process shares the mapping.
+ *
+ * Return Value
+ * on failure, -1 and auditing stays off
+ * on success, 0
+ */
+int audit_open(const char *path, int records);
+
+/**
+ * audit_begin
+ *
+ * Fill "rec" from the request in "hs", which can be released after.
+ */
+void audit_begin(struct audit_record *rec, const struct handshake *hs);
+
+/**
+ * audit_commit
+ *
+ * Add "rec" to the audit log with exit code "code", for a request
+ * which took "duration_us". Does nothing when auditing is off.
+ */
+void audit_commit(struct audit_record *rec, int code, long long duration_us);
+
+#endif
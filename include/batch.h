@@ -0,0 +1,50 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * batch.h
+ *
+ * su --batch, which runs every line of a file as a command, several at
+ * once, from a single request. The results go to stdout as they come,
+ * each frame a header line and, for output, that many bytes of it:
+ *
+ *   LINE out LEN\n<LEN bytes of stdout>
+ *   LINE err LEN\n<LEN bytes of stderr>
+ *   LINE exit CODE USEC\n
+ *
+ * LINE is the line number of the command in the file, CODE its exit
+ * code, or 128 plus the signal which killed it, and USEC how long it
+ * ran. Output frames only come with --capture, and all of them before
+ * the exit frame of their command. Empty lines and lines starting with
+ * '#' are skipped.
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+/**
+ * batch_run
+ *
+ * Run each line of "in" with "shell -c" in "envp", up to "jobs" at once
+ * and at most SUD_BATCH_JOBS, and write the frames to "out". Output of
+ * the commands is discarded unless "capture" is set.
+ *
+ * Return Value
+ * the exit code of su, 0 when every command exited with 0
+ */
+int batch_run(int in, int out, int jobs, int capture, const char *shell, char *const envp[]);
+
+#endif
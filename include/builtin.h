@@ -0,0 +1,80 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * builtin.h
+ *
+ * Optional stand-ins for the simple commands which make up most
+ * requests, run without the exec of the command or of the shell, see
+ * SUD_BUILTINS. A command matches when it is one of the builtins run
+ * directly, or through "sh -c" with a command line of plain words
+ * and at most a trailing "> FILE" or ">> FILE". Anything else, or any
+ * option a builtin doesn't know, is executed as usual.
+ */
+
+#ifndef _BUILTIN_H_
+#define _BUILTIN_H_
+
+// Longest "sh -c" command line, and most words in it
+#define BUILTIN_MAX_LINE    1024
+#define BUILTIN_MAX_ARGS    32
+
+struct builtin;
+
+struct builtin_call {
+    const struct builtin *builtin;
+    int argc;
+    char *argv[BUILTIN_MAX_ARGS + 1];
+    // file stdout is redirected to, or NULL
+    char *redirect;
+    int append;
+    // words of a "sh -c" command line
+    char line[BUILTIN_MAX_LINE];
+};
+
+/**
+ * builtin_init
+ *
+ * Read SUD_BUILTINS, once when the daemon starts. Builtins are off
+ * until then.
+ */
+void builtin_init(void);
+
+/**
+ * builtin_match
+ *
+ * Check whether running "binary" with "argv" can be left to a builtin,
+ * and count the hit or miss. Always misses when SUD_BUILTINS is off.
+ *
+ * Return Value
+ * 0 and "call" is set up for builtin_run() on a hit
+ * -1 when the command has to be executed
+ */
+int builtin_match(const char *binary, char *const argv[], struct builtin_call *call);
+
+/**
+ * builtin_run
+ *
+ * Run a matched builtin on the stdio of the calling process, opening
+ * its redirect first. Nothing is written or truncated unless it runs.
+ *
+ * Return Value
+ * the exit code of the command
+ * -1 when the command has to be executed after all
+ */
+int builtin_run(struct builtin_call *call);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * log.h
+ *
+ * Buffered logging behind the LOG* macros of su.h. Messages below
+ * ANDROID_LOG_WARN are formatted into a per-process ring and only handed
+ * to liblog by su_log_flush(), which the daemon and the client call
+ * where they are about to block anyway, and at exit. Warnings and
+ * errors flush the ring and go out right away.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+// Slots of the ring, and the longest message a slot holds
+#define LOG_RING_SLOTS  64
+#define LOG_MSG_SIZE    512
+
+/**
+ * su_log
+ *
+ * Log a message at "prio", see above.
+ */
+void su_log(int prio, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+/**
+ * su_log_flush
+ *
+ * Hand everything in the ring to liblog. Needs to run before exec,
+ * which would lose the ring. Returns without doing anything if another
+ * thread is already flushing.
+ */
+void su_log_flush(void);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * mux.h
+ *
+ * The stdio of a request flagged HANDSHAKE_MUX, carried over the socket
+ * itself for clients which can't pass FDs, such as those on TCP. The
+ * daemon gives the command pipes, or a PTY of its own with
+ * HANDSHAKE_PTY, and relays them next to it.
+ *
+ * After the ack both ends exchange frames, each a mux_header followed
+ * by "len" bytes, in the byte order of the handshake:
+ *
+ *   MUX_DATA     "len" bytes of stdin, stdout or stderr, as "channel"
+ *                says. Never empty.
+ *   MUX_END      the end of "channel", with the count of bytes sent on
+ *                it as a uint64_t. A receiver which got a different
+ *                amount treats the relay as broken, so a stream cut
+ *                short is never taken for a complete one.
+ *   MUX_CREDIT   the receiver of "channel" wrote out "len" more bytes,
+ *                and so takes that many more. No payload.
+ *   MUX_WINSIZE  a struct winsize for the PTY, from the client.
+ *   MUX_EXIT     the exit code of the command as an int32_t, from the
+ *                daemon, after all its output. It replaces the exit
+ *                code int which follows other requests.
+ *
+ * Each receiver starts out taking MUX_WINDOW bytes of every channel,
+ * so neither end buffers more than that of a stream which isn't being
+ * read, and the other streams keep flowing meanwhile.
+ */
+
+#ifndef _MUX_H_
+#define _MUX_H_
+
+#include <sys/types.h>
+#include <limits.h>
+#include <stdint.h>
+
+// mux_header.type
+#define MUX_DATA        0
+#define MUX_CREDIT      1
+#define MUX_WINSIZE     2
+#define MUX_EXIT        3
+#define MUX_END         4
+
+// mux_header.channel
+#define MUX_STDIN       0
+#define MUX_STDOUT      1
+#define MUX_STDERR      2
+#define MUX_CHANNELS    3
+
+// Bytes of a channel in flight before the receiver returns credit,
+// and the most put in a single frame
+#define MUX_WINDOW      (256 * 1024)
+#define MUX_FRAME_MAX   (64 * 1024)
+
+struct mux_header {
+    uint8_t type;
+    uint8_t channel;
+    uint16_t reserved;
+    uint32_t len;
+};
+
+/**
+ * mux_stdio
+ *
+ * The stdio of a muxed command in the daemon. "child" is what goes
+ * into handshake.fds, -1 for the streams on the PTY, whose slave is
+ * then "pts_slave". "relay" are the other ends, the PTY master for
+ * stdin and stdout, -1 where there is nothing to relay. The relay
+ * holds "slave" open until the command exits, as the master hangs up
+ * whenever no slave is open, such as before the command opened its own.
+ */
+struct mux_stdio {
+    int child[MUX_CHANNELS];
+    int relay[MUX_CHANNELS];
+    int slave;
+    char pts_slave[PATH_MAX];
+};
+
+/**
+ * mux_stdio_open
+ *
+ * Create the pipes for a command, or the PTY with "pty" set, all of
+ * them close-on-exec.
+ *
+ * Return Value
+ * on failure, -1 and errno is set. Nothing is left open.
+ * on success, 0
+ */
+int mux_stdio_open(struct mux_stdio *io, int pty);
+
+/**
+ * mux_stdio_close
+ *
+ * Close each of "fds" which is open, and mark it -1.
+ */
+void mux_stdio_close(int fds[MUX_CHANNELS]);
+
+/**
+ * mux_serve
+ *
+ * Relay the stdio of "child", started on the child ends of "io", over
+ * "sockfd" until it exits and its output went out, then send its exit
+ * code and reap it. Closes the relay ends and the slave of "io".
+ *
+ * Return Value
+ * on failure, -1. The client went away, and the session of the child
+ * got SIGHUP.
+ * on success, the exit code of the child
+ */
+int mux_serve(int sockfd, struct mux_stdio *io, pid_t child);
+
+/**
+ * mux_client
+ *
+ * Relay our stdio over "sockfd" to a request acked with HANDSHAKE_MUX,
+ * until the exit code arrives. With "pty", stdin is put into raw mode
+ * if it is a TTY and the window size of stdout follows SIGWINCH.
+ *
+ * Termination signals stop the relay, and restore stdin.
+ *
+ * Return Value
+ * on failure, -1 and errno is set
+ * on success, the exit code of the command
+ */
+int mux_client(int sockfd, int pty);
+
+#endif
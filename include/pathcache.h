@@ -0,0 +1,56 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * pathcache.h
+ *
+ * Where execvp() would find a command, remembered by the daemon process
+ * which looked it up, so that the exec of the next request for it is a
+ * single execve() instead of one failed execve() per PATH directory
+ * before it. The directories are watched with inotify and the cache is
+ * dropped as soon as anything is created, removed, renamed or chmod'ed
+ * in any of them, see SUD_PATH_CACHE.
+ */
+
+#ifndef _PATHCACHE_H_
+#define _PATHCACHE_H_
+
+/**
+ * pathcache_init
+ *
+ * Read SUD_PATH_CACHE, and make the calling process, an acceptor of the
+ * daemon, the one which owns the cache and watches PATH. The cache is
+ * off until then.
+ */
+void pathcache_init(void);
+
+/**
+ * pathcache_lookup
+ *
+ * Find "name" on PATH the way execvp() would, from the cache when it is
+ * there. Processes forked from the one which owns the cache only use
+ * what it already has, as they share its inotify instance, and return
+ * NULL for anything else.
+ *
+ * Return Value
+ * the full path, valid until the next call
+ * NULL when execvp() has to find it, e.g. for names with a '/', ones
+ * which aren't on PATH, or ones only found after a directory which
+ * can't be watched
+ */
+const char *pathcache_lookup(const char *name);
+
+#endif
@@ -0,0 +1,213 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * proto.h
+ *
+ * The handshake between connect_daemon() and the daemon.
+ *
+ * Since PROTO_VERSION 2 the whole request is a single message: a fixed
+ * header, followed by the PTY slave path and every argument as NUL
+ * terminated strings, with the passed stdio FDs attached as one
+ * SCM_RIGHTS array. The daemon still accepts the older field-by-field
+ * handshake, which starts with the client pid instead of the magic.
+ * It receives either without blocking, see handshake_read().
+ *
+ * Since PROTO_VERSION 3 the header is followed by a 64-bit request id,
+ * which tags the trace events of both ends. Version 2 requests are
+ * still accepted and get an id made up by the daemon.
+ *
+ * Since PROTO_VERSION 4 a request may be flagged HANDSHAKE_MUX, for
+ * clients which can't pass FDs. Its stdio then goes over the socket as
+ * frames, see mux.h, through a PTY of the daemon with HANDSHAKE_PTY.
+ *
+ * Since PROTO_VERSION 5 the request id is the last field of the header
+ * rather than following it, which saves the daemon a read. Versions 3
+ * and 4 send the shorter header, HANDSHAKE_HEADER_V2_SIZE, and the id
+ * after it.
+ *
+ * The daemon acks each request with an int, then sends the exit code
+ * of the command as another int. Requests flagged HANDSHAKE_SESSION
+ * keep the connection open, and the client may send the next request
+ * once it got the exit code of the previous one.
+ *
+ * Clients relaying a PTY of their own flag the request HANDSHAKE_RELAY,
+ * and send the bytes they relayed as a uint64_t after the exit code,
+ * for the counters of the daemon.
+ */
+
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define HANDSHAKE_MAGIC     0x32445553  /* "SUD2" */
+
+// Limits enforced by both ends
+#define HANDSHAKE_MAX_ARGS  512
+#define HANDSHAKE_MAX_SIZE  (256 * 1024)
+// What a request may take in its arena: the strings, argv, and the
+// padding of each string of a legacy handshake
+#define HANDSHAKE_ARENA_SIZE \
+    (HANDSHAKE_MAX_SIZE + 2 * sizeof(char *) * (HANDSHAKE_MAX_ARGS + 2))
+
+// Bits of handshake_header.flags
+#define HANDSHAKE_SESSION   1
+#define HANDSHAKE_MUX       2
+#define HANDSHAKE_PTY       4
+#define HANDSHAKE_RELAY     8
+
+// Bits of handshake_header.fds, in the order the FDs are attached
+#define HANDSHAKE_STDIN     1
+#define HANDSHAKE_STDOUT    2
+#define HANDSHAKE_STDERR    4
+
+struct handshake_header {
+    uint32_t magic;
+    uint32_t version;
+    // bytes of strings following the header
+    uint32_t size;
+    int32_t pid;
+    int32_t uid;
+    int32_t ppid;
+    uint32_t flags;
+    uint32_t fds;
+    uint32_t argc;
+    // since version 5
+    uint32_t reserved;
+    uint64_t request_id;
+};
+
+// The header of versions 2 to 4
+#define HANDSHAKE_HEADER_V2_SIZE offsetof(struct handshake_header, reserved)
+
+struct handshake {
+    uint64_t request_id;
+    // the PROTO_VERSION of the client, 0 for the legacy handshake
+    int version;
+    int pid;
+    int uid;
+    int ppid;
+    int flags;
+    // stdin, stdout and stderr, -1 when not passed
+    int fds[3];
+    char *pts_slave;
+    int argc;
+    char **argv;
+    // where the strings and argv of a received handshake live
+    struct arena *arena;
+};
+
+/**
+ * handshake_send
+ *
+ * Send the request in "hs" with a single sendmsg(). FDs in hs->fds
+ * which are -1 or closed are not sent. hs->arena is ignored.
+ *
+ * Return Value
+ * on failure, -1 and errno is set
+ * on success, 0
+ */
+int handshake_send(int sockfd, const struct handshake *hs);
+
+/**
+ * handshake_recv
+ *
+ * Receive a single message request into "hs", waiting for as long as
+ * it takes, like the next request of a session. It is expected in the
+ * version of the request "hs" held before, as a session sticks to one.
+ * The strings and argv all live in "arena", which is reset first, and
+ * go away with handshake_free().
+ *
+ * Return Value
+ * on failure, -1. No FDs are left open.
+ * if the client hung up before sending anything, 1
+ * on success, 0
+ */
+int handshake_recv(int sockfd, struct handshake *hs, struct arena *arena);
+
+// handshake_read() is still waiting for the rest of the request
+#define HANDSHAKE_PARTIAL   2
+
+/*
+ * A request received piece by piece as it arrives, single message or
+ * legacy, see handshake_read().
+ */
+struct handshake_reader {
+    // the request, complete once handshake_read() returns 0
+    struct handshake hs;
+    struct handshake_header hdr;
+    // the field being read, "got" of its "want" bytes so far
+    int state;
+    char *field;
+    size_t want, got;
+    // an int of the legacy handshake, or the length of a string
+    int32_t value;
+    char byte;
+    // the next FD or argument of the legacy handshake, and how many
+    // FDs had arrived before the byte of that FD
+    int next;
+    int mark;
+    char *strings;
+    // FDs received so far, which the request owns once complete
+    int fds[3];
+    int nfds;
+};
+
+/**
+ * handshake_reader_init
+ *
+ * Get "reader" ready for a new request, whose strings and argv will
+ * live in "arena", which is reset.
+ */
+void handshake_reader_init(struct handshake_reader *reader, struct arena *arena);
+
+/**
+ * handshake_read
+ *
+ * Receive whatever has arrived of the request on "sockfd" without
+ * blocking, and carry on from there on the next call. Accepts the
+ * legacy handshake as well, which starts with the client pid instead
+ * of the magic.
+ *
+ * Return Value
+ * on failure, -1. No FDs are left open.
+ * if the client hung up before sending anything, 1
+ * if more of the request has to arrive, HANDSHAKE_PARTIAL
+ * on success, 0, with the request in reader->hs
+ */
+int handshake_read(int sockfd, struct handshake_reader *reader);
+
+/**
+ * handshake_reader_abort
+ *
+ * Drop a request which is only partly received, closing the FDs which
+ * came with it.
+ */
+void handshake_reader_abort(struct handshake_reader *reader);
+
+/**
+ * handshake_free
+ *
+ * Reset the arena of a received handshake, for the next request of
+ * the session. Passed FDs are left alone.
+ */
+void handshake_free(struct handshake *hs);
+
+#endif
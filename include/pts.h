@@ -24,6 +24,23 @@
 #ifndef _PTS_H_
 #define _PTS_H_
 
+/**
+ * pump_stats
+ *
+ * Per-process counters of how the pumps relayed their data.
+ * splice_bytes were moved with splice() through a pipe, without
+ * being copied into userspace. copy_bytes went through the
+ * read()/write() fallback. fallbacks counts the relays that
+ * started on splice() and had to switch to copying. ring_bytes
+ * were relayed through io_uring, see SUD_IO_ENGINE.
+ */
+struct pump_stats {
+    unsigned long long splice_bytes;
+    unsigned long long copy_bytes;
+    unsigned long fallbacks;
+    unsigned long long ring_bytes;
+};
+
 /**
  * pts_open
  *
@@ -66,51 +83,46 @@ int set_stdin_raw(void);
  */
 int restore_stdin(void);
 
+// Flags for pump_session()
+#define PUMP_STDIN      1
+#define PUMP_STDOUT     2
+#define PUMP_WINCH      4
+
 /**
- * watch_sigwinch_async
+ * pump_session
+ *
+ * Relay a PTY session from a single thread with epoll, or
+ * io_uring if SUD_IO_ENGINE asks for it and the kernel has it,
+ * until the exit code is ready to be read from "sockfd".
  *
- * After calling this function, if the application receives
- * SIGWINCH, the terminal window size will be read from 
- * "input" and set on "output".
+ * With PUMP_STDIN, stdin is put into raw mode and forwarded to
+ * the PTY. With PUMP_STDOUT, the PTY output is forwarded to
+ * stdout. With PUMP_WINCH, the window size of stdout is set on
+ * the PTY now and on every SIGWINCH.
  *
- * NOTE: This function blocks SIGWINCH and spawns a thread.
+ * Termination signals are received through a signalfd. The
+ * first one restores stdin and stops the relay, but the
+ * session keeps waiting for the exit code. A second one
+ * takes its default action.
+ *
+ * Before returning, restores stdin settings.
  *
  * Arguments
- * master   A file descriptor of the TTY window size to follow
- * slave    A file descriptor of the TTY window size which is
- *          to be set on SIGWINCH
+ * ptmx     the PTY master
+ * sockfd   the daemon socket, readable once the exit code arrives
+ * flags    any of PUMP_STDIN, PUMP_STDOUT and PUMP_WINCH
  *
  * Return Value
- * on failure, -1 and errno will be set. In this case, no
- *      thread has been spawned and SIGWINCH will not be 
- *      blocked.
+ * on failure, -1 and errno is set
  * on success, 0
  */
-int watch_sigwinch_async(int master, int slave);
-
-/**
- * watch_sigwinch_cleanup
- *
- * Cause the SIGWINCH watcher thread to terminate
- */
-void watch_sigwinch_cleanup(void);
+int pump_session(int ptmx, int sockfd, int flags);
 
 /**
- * pump_stdin_async
+ * pump_get_stats
  *
- * Forward data from STDIN to the given FD
- * in a seperate thread
- */
-void pump_stdin_async(int outfd);
-
-/**
- * pump_stdout_blocking
- *
- * Forward data from the FD to STDOUT.
- * Returns when the remote end of the FD closes.
- *
- * Before returning, restores stdin settings.
+ * Copy the relay counters of this process into "out".
  */
-void pump_stdout_blocking(int infd);
+void pump_get_stats(struct pump_stats *out);
 
 #endif
@@ -0,0 +1,180 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * stats.h
+ *
+ * Counters of the daemon, in a file mapped shared by run_daemon() before
+ * it forks, so every handler and worker updates them with plain atomic
+ * adds. "su --daemon-stats" maps the same file read-only to print them,
+ * without connecting to the daemon at all.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+#define STATS_MAGIC         0x54535553  /* "SUST" */
+#define STATS_VERSION       8
+
+// Exit codes 0 to 255, and one bucket for everything else
+#define STATS_EXIT_CODES    257
+
+// Request latency, bucket i counts requests below 128 << i us and
+// the last one everything slower
+#define STATS_LATENCY_BUCKETS   16
+#define STATS_LATENCY_BASE_US   128
+
+// Acceptors, or pool workers, tracked one by one
+#define STATS_ACCEPTORS     16
+
+struct stats_acceptor {
+    int32_t pid;
+    // connections waiting in the accept queue of its TCP listener, and
+    // the backlog of that queue, as of its last accept
+    uint32_t queue;
+    uint32_t backlog;
+    // commands and handlers it waits for
+    uint32_t handlers;
+    uint64_t accepts;
+};
+
+struct daemon_stats {
+    uint32_t magic;
+    uint32_t version;
+    // pid of the daemon, for the liveness check
+    int32_t pid;
+    uint32_t reserved;
+    // CLOCK_REALTIME the daemon started at, in s
+    int64_t started;
+
+    uint64_t accepts;
+    // of those, the ones taken by the io_uring engine, which stays 0
+    // unless SUD_IO_ENGINE=uring engaged
+    uint64_t ring_accepts;
+    // requests which were invalid or never arrived in full, and how
+    // many of those missed their deadline
+    uint64_t handshake_failures;
+    uint64_t handshake_timeouts;
+    uint64_t requests;
+    uint64_t fork_failures;
+    // requests a handler dropped before their command started, e.g.
+    // as the client was gone
+    uint64_t request_failures;
+    // sessions being served right now
+    int64_t active_sessions;
+    // processes the acceptors wait for, commands they spawned and
+    // handlers they forked, and how often one waited for them because
+    // it was at SUD_MAX_HANDLERS or SUD_MAX_HANDSHAKES
+    int64_t handlers;
+    uint64_t handler_waits;
+    // commands run by a builtin, and those executed while builtins
+    // were on
+    uint64_t builtin_hits;
+    uint64_t builtin_misses;
+    // commands found on PATH from the cache, and by looking
+    uint64_t path_hits;
+    uint64_t path_misses;
+    // bytes moved over the client sockets: requests, exit codes and
+    // frames of muxed stdio
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // stdio relayed for clients, by the daemon for muxed ones and as
+    // reported by the PTY pumps of the others
+    uint64_t relay_bytes;
+
+    uint64_t exit_codes[STATS_EXIT_CODES];
+    uint64_t latency[STATS_LATENCY_BUCKETS];
+    struct stats_acceptor acceptors[STATS_ACCEPTORS];
+};
+
+extern struct daemon_stats *daemon_stats;
+
+#define STATS_ADD(field, n) do {                                        \
+        if (daemon_stats)                                               \
+            __atomic_add_fetch(&daemon_stats->field, (n), __ATOMIC_RELAXED); \
+    } while (0)
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+/**
+ * stats_path
+ *
+ * The file the counters live in, SUD_STATS or DAEMON_STATS.
+ */
+const char *stats_path(void);
+
+/**
+ * stats_open
+ *
+ * Create the counters at "path", zeroed, and map them. Has to be called
+ * before forking so that every process shares the mapping.
+ *
+ * Return Value
+ * on failure, -1 and the counters stay off
+ * on success, 0
+ */
+int stats_open(const char *path);
+
+/**
+ * stats_owner
+ *
+ * Record the calling process as the daemon.
+ */
+void stats_owner(void);
+
+/**
+ * stats_acceptor
+ *
+ * Record the calling process as acceptor "index".
+ */
+void stats_acceptor(int index);
+
+/**
+ * stats_accepted
+ *
+ * Count "count" accepted connections, and the queue left behind in the
+ * accept queue of the calling acceptor.
+ */
+void stats_accepted(int count, unsigned int queue, unsigned int backlog);
+
+/**
+ * stats_handlers
+ *
+ * Count "delta" commands or handlers started, or reaped when negative,
+ * by the calling acceptor.
+ */
+void stats_handlers(int delta);
+
+/**
+ * stats_request
+ *
+ * Count a finished request with exit code "code" which took
+ * "duration_us".
+ */
+void stats_request(int code, long long duration_us);
+
+/**
+ * stats_print
+ *
+ * Print the counters at "path" to stdout.
+ *
+ * Return Value
+ * 0 if the daemon which owns them is alive, 1 otherwise
+ */
+int stats_print(const char *path);
+
+#endif
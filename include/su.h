@@ -21,13 +21,158 @@
 
 #include <android/log.h>
 
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-#define LOGV(...) __android_log_print(ANDROID_LOG_VERBOSE, LOG_TAG, __VA_ARGS__)
+#include "log.h"
+
+// Lowest priority which is logged at all. Messages below it compile to
+// nothing, e.g. build with -DLOG_LEVEL=ANDROID_LOG_INFO to drop LOGD.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL ANDROID_LOG_VERBOSE
+#endif
+
+#define LOG_PRIO(prio, ...) do { if ((prio) >= LOG_LEVEL) su_log(prio, __VA_ARGS__); } while (0)
+
+#define LOGD(...) LOG_PRIO(ANDROID_LOG_DEBUG, __VA_ARGS__)
+#define LOGE(...) LOG_PRIO(ANDROID_LOG_ERROR, __VA_ARGS__)
+#define LOGV(...) LOG_PRIO(ANDROID_LOG_VERBOSE, __VA_ARGS__)
 #define LOGW LOGD
 
 #define PORT 3523
 
+// Unix socket of the daemon, "@name" for the abstract namespace or a
+// filesystem path, "" to disable. Overridden by SUD_SOCKET at runtime,
+// for both the daemon and its clients.
+#ifndef DAEMON_SOCKET
+#define DAEMON_SOCKET "@sud"
+#endif
+
+// Whether the daemon also listens on TCP PORT. Clients fall back to it
+// when the Unix socket is unavailable. Overridden by SUD_TCP at runtime.
+#ifndef DAEMON_TCP
+#define DAEMON_TCP 1
+#endif
+
+// Number of pre-forked daemon workers, which take turns on shared
+// listeners and are replaced after DAEMON_WORKER_SESSIONS, 0 for the
+// acceptors of DAEMON_ACCEPTORS instead. Overridden by SUD_WORKERS at
+// runtime.
+#ifndef DAEMON_WORKERS
+#define DAEMON_WORKERS 0
+#endif
+
+// Sessions a worker serves before it is replaced, 0 for no limit.
+// Overridden by SUD_WORKER_SESSIONS at runtime.
+#ifndef DAEMON_WORKER_SESSIONS
+#define DAEMON_WORKER_SESSIONS 64
+#endif
+
+// Backlog of the listening sockets. Overridden by SUD_BACKLOG at runtime.
+#ifndef DAEMON_BACKLOG
+#define DAEMON_BACKLOG 128
+#endif
+
+// Acceptor processes serving the connections, each with its own
+// SO_REUSEPORT TCP listener; the Unix socket is shared as Linux only
+// balances TCP and UDP. Overridden by SUD_ACCEPTORS at runtime.
+#ifndef DAEMON_ACCEPTORS
+#define DAEMON_ACCEPTORS 1
+#endif
+#define DAEMON_MAX_ACCEPTORS 16
+
+// Connections an acceptor takes per wakeup, before forking their
+// handlers. Overridden by SUD_ACCEPT_BATCH at runtime.
+#ifndef DAEMON_ACCEPT_BATCH
+#define DAEMON_ACCEPT_BATCH 8
+#endif
+#define DAEMON_MAX_ACCEPT_BATCH 64
+
+// Requests an acceptor keeps running at once, whether it spawned the
+// command itself or forked a handler. At the cap it stops accepting
+// until one exits, leaving new connections in the backlog.
+// Overridden by SUD_MAX_HANDLERS at runtime.
+#ifndef DAEMON_MAX_HANDLERS
+#define DAEMON_MAX_HANDLERS 256
+#endif
+
+// Requests an acceptor receives at once, and how long, in ms, a client
+// has to send all of its request, counted from when the first part of
+// it didn't arrive in full. Acceptors receive requests without
+// blocking, and only spawn or fork for one once it is complete.
+// Overridden by SUD_MAX_HANDSHAKES and SUD_HANDSHAKE_TIMEOUT at runtime.
+#ifndef DAEMON_MAX_HANDSHAKES
+#define DAEMON_MAX_HANDSHAKES 64
+#endif
+
+#ifndef DAEMON_HANDSHAKE_TIMEOUT
+#define DAEMON_HANDSHAKE_TIMEOUT 1000
+#endif
+
+// Binary audit log of every request, "" to disable, and the number of
+// 256 byte records it keeps. Overridden by SUD_AUDIT and
+// SUD_AUDIT_RECORDS at runtime.
+#ifndef DAEMON_AUDIT
+#define DAEMON_AUDIT "/data/adb/sud.audit"
+#endif
+
+#ifndef DAEMON_AUDIT_RECORDS
+#define DAEMON_AUDIT_RECORDS 16384
+#endif
+
+// Shared counters of the daemon, read by su --daemon-stats, "" to
+// disable. Overridden by SUD_STATS at runtime, for both the daemon
+// and su --daemon-stats.
+#ifndef DAEMON_STATS
+#define DAEMON_STATS "/dev/sud.stats"
+#endif
+
+// How the daemon starts the command of a request: "vfork" execs it
+// straight from the handler, "fork" runs su_main() in a forked child.
+// Overridden by SUD_SPAWN at runtime.
+#ifndef DAEMON_SPAWN
+#define DAEMON_SPAWN "vfork"
+#endif
+
+// How acceptors and the PTY relay of the client wait for I/O: "epoll",
+// or "uring" for io_uring where the kernel has it, see uring.h.
+// Overridden by SUD_IO_ENGINE at runtime, for both the daemon and the
+// client.
+#ifndef DAEMON_IO_ENGINE
+#define DAEMON_IO_ENGINE "epoll"
+#endif
+
+// Whether simple commands like "cat FILE" or "echo 1 > FILE" run as
+// builtins instead of executing them, see builtin.h. Overridden by
+// SUD_BUILTINS at runtime.
+#ifndef DAEMON_BUILTINS
+#define DAEMON_BUILTINS 0
+#endif
+
+// Most commands of su --batch which run at once, 0 for the number of
+// CPUs. Overridden by SUD_BATCH_JOBS at runtime.
+#ifndef DAEMON_BATCH_JOBS
+#define DAEMON_BATCH_JOBS 0
+#endif
+
+// Whether the daemon remembers where commands are on PATH, watching
+// its directories for changes, see pathcache.h. Overridden by
+// SUD_PATH_CACHE at runtime.
+#ifndef DAEMON_PATH_CACHE
+#define DAEMON_PATH_CACHE 1
+#endif
+
+// When clients send their stdio over the socket instead of passing
+// FDs, see mux.h: 0 never, 1 over TCP, 2 always. Clients read
+// SUD_MUX at runtime.
+#ifndef DAEMON_MUX
+#define DAEMON_MUX 1
+#endif
+
+// Whether the client forks before running its request, for Samsung
+// kernels with CONFIG_SEC_RESTRICT_SETUID. Overridden by
+// SUD_SAMSUNG_FORK at runtime.
+#ifndef SAMSUNG_FORK
+#define SAMSUNG_FORK 0
+#endif
+
 #ifdef LOG_TAG
 #undef LOG_TAG
 #endif
@@ -64,7 +209,7 @@
 #define VERSION_CODE 16
 #endif
 
-#define PROTO_VERSION 1
+#define PROTO_VERSION 5
 
 struct su_initiator {
     pid_t pid;
@@ -85,6 +230,13 @@ struct su_request {
     char **argv;
     int argc;
     int optind;
+    // file of su --pull or su --push, see transfer.h
+    char *pull;
+    char *push;
+    // file of su --batch, "-" for stdin, and its options, see batch.h
+    char *batch;
+    int jobs;
+    int capture;
 };
 
 struct su_user_info {
@@ -115,8 +267,32 @@ static inline char *get_command(const struct su_request *to)
 
 int run_daemon();
 int connect_daemon(int argc, char *argv[], int ppid);
+int connect_daemon_session(int argc, char *argv[], int first_arg, int ppid, int status_fd);
+int connect_daemon_transfer(const char *option, const char *path, int ppid);
+int connect_daemon_stdio(const char *option, int argc, char *argv[], int ppid);
 int su_main(int argc, char *argv[], int need_client);
 
+// What su_main() would exec for a request, see su_prepare()
+struct su_exec {
+    char *binary;
+    // where binary is on PATH, or NULL, see pathcache.h
+    const char *path;
+    char **argv;
+    char **envp;
+    // envp belongs to the user cache of su.c rather than the struct
+    int cached_envp;
+    mode_t umask;
+    // login argv[0], owned by the struct
+    char *arg0;
+    // copy of the request's argv which argv points into, owned by the struct
+    char **args;
+};
+
+// Resolve argv like su_main() without running anything. Returns -1 when
+// the request needs su_main() itself, e.g. for options which only print.
+int su_prepare(int argc, char *argv[], struct su_exec *exec);
+void su_exec_free(struct su_exec *exec);
+
 #include <errno.h>
 #include <string.h>
 #define PLOGE(fmt,args...) LOGE(fmt " failed with %d: %s", ##args, errno, strerror(errno))
@@ -0,0 +1,69 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * trace.h
+ *
+ * Optional spans around the stages of a request, appended to the file
+ * named by SUD_TRACE in the Chrome trace event format, which loads in
+ * chrome://tracing and Perfetto. Client and daemon append to the same
+ * file with one write() per event, and tag every event with the request
+ * id carried in the handshake so the two sides line up. Without
+ * SUD_TRACE every call returns right away.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+struct trace_span {
+    const char *name;
+    // CLOCK_MONOTONIC start in us, 0 when tracing is off
+    long long start;
+};
+
+/**
+ * trace_request
+ *
+ * Set the request id events of this process are tagged with, which
+ * forked children inherit.
+ */
+void trace_request(uint64_t id);
+
+/**
+ * trace_new_request
+ *
+ * Make up a request id for a new request.
+ */
+uint64_t trace_new_request(void);
+
+/**
+ * trace_begin, trace_end
+ *
+ * Time "span" from trace_begin() to trace_end().
+ */
+void trace_begin(struct trace_span *span, const char *name);
+void trace_end(struct trace_span *span);
+
+/**
+ * trace_mark
+ *
+ * Record an instant event, e.g. right before exec.
+ */
+void trace_mark(const char *name);
+
+#endif
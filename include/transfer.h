@@ -0,0 +1,65 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * transfer.h
+ *
+ * su --pull and su --push, which copy a file as root between the
+ * daemon and the stdout or stdin the client passed, without a PTY or a
+ * shell in between. The data goes through sendfile() or splice() where
+ * the kernel supports it for the pair of files, so it never has to be
+ * copied through the daemon or the client.
+ */
+
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+/**
+ * transfer_copy
+ *
+ * Copy from "in" to "out" until EOF, with the cheapest of sendfile(),
+ * splice() and read()/write() which works for the two files. Either of
+ * them may be non-blocking.
+ *
+ * Return Value
+ * on failure, -1 and errno is set
+ * on success, 0
+ * Either way "bytes" is set to the amount copied.
+ */
+int transfer_copy(int in, int out, unsigned long long *bytes);
+
+/**
+ * transfer_pull
+ *
+ * Copy "path" to stdout and check that all of it made it.
+ *
+ * Return Value
+ * the exit code of su
+ */
+int transfer_pull(const char *path);
+
+/**
+ * transfer_push
+ *
+ * Copy stdin to "path", created if needed and truncated otherwise, and
+ * check that all of it made it to disk.
+ *
+ * Return Value
+ * the exit code of su
+ */
+int transfer_push(const char *path);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * uring.h
+ *
+ * Just enough of io_uring for the acceptors and the PTY relay, on the
+ * raw system calls as neither the NDK nor older hosts have liburing.
+ * Whether it is used at all is up to SUD_IO_ENGINE, see uring_wanted(),
+ * and every user falls back to its epoll loop when the kernel lacks
+ * io_uring, or an operation it needs, or SELinux denies it.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Newer than some of the headers this builds against
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+#ifndef IORING_POLL_ADD_MULTI
+#define IORING_POLL_ADD_MULTI   (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE       (1U << 1)
+#endif
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    // Tail of the SQEs handed out, published by uring_submit()
+    unsigned sqe_tail;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+/**
+ * uring_wanted
+ *
+ * Whether SUD_IO_ENGINE, or DAEMON_IO_ENGINE without it, asks for
+ * io_uring.
+ */
+int uring_wanted(void);
+
+/**
+ * uring_init
+ *
+ * Set up "ring" with room for "entries" SQEs, as long as the kernel
+ * supports every opcode in "ops", a list ending in -1.
+ *
+ * Return Value
+ * on failure, -1 and errno is set
+ * on success, 0
+ */
+int uring_init(struct uring *ring, unsigned entries, const int *ops);
+
+/**
+ * uring_destroy
+ *
+ * Unmap "ring" and close it, cancelling whatever is still in flight
+ * unless another process shares it.
+ */
+void uring_destroy(struct uring *ring);
+
+/**
+ * uring_register_buffers
+ *
+ * Register "count" buffers for IORING_OP_READ_FIXED and
+ * IORING_OP_WRITE_FIXED, by their index in "iov".
+ *
+ * Return Value
+ * on failure, -1 and errno is set
+ * on success, 0
+ */
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned count);
+
+/**
+ * uring_sqe
+ *
+ * Get a cleared SQE, queued by the next uring_submit().
+ *
+ * Return Value
+ * NULL when the submission queue is full
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+
+/**
+ * uring_submit
+ *
+ * Submit the queued SQEs and, with "wait", block until a CQE is ready
+ * unless one already is. Both in a single system call.
+ *
+ * Return Value
+ * on failure, -1 and errno is set
+ * on success, 0
+ */
+int uring_submit(struct uring *ring, int wait);
+
+/**
+ * uring_cqe, uring_cqe_seen
+ *
+ * The oldest CQE, or NULL when there is none, and let go of it once
+ * it was handled.
+ */
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif
@@ -27,4 +27,13 @@ extern char* read_file(const char *fn);
 extern int get_property(const char *data, char *found, const char *searchkey,
                         const char *not_found);
 extern int check_property(const char *data, const char *prefix);
+
+/* reads a non-negative int from the environment, def when unset or invalid */
+extern int env_int(const char *name, int def);
+
+/* writes all of buf, waiting for fd if it is non-blocking; -1 on error */
+extern int write_all(int fd, const char *buf, size_t len);
+
+/* the exit code of a wait() status, 128 plus the signal if one killed it */
+extern int exit_code(int status);
 #endif
@@ -0,0 +1,90 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * arena.c
+ *
+ * Per-session allocations of the daemon, see arena.h
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    // aligned for a pointer, as the header is a multiple of one
+    char data[];
+};
+
+void arena_init(struct arena *arena, size_t limit) {
+    arena->blocks = NULL;
+    arena->used = 0;
+    arena->limit = limit;
+}
+
+void *arena_alloc(struct arena *arena, size_t len) {
+    struct arena_block *block = arena->blocks;
+    size_t size;
+    void *ret;
+
+    len = ARENA_ALIGN(len);
+    if (len > arena->limit - arena->used)
+        return NULL;
+
+    if (block == NULL || block->size - block->used < len) {
+        // Twice the last block, but at least the allocation
+        size = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+        if (size < len)
+            size = len;
+        block = malloc(sizeof(*block) + size);
+        if (block == NULL)
+            return NULL;
+        block->next = arena->blocks;
+        block->size = size;
+        block->used = 0;
+        arena->blocks = block;
+    }
+
+    ret = block->data + block->used;
+    block->used += len;
+    arena->used += len;
+    return ret;
+}
+
+void arena_reset(struct arena *arena) {
+    struct arena_block *block;
+
+    // Only the oldest block is kept, unless a large request made it
+    while (arena->blocks && (arena->blocks->next || arena->blocks->size > ARENA_BLOCK_SIZE)) {
+        block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+    if (arena->blocks)
+        arena->blocks->used = 0;
+    arena->used = 0;
+}
+
+void arena_release(struct arena *arena) {
+    arena_reset(arena);
+    free(arena->blocks);
+    arena->blocks = NULL;
+}
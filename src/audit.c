@@ -0,0 +1,160 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * audit.c
+ *
+ * Writer side of the binary audit log, see audit.h
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "su.h"
+#include "proto.h"
+#include "audit.h"
+
+_Static_assert(sizeof(struct audit_header) == 64, "audit header layout");
+_Static_assert(sizeof(struct audit_record) == 256, "audit record layout");
+
+static struct audit_header *audit_log;
+static struct audit_record *audit_records;
+// Size of the ring, never taken from the mapping, which a writer of
+// the file could change under us
+static uint32_t audit_count;
+
+int audit_open(const char *path, int records) {
+    struct stat st;
+    size_t size;
+    int fd;
+
+    if (records <= 0)
+        return -1;
+    size = sizeof(struct audit_header) + sizeof(struct audit_record) * (size_t)records;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd == -1) {
+        PLOGE("open(%s)", path);
+        return -1;
+    }
+    if (fstat(fd, &st)) {
+        PLOGE("fstat(%s)", path);
+        close(fd);
+        return -1;
+    }
+    // Whoever else could read or write it, or made it for us to find,
+    // would see every request, or feed the daemon a log of their own
+    if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || st.st_nlink != 1 ||
+            (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        LOGE("refusing audit log %s, owned by %d with mode %o", path,
+                (int)st.st_uid, (unsigned int)(st.st_mode & 07777));
+        close(fd);
+        return -1;
+    }
+    if (st.st_size != (off_t)size && ftruncate(fd, size)) {
+        PLOGE("size %s", path);
+        close(fd);
+        return -1;
+    }
+
+    audit_log = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (audit_log == MAP_FAILED) {
+        PLOGE("mmap(%s)", path);
+        audit_log = NULL;
+        return -1;
+    }
+
+    // Start over unless this is a log in the very same layout
+    if (audit_log->magic != AUDIT_MAGIC ||
+        audit_log->version != AUDIT_VERSION ||
+        audit_log->record_size != sizeof(struct audit_record) ||
+        audit_log->records != (uint32_t)records) {
+        memset(audit_log, 0, size);
+        audit_log->magic = AUDIT_MAGIC;
+        audit_log->version = AUDIT_VERSION;
+        audit_log->record_size = sizeof(struct audit_record);
+        audit_log->records = records;
+        audit_log->next = 1;
+    }
+    audit_records = (struct audit_record *)(audit_log + 1);
+    audit_count = records;
+
+    LOGD("auditing to %s, %d records", path, records);
+    return 0;
+}
+
+void audit_begin(struct audit_record *rec, const struct handshake *hs) {
+    struct timespec now;
+    uint32_t hash = 2166136261u;
+    size_t off = 0;
+    int i;
+
+    memset(rec, 0, sizeof(*rec));
+    if (audit_log == NULL)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec->time_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    rec->pid = hs->pid;
+    rec->uid = hs->uid;
+    rec->ppid = hs->ppid;
+    rec->argc = hs->argc;
+
+    for (i = 0; i < hs->argc; i++) {
+        const char *p = hs->argv[i];
+
+        do {
+            hash = (hash ^ (unsigned char)*p) * 16777619u;
+        } while (*p++);
+
+        if (off + 1 < sizeof(rec->argv)) {
+            if (i > 0)
+                rec->argv[off++] = ' ';
+            size_t len = strnlen(hs->argv[i], sizeof(rec->argv) - off - 1);
+            memcpy(rec->argv + off, hs->argv[i], len);
+            off += len;
+        }
+    }
+    rec->argv_hash = hash;
+}
+
+void audit_commit(struct audit_record *rec, int code, long long duration_us) {
+    struct audit_record *slot;
+    uint64_t seq;
+
+    if (audit_log == NULL)
+        return;
+
+    rec->duration_us = duration_us;
+    rec->code = code;
+
+    seq = __atomic_fetch_add(&audit_log->next, 1, __ATOMIC_RELAXED);
+    slot = &audit_records[(seq - 1) % audit_count];
+
+    // Unpublish the old record while it is overwritten
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)slot + sizeof(slot->seq), (char *)rec + sizeof(rec->seq),
+            sizeof(*rec) - sizeof(rec->seq));
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,389 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * batch.c
+ *
+ * Parallel batches of commands, see batch.h
+ */
+
+#define _GNU_SOURCE /* for pipe2() */
+
+#include <sys/types.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "su.h"
+#include "utils.h"
+#include "batch.h"
+
+// Most commands which run at once, whatever SUD_BATCH_JOBS says
+#define BATCH_MAX_JOBS  256
+// Most output read from a command at once, and so put in one frame
+#define BATCH_CHUNK     65536
+
+struct batch_job {
+    // 0 while the slot is free
+    pid_t pid;
+    int line;
+    // read ends of the stdout and stderr pipes, -1 once closed
+    int fds[2];
+    int exited;
+    int status;
+    struct timespec start;
+    struct timespec end;
+};
+
+struct batch {
+    int out;
+    int capture;
+    const char *shell;
+    const char *arg0;
+    char *const *envp;
+    // stdin of the commands, and their stdout and stderr without capture
+    int devnull;
+    // signal mask the commands start with
+    sigset_t sigmask;
+    // a command didn't exit with 0, or a frame couldn't be written
+    int failed;
+    int broken;
+    char buf[BATCH_CHUNK];
+};
+
+static const char *const stream_names[] = { "out", "err" };
+
+/*
+ * Write a frame, its header from "fmt" and then "len" bytes of "data".
+ * Once the client is gone nothing more is written.
+ */
+static void emit(struct batch *b, const char *data, size_t len, const char *fmt, ...) {
+    char header[64];
+    va_list ap;
+    int n;
+
+    if (b->broken)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(header, sizeof(header), fmt, ap);
+    va_end(ap);
+    if (write_all(b->out, header, n) || write_all(b->out, data, len)) {
+        PLOGE("batch results");
+        b->broken = 1;
+        b->failed = 1;
+    }
+}
+
+static long elapsed_us(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000L +
+            (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void close_pipes(struct batch_job *job) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (job->fds[i] != -1)
+            close(job->fds[i]);
+        job->fds[i] = -1;
+    }
+}
+
+/*
+ * Pass on what there is to read from stream "i" of "job", closing it at
+ * EOF. Once the command exited "drain" reads until there is nothing
+ * more, as whatever still holds the pipe open may never close it.
+ */
+static void forward_output(struct batch *b, struct batch_job *job, int i, int drain) {
+    ssize_t len;
+
+    do {
+        len = read(job->fds[i], b->buf, sizeof(b->buf));
+        if (len > 0)
+            emit(b, b->buf, len, "%d %s %zd\n", job->line, stream_names[i], len);
+    } while (len > 0 || (len == -1 && errno == EINTR));
+
+    if (len == 0 || drain || errno != EAGAIN) {
+        close(job->fds[i]);
+        job->fds[i] = -1;
+    }
+}
+
+/*
+ * The vfork() child of start_job(), which execs the shell on "cmd".
+ */
+static __attribute__ ((noreturn)) void job_child(const struct batch *b, const char *cmd,
+        int out, int err) {
+    char *argv[] = { (char *)b->arg0, "-c", (char *)cmd, NULL };
+
+    signal(SIGPIPE, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &b->sigmask, NULL);
+    if (dup2(b->devnull, STDIN_FILENO) == -1 ||
+            dup2(out, STDOUT_FILENO) == -1 ||
+            dup2(err, STDERR_FILENO) == -1)
+        _exit(127);
+    execve(b->shell, argv, b->envp);
+    _exit(127);
+}
+
+/*
+ * Start "cmd" from line "line" in the free slot "job". A command which
+ * can't be started exits with 127 right away, like in a shell.
+ */
+static void start_job(struct batch *b, struct batch_job *job, int line, const char *cmd) {
+    int pipes[2][2] = { { -1, -1 }, { -1, -1 } };
+    pid_t pid;
+
+    job->line = line;
+    job->fds[0] = job->fds[1] = -1;
+    job->exited = 0;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    if (b->capture) {
+        if (pipe2(pipes[0], O_CLOEXEC) || pipe2(pipes[1], O_CLOEXEC)) {
+            PLOGE("pipe2");
+            goto err;
+        }
+    }
+
+    pid = vfork();
+    if (pid == 0) {
+        if (b->capture)
+            job_child(b, cmd, pipes[0][1], pipes[1][1]);
+        job_child(b, cmd, b->devnull, b->devnull);
+    }
+    if (pid == -1) {
+        PLOGE("vfork");
+        goto err;
+    }
+
+    job->pid = pid;
+    if (b->capture) {
+        close(pipes[0][1]);
+        close(pipes[1][1]);
+        job->fds[0] = pipes[0][0];
+        job->fds[1] = pipes[1][0];
+        fcntl(job->fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(job->fds[1], F_SETFL, O_NONBLOCK);
+    }
+    return;
+
+err:
+    if (pipes[0][0] != -1) {
+        close(pipes[0][0]);
+        close(pipes[0][1]);
+    }
+    if (pipes[1][0] != -1) {
+        close(pipes[1][0]);
+        close(pipes[1][1]);
+    }
+    b->failed = 1;
+    emit(b, NULL, 0, "%d exit 127 0\n", line);
+}
+
+/*
+ * Note the exit of every command which exited since the last call.
+ */
+static void reap_jobs(struct batch_job *jobs, int count) {
+    struct timespec now;
+    int status, i;
+    pid_t pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < count; i++) {
+            if (jobs[i].pid == pid) {
+                jobs[i].exited = 1;
+                jobs[i].status = status;
+                jobs[i].end = now;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Report "job" and free its slot, once it exited.
+ */
+static int finish_job(struct batch *b, struct batch_job *job) {
+    int i, code;
+
+    if (!job->exited)
+        return 0;
+    for (i = 0; i < 2; i++) {
+        if (job->fds[i] != -1)
+            forward_output(b, job, i, 1);
+    }
+
+    code = exit_code(job->status);
+    if (code)
+        b->failed = 1;
+    emit(b, NULL, 0, "%d exit %d %ld\n", job->line, code, elapsed_us(&job->start, &job->end));
+    job->pid = 0;
+    return 1;
+}
+
+/*
+ * The next command of the batch and its line number, or NULL at EOF.
+ */
+static char *next_command(FILE *file, char **line, size_t *size, int *lineno) {
+    ssize_t len;
+
+    while ((len = getline(line, size, file)) != -1) {
+        (*lineno)++;
+        if (len > 0 && (*line)[len - 1] == '\n')
+            (*line)[--len] = 0;
+        if (len > 0 && (*line)[0] != '#')
+            return *line;
+    }
+    return NULL;
+}
+
+int batch_run(int in, int out, int jobs, int capture, const char *shell, char *const envp[]) {
+    struct pollfd pfds[1 + 2 * BATCH_MAX_JOBS];
+    struct batch_job *slots[1 + 2 * BATCH_MAX_JOBS];
+    int streams[1 + 2 * BATCH_MAX_JOBS];
+    struct signalfd_siginfo si;
+    struct batch_job *table;
+    struct batch *b;
+    char *line = NULL, *cmd;
+    size_t size = 0;
+    int limit, sigfd = -1, running = 0, lineno = 0, eof = 0, nfds, i, j, ret = 1;
+    FILE *file = NULL;
+    sigset_t mask;
+
+    limit = env_int("SUD_BATCH_JOBS", DAEMON_BATCH_JOBS);
+    if (limit == 0)
+        limit = sysconf(_SC_NPROCESSORS_ONLN);
+    if (limit < 1)
+        limit = 1;
+    if (jobs <= 0 || jobs > limit)
+        jobs = limit;
+    if (jobs > BATCH_MAX_JOBS)
+        jobs = BATCH_MAX_JOBS;
+
+    b = calloc(1, sizeof(*b));
+    table = calloc(jobs, sizeof(*table));
+    if (b == NULL || table == NULL) {
+        LOGE("unable to allocate batch");
+        goto out;
+    }
+    for (i = 0; i < jobs; i++)
+        table[i].fds[0] = table[i].fds[1] = -1;
+    b->devnull = -1;
+    b->out = out;
+    b->capture = capture;
+    b->shell = shell;
+    b->arg0 = strrchr(shell, '/') ? strrchr(shell, '/') + 1 : shell;
+    b->envp = envp;
+
+    // A client which went away shows as EPIPE, to stop starting commands
+    signal(SIGPIPE, SIG_IGN);
+
+    // Exits arrive through a signalfd, to wait for them along with output
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &b->sigmask)) {
+        PLOGE("sigprocmask");
+        goto out;
+    }
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    b->devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    file = fdopen(dup(in), "r");
+    if (sigfd == -1 || b->devnull == -1 || file == NULL) {
+        PLOGE("batch setup");
+        goto out;
+    }
+    LOGD("running batch with %d jobs", jobs);
+
+    for (;;) {
+        // Fill the free slots, unless the client is gone
+        for (i = 0; i < jobs && !eof && !b->broken; i++) {
+            if (table[i].pid)
+                continue;
+            cmd = next_command(file, &line, &size, &lineno);
+            if (cmd == NULL) {
+                eof = 1;
+                break;
+            }
+            start_job(b, &table[i], lineno, cmd);
+            if (table[i].pid)
+                running++;
+        }
+        if (running == 0 && (eof || b->broken))
+            break;
+
+        nfds = 0;
+        pfds[nfds].fd = sigfd;
+        pfds[nfds++].events = POLLIN;
+        for (i = 0; i < jobs; i++) {
+            for (j = 0; j < 2 && table[i].pid; j++) {
+                if (table[i].fds[j] == -1)
+                    continue;
+                pfds[nfds].fd = table[i].fds[j];
+                pfds[nfds].events = POLLIN;
+                slots[nfds] = &table[i];
+                streams[nfds++] = j;
+            }
+        }
+        if (poll(pfds, nfds, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            PLOGE("poll");
+            break;
+        }
+
+        for (i = 1; i < nfds; i++) {
+            if (pfds[i].revents)
+                forward_output(b, slots[i], streams[i], 0);
+        }
+        if (pfds[0].revents) {
+            while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+            reap_jobs(table, jobs);
+        }
+        for (i = 0; i < jobs; i++) {
+            if (table[i].pid && finish_job(b, &table[i]))
+                running--;
+        }
+    }
+    ret = b->failed ? 1 : 0;
+
+out:
+    if (table) {
+        for (i = 0; i < jobs; i++)
+            close_pipes(&table[i]);
+    }
+    if (file)
+        fclose(file);
+    if (b && b->devnull != -1)
+        close(b->devnull);
+    if (sigfd != -1)
+        close(sigfd);
+    free(line);
+    free(table);
+    free(b);
+    return ret;
+}
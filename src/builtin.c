@@ -0,0 +1,485 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * builtin.c
+ *
+ * Builtin stand-ins for simple commands, see builtin.h
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+
+#include "su.h"
+#include "utils.h"
+#include "stats.h"
+#include "builtin.h"
+#include "transfer.h"
+
+#define SELINUX_MAGIC 0xf97cff8c
+
+// SUD_BUILTINS, see builtin_init()
+static int builtins_enabled = 0;
+
+struct builtin {
+    const char *name;
+    // 0 if the builtin handles these arguments
+    int (*check)(int argc, char **argv);
+    // Returns the exit code
+    int (*run)(int argc, char **argv, int out);
+    // 0 if output to a terminal is left to the command
+    int terminal;
+};
+
+/*
+ * Whether "path" is a file argument the builtins can take: not an
+ * option, and not about the process itself, which would be the
+ * daemon rather than the command.
+ */
+static int check_path(const char *path) {
+    if (path[0] == '-')
+        return -1;
+    if (!strncmp(path, "/proc/self", 10) || !strncmp(path, "/proc/thread-self", 17))
+        return -1;
+    return 0;
+}
+
+static int check_cat(int argc, char **argv) {
+    int i;
+
+    // Reading stdin is left to cat
+    if (argc < 2)
+        return -1;
+    for (i = 1; i < argc; i++) {
+        if (check_path(argv[i]))
+            return -1;
+    }
+    return 0;
+}
+
+static int run_cat(int argc, char **argv, int out) {
+    unsigned long long bytes;
+    int i, fd, ret = 0;
+
+    for (i = 1; i < argc; i++) {
+        fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || transfer_copy(fd, out, &bytes)) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            ret = 1;
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    return ret;
+}
+
+static int check_echo(int argc, char **argv) {
+    size_t len = 0;
+    int i;
+
+    // -n only, -e and -E are left to the shell
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n"))
+            return -1;
+    }
+    for (i = 1; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    return len < PATH_MAX ? 0 : -1;
+}
+
+static int run_echo(int argc, char **argv, int out) {
+    char buf[PATH_MAX + 1];
+    size_t len = 0, n;
+    int i = 1, newline = 1;
+
+    while (i < argc && !strcmp(argv[i], "-n")) {
+        newline = 0;
+        i++;
+    }
+    for (; i < argc; i++) {
+        n = strlen(argv[i]);
+        memcpy(buf + len, argv[i], n);
+        len += n;
+        if (i < argc - 1)
+            buf[len++] = ' ';
+    }
+    if (newline)
+        buf[len++] = '\n';
+
+    // One write, sysfs takes the value of each write on its own
+    if (write_all(out, buf, len)) {
+        fprintf(stderr, "echo: write error: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int check_id(int argc, char **argv) {
+    if (argc == 1)
+        return 0;
+    if (argc == 2 && (!strcmp(argv[1], "-u") || !strcmp(argv[1], "-g")))
+        return 0;
+    return -1;
+}
+
+static int append_id(char *buf, size_t size, const char *prefix, unsigned id,
+        const char *name) {
+    if (name)
+        return snprintf(buf, size, "%s%u(%s)", prefix, id, name);
+    return snprintf(buf, size, "%s%u", prefix, id);
+}
+
+static const char *user_name(uid_t uid) {
+    struct passwd *pw = getpwuid(uid);
+
+    return pw ? pw->pw_name : NULL;
+}
+
+static const char *group_name(gid_t gid) {
+    struct group *gr = getgrgid(gid);
+
+    return gr ? gr->gr_name : NULL;
+}
+
+/*
+ * Read the SELinux context of the process into "context", if SELinux
+ * is enabled like is_selinux_enabled() of libselinux has it: selinuxfs
+ * is mounted, and the context isn't the "kernel" one of a system which
+ * never loaded a policy. Other LSMs use the same file.
+ *
+ * Returns the length of the context, or 0 without one.
+ */
+static size_t selinux_context(char *context, size_t size) {
+    struct statfs sfs;
+    ssize_t len;
+    int fd;
+
+    if (statfs("/sys/fs/selinux", &sfs) || (uint32_t)sfs.f_type != SELINUX_MAGIC)
+        return 0;
+    fd = open("/proc/self/attr/current", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    len = read(fd, context, size - 1);
+    close(fd);
+    while (len > 0 && (context[len - 1] == '\0' || context[len - 1] == '\n'))
+        len--;
+    if (len <= 0)
+        return 0;
+    context[len] = '\0';
+    return strcmp(context, "kernel") ? (size_t)len : 0;
+}
+
+static int run_id(int argc, char **argv, int out) {
+    gid_t groups[64];
+    char buf[4096], context[200];
+    size_t len = 0;
+    int i, count;
+
+    if (argc == 2) {
+        len = snprintf(buf, sizeof(buf), "%u\n",
+                argv[1][1] == 'u' ? (unsigned)geteuid() : (unsigned)getegid());
+        return write_all(out, buf, len) ? 1 : 0;
+    }
+
+    // Leave room for the context and the newline
+#define ID_APPEND(...) do {                                             \
+        if (len < sizeof(buf) - 256)                                    \
+            len += append_id(buf + len, sizeof(buf) - 256 - len, __VA_ARGS__); \
+    } while (0)
+
+    ID_APPEND("uid=", geteuid(), user_name(geteuid()));
+    ID_APPEND(" gid=", getegid(), group_name(getegid()));
+    ID_APPEND(" groups=", getegid(), group_name(getegid()));
+    count = getgroups(sizeof(groups) / sizeof(groups[0]), groups);
+    for (i = 0; i < count; i++) {
+        if (groups[i] != getegid())
+            ID_APPEND(",", groups[i], group_name(groups[i]));
+    }
+#undef ID_APPEND
+    if (len > sizeof(buf) - 256)
+        len = sizeof(buf) - 256;
+
+    if (selinux_context(context, sizeof(context)))
+        len += snprintf(buf + len, sizeof(buf) - len, " context=%s", context);
+    buf[len++] = '\n';
+    return write_all(out, buf, len) ? 1 : 0;
+}
+
+static int check_ls(int argc, char **argv) {
+    return argc == 1 || (argc == 2 && check_path(argv[1]) == 0) ? 0 : -1;
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int run_ls(int argc, char **argv, int out) {
+    const char *path = argc == 2 ? argv[1] : ".";
+    char **names = NULL, **grown;
+    size_t count = 0, size = 0, i;
+    struct dirent *de;
+    struct stat st;
+    int ret = 0;
+    DIR *dir;
+
+    if (stat(path, &st)) {
+        fprintf(stderr, "ls: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        char buf[PATH_MAX + 1];
+        int len = snprintf(buf, sizeof(buf), "%s\n", path);
+        return write_all(out, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1) ? 1 : 0;
+    }
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "ls: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            grown = realloc(names, sizeof(char *) * size);
+            if (grown == NULL)
+                goto nomem;
+            names = grown;
+        }
+        names[count] = strdup(de->d_name);
+        if (names[count] == NULL)
+            goto nomem;
+        count++;
+    }
+    closedir(dir);
+    dir = NULL;
+
+    qsort(names, count, sizeof(char *), cmp_name);
+    for (i = 0; i < count && ret == 0; i++) {
+        size_t len = strlen(names[i]);
+        names[i][len] = '\n';
+        if (write_all(out, names[i], len + 1))
+            ret = 1;
+    }
+    goto out;
+
+nomem:
+    fprintf(stderr, "ls: %s\n", strerror(ENOMEM));
+    ret = 1;
+out:
+    if (dir)
+        closedir(dir);
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+#ifdef __ANDROID__
+static int check_getprop(int argc, char **argv) {
+    return argc == 2 && argv[1][0] != '-' ? 0 : -1;
+}
+
+static int run_getprop(int argc, char **argv, int out) {
+    char value[PROP_VALUE_MAX + 1];
+    int len;
+
+    (void)argc;
+    len = __system_property_get(argv[1], value);
+    value[len++] = '\n';
+    return write_all(out, value, len) ? 1 : 0;
+}
+#endif
+
+static const struct builtin builtins[] = {
+    { "cat",     check_cat,     run_cat,     1 },
+    { "echo",    check_echo,    run_echo,    1 },
+    { "id",      check_id,      run_id,      1 },
+    // Columns only matter on a terminal, which ls can take care of
+    { "ls",      check_ls,      run_ls,      0 },
+#ifdef __ANDROID__
+    { "getprop", check_getprop, run_getprop, 1 },
+#endif
+};
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+}
+
+/*
+ * Whether "path" names one of the system commands the builtins stand
+ * in for, rather than a binary of its own.
+ */
+static int system_command(const char *path) {
+    return strchr(path, '/') == NULL ||
+        !strncmp(path, "/system/bin/", 12) ||
+        !strncmp(path, "/system/xbin/", 13);
+}
+
+static int safe_char(char c) {
+    return isalnum((unsigned char)c) || (c && strchr("/._-+,:@%=", c));
+}
+
+/*
+ * Split a "sh -c" command line into call->argv, as long as none of it
+ * needs the shell: no quoting, expansion, globbing, or operators other
+ * than a trailing "> FILE" or ">> FILE".
+ */
+static int split_line(const char *cmd, struct builtin_call *call) {
+    size_t len = strlen(cmd);
+    int target = 0;
+    char *p, *word;
+
+    if (len >= sizeof(call->line))
+        return -1;
+    memcpy(call->line, cmd, len + 1);
+
+    p = call->line;
+    while (*p) {
+        if (*p == ' ' || *p == '\t') {
+            *p++ = '\0';
+            continue;
+        }
+        if (*p == '>') {
+            if (call->redirect || target)
+                return -1;
+            if (*++p == '>') {
+                call->append = 1;
+                p++;
+            }
+            target = 1;
+            continue;
+        }
+
+        word = p;
+        while (safe_char(*p))
+            p++;
+        if (*p && *p != ' ' && *p != '\t')
+            return -1;
+
+        if (target) {
+            call->redirect = word;
+            target = 0;
+        } else if (call->redirect || call->argc == BUILTIN_MAX_ARGS) {
+            return -1;
+        } else {
+            call->argv[call->argc++] = word;
+        }
+    }
+    return target ? -1 : 0;
+}
+
+void builtin_init(void) {
+    builtins_enabled = env_int("SUD_BUILTINS", DAEMON_BUILTINS);
+}
+
+int builtin_match(const char *binary, char *const argv[], struct builtin_call *call) {
+    const char *name = binary;
+    size_t i;
+
+    if (!builtins_enabled)
+        return -1;
+
+    call->builtin = NULL;
+    call->argc = 0;
+    call->redirect = NULL;
+    call->append = 0;
+
+    if (system_command(binary) && !strcmp(base_name(binary), "sh") &&
+            argv[1] && !strcmp(argv[1], "-c") && argv[2]) {
+        if (split_line(argv[2], call) || call->argc == 0)
+            goto miss;
+        name = call->argv[0];
+    } else {
+        while (argv[call->argc]) {
+            if (call->argc == BUILTIN_MAX_ARGS)
+                goto miss;
+            call->argv[call->argc] = argv[call->argc];
+            call->argc++;
+        }
+    }
+    call->argv[call->argc] = NULL;
+    if (call->argc == 0 || !system_command(name))
+        goto miss;
+
+    // argv[0] may be a login "-name", go by the binary
+    for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (!strcmp(base_name(name), builtins[i].name)) {
+            call->builtin = &builtins[i];
+            break;
+        }
+    }
+    if (call->builtin && call->builtin->check(call->argc, call->argv) == 0)
+        return 0;
+
+miss:
+    STATS_INC(builtin_misses);
+    return -1;
+}
+
+int builtin_run(struct builtin_call *call) {
+    int out = STDOUT_FILENO, ret;
+    struct stat st;
+
+    // Truncated only once the builtin is sure to run, the command
+    // executed instead opens it again
+    if (call->redirect) {
+        out = open(call->redirect, O_WRONLY | O_CREAT | O_CLOEXEC |
+                (call->append ? O_APPEND : 0), 0666);
+        if (out == -1) {
+            fprintf(stderr, "sh: can't create %s: %s\n", call->redirect, strerror(errno));
+            STATS_INC(builtin_hits);
+            return 1;
+        }
+    }
+
+    if (!call->builtin->terminal && isatty(out)) {
+        if (out != STDOUT_FILENO)
+            close(out);
+        STATS_INC(builtin_misses);
+        return -1;
+    }
+    if (out != STDOUT_FILENO && !call->append &&
+            fstat(out, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(out, 0)) {
+        fprintf(stderr, "sh: can't create %s: %s\n", call->redirect, strerror(errno));
+        close(out);
+        STATS_INC(builtin_hits);
+        return 1;
+    }
+
+    ret = call->builtin->run(call->argc, call->argv, out);
+    if (out != STDOUT_FILENO)
+        close(out);
+    STATS_INC(builtin_hits);
+    return ret;
+}
@@ -42,129 +42,40 @@
 #include <signal.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <stddef.h>
+#include <netinet/tcp.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include "su.h"
 #include "utils.h"
 #include "pts.h"
+#include "proto.h"
+#include "audit.h"
+#include "trace.h"
+#include "stats.h"
+#include "builtin.h"
+#include "pathcache.h"
+#include "uring.h"
+#include "mux.h"
 
 int is_daemon = 0;
 int daemon_from_uid = 0;
 int daemon_from_pid = 0;
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
 // Constants for the atty bitfield
 #define ATTY_IN     1
 #define ATTY_OUT    2
 #define ATTY_ERR    4
 
-/*
- * Receive a file descriptor from a Unix socket.
- * Contributed by @mkasick
- *
- * Returns the file descriptor on success, or -1 if a file
- * descriptor was not actually included in the message
- *
- * On error the function terminates by calling exit(-1)
- */
-static int recv_fd(int sockfd) {
-    // Need to receive data from the message, otherwise don't care about it.
-    char iovbuf;
-
-    struct iovec iov = {
-        .iov_base = &iovbuf,
-        .iov_len  = 1,
-    };
-
-    char cmsgbuf[CMSG_SPACE(sizeof(int))];
-
-    struct msghdr msg = {
-        .msg_iov        = &iov,
-        .msg_iovlen     = 1,
-        .msg_control    = cmsgbuf,
-        .msg_controllen = sizeof(cmsgbuf),
-    };
-
-    if (recvmsg(sockfd, &msg, MSG_WAITALL) != 1) {
-        goto error;
-    }
-
-    // Was a control message actually sent?
-    switch (msg.msg_controllen) {
-    case 0:
-        // No, so the file descriptor was closed and won't be used.
-        return -1;
-    case sizeof(cmsgbuf):
-        // Yes, grab the file descriptor from it.
-        break;
-    default:
-        goto error;
-    }
-
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-
-    if (cmsg             == NULL                  ||
-        cmsg->cmsg_len   != CMSG_LEN(sizeof(int)) ||
-        cmsg->cmsg_level != SOL_SOCKET            ||
-        cmsg->cmsg_type  != SCM_RIGHTS) {
-error:
-        LOGE("unable to read fd");
-        exit(-1);
-    }
-
-    return *(int *)CMSG_DATA(cmsg);
-}
-
-/*
- * Send a file descriptor through a Unix socket.
- * Contributed by @mkasick
- *
- * On error the function terminates by calling exit(-1)
- *
- * fd may be -1, in which case the dummy data is sent,
- * but no control message with the FD is sent.
- */
-static void send_fd(int sockfd, int fd) {
-    // Need to send some data in the message, this will do.
-    struct iovec iov = {
-        .iov_base = "",
-        .iov_len  = 1,
-    };
-
-    struct msghdr msg = {
-        .msg_iov        = &iov,
-        .msg_iovlen     = 1,
-    };
-
-    char cmsgbuf[CMSG_SPACE(sizeof(int))];
-
-    if (fd != -1) {
-        // Is the file descriptor actually open?
-        if (fcntl(fd, F_GETFD) == -1) {
-            if (errno != EBADF) {
-                goto error;
-            }
-            // It's closed, don't send a control message or sendmsg will EBADF.
-        } else {
-            // It's open, send the file descriptor in a control message.
-            msg.msg_control    = cmsgbuf;
-            msg.msg_controllen = sizeof(cmsgbuf);
-
-            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-
-            cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
-            cmsg->cmsg_level = SOL_SOCKET;
-            cmsg->cmsg_type  = SCM_RIGHTS;
-
-            *(int *)CMSG_DATA(cmsg) = fd;
-        }
-    }
-
-    if (sendmsg(sockfd, &msg, 0) != 1) {
-error:
-        PLOGE("unable to send fd");
-        exit(-1);
-    }
-}
-
 static int read_int(int fd) {
     int val;
     int len = read(fd, &val, sizeof(int));
@@ -179,41 +90,15 @@ static void write_int(int fd, int val) {
     int written = write(fd, &val, sizeof(int));
     if (written != sizeof(int)) {
         PLOGE("unable to write int");
-        exit(-1);
-    }
-}
-
-static char* read_string(int fd) {
-    int len = read_int(fd);
-    if (len > PATH_MAX || len < 0) {
-        LOGE("invalid string length %d", len);
-        exit(-1);
-    }
-    char* val = malloc(sizeof(char) * (len + 1));
-    if (val == NULL) {
-        LOGE("unable to malloc string");
-        exit(-1);
-    }
-    val[len] = '\0';
-    int amount = read(fd, val, len);
-    if (amount != len) {
-        LOGE("unable to read string");
-        exit(-1);
-    }
-    return val;
-}
-
-static void write_string(int fd, char* val) {
-    int len = strlen(val);
-    write_int(fd, len);
-    int written = write(fd, val, len);
-    if (written != len) {
-        PLOGE("unable to write string");
+        STATS_INC(request_failures);
         exit(-1);
     }
 }
 
 static int run_daemon_child(int infd, int outfd, int errfd, int argc, char** argv) {
+    struct trace_span span;
+
+    trace_begin(&span, "run_daemon_child");
     if (-1 == dup2(outfd, STDOUT_FILENO)) {
         PLOGE("dup2 child outfd");
         exit(-1);
@@ -232,26 +117,208 @@ static int run_daemon_child(int infd, int outfd, int errfd, int argc, char** arg
     close(infd);
     close(outfd);
     close(errfd);
+    trace_end(&span);
 
     return su_main(argc, argv, 0);
 }
 
-static int daemon_accept(int fd) {
-    is_daemon = 1;
-    int pid = read_int(fd);
-    LOGD("remote pid: %d", pid);
-    char *pts_slave = read_string(fd);
-    LOGD("remote pts_slave: %s", pts_slave);
-    daemon_from_uid = read_int(fd);
+/*
+ * Whether requests are started with spawn_request() rather than a
+ * forked su_main(), see DAEMON_SPAWN.
+ */
+static int spawn_with_vfork(void) {
+    const char *mode = getenv("SUD_SPAWN");
+
+    if (mode == NULL || !*mode)
+        mode = DAEMON_SPAWN;
+    return strcmp(mode, "vfork") == 0;
+}
+
+/*
+ * The vfork() child of spawn_request(): does what the forked handler
+ * does before su_main(), then execs. Only touches its own frame.
+ */
+static __attribute__ ((noreturn)) void spawn_child(int fd, const struct handshake *hs,
+        const struct su_exec *exec, struct builtin_call *call) {
+    int infd  = hs->fds[0];
+    int outfd = hs->fds[1];
+    int errfd = hs->fds[2];
+
+    close(fd);
+    setsid();
+
+    if (hs->pts_slave[0]) {
+        int ptsfd = open(hs->pts_slave, O_RDWR);
+        if (ptsfd == -1)
+            _exit(-1);
+        if (infd < 0)  infd  = ptsfd;
+        if (outfd < 0) outfd = ptsfd;
+        if (errfd < 0) errfd = ptsfd;
+    } else if (isatty(infd)) {
+        ioctl(infd, TIOCSCTTY, 1);
+    }
+
+    if (dup2(outfd, STDOUT_FILENO) == -1 ||
+        dup2(errfd, STDERR_FILENO) == -1 ||
+        dup2(infd, STDIN_FILENO) == -1)
+        _exit(-1);
+    if (infd > STDERR_FILENO)  close(infd);
+    if (outfd > STDERR_FILENO && outfd != infd) close(outfd);
+    if (errfd > STDERR_FILENO && errfd != infd && errfd != outfd) close(errfd);
+
+    umask(exec->umask);
+    if (call) {
+        int code = builtin_run(call);
+        if (code >= 0)
+            _exit(code);
+    }
+    // execvpe() knows best why the cached path didn't work out
+    if (exec->path)
+        execve(exec->path, exec->argv, exec->envp);
+    execvpe(exec->binary, exec->argv, exec->envp);
+
+    char buf[PATH_MAX + 64];
+    int len = snprintf(buf, sizeof(buf), "Cannot execute %s: %s\n",
+            exec->binary, strerror(errno));
+    if (len > 0)
+        write(STDERR_FILENO, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * Start the command resolved by su_prepare() with a single vfork()
+ * and exec, instead of forking a handler which then runs su_main().
+ * Builtins run in a forked child instead, as vfork() only allows the
+ * exec, and the caller may not wait for them.
+ *
+ * The vfork() child can't trace, but the parent is suspended until it
+ * execs, so the "spawn" span covers what setsid, pts_open and
+ * run_daemon_child do in a handler, and ends at the exec.
+ *
+ * Returns the pid of the child, or -1 if vfork() failed.
+ */
+static int spawn_request(int fd, const struct handshake *hs, const struct su_exec *exec) {
+    struct builtin_call call;
+    struct trace_span span;
+    struct timespec start, end;
+    int child, builtin;
+
+    trace_begin(&span, "spawn");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    builtin = builtin_match(exec->binary, exec->argv, &call) == 0;
+    if (builtin) {
+        child = fork();
+        if (child == 0)
+            spawn_child(fd, hs, exec, &call);
+    } else {
+        child = vfork();
+        if (child == 0)
+            spawn_child(fd, hs, exec, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    trace_end(&span);
+    if (child > 0 && !builtin)
+        trace_mark("exec");
+    if (child > 0) {
+        LOGD("spawned %s as %d in %ld us", exec->binary, child,
+                (end.tv_sec - start.tv_sec) * 1000000L +
+                (end.tv_nsec - start.tv_nsec) / 1000);
+    }
+    return child;
+}
+
+/*
+ * Log the request in "hs", and start its audit record and counters.
+ */
+static void request_begin(const struct handshake *hs, struct audit_record *audit) {
+    LOGD("remote pid: %d", hs->pid);
+    LOGD("remote pts_slave: %s", hs->pts_slave);
+    daemon_from_uid = hs->uid;
     LOGD("remote uid: %d", daemon_from_uid);
-    daemon_from_pid = read_int(fd);
+    daemon_from_pid = hs->ppid;
     LOGD("remote req pid: %d", daemon_from_pid);
+    LOGD("remote args: %d", hs->argc);
+
+    audit_begin(audit, hs);
+
+    if (daemon_stats) {
+        size_t size = sizeof(struct handshake_header) + strlen(hs->pts_slave) + 1;
+        int i;
+        for (i = 0; i < hs->argc; i++)
+            size += strlen(hs->argv[i]) + 1;
+        STATS_ADD(bytes_in, size);
+        STATS_ADD(bytes_out, 2 * sizeof(int));
+    }
+}
+
+static long long elapsed_us(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL +
+            (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Send the exit code of a request started at "start" back to the
+ * client, unless "fd" is -1 as it went out in a frame already, and
+ * account for it.
+ */
+// How long a client has to send all of its request, or the count of
+// its relay after the exit code, see DAEMON_HANDSHAKE_TIMEOUT
+static int handshake_timeout = DAEMON_HANDSHAKE_TIMEOUT;
+
+static void request_finish(int fd, int code, struct audit_record *audit,
+        const struct timespec *start) {
+    long long duration_us = elapsed_us(start);
+
+    LOGD("sending code");
+    if (fd != -1 && send(fd, &code, sizeof(int), MSG_NOSIGNAL) != sizeof(int)) {
+        PLOGE("unable to write exit code");
+    }
+    audit_commit(audit, code, duration_us);
+    stats_request(code, duration_us);
+}
+
+/*
+ * Count the bytes which the PTY relay of a client flagged
+ * HANDSHAKE_RELAY moved, sent after the exit code, waiting up to
+ * "timeout" ms for them.
+ *
+ * Return Value
+ * 0 if they haven't arrived yet
+ * 1 once they did, or the client hung up without them
+ */
+static int relay_count(int fd, int timeout) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t bytes;
+
+    if (poll(&pfd, 1, timeout) == 0)
+        return 0;
+    if (recv(fd, &bytes, sizeof(bytes), MSG_DONTWAIT) == sizeof(bytes))
+        STATS_ADD(relay_bytes, bytes);
+    return 1;
+}
+
+/*
+ * Serve a single request: ack it, start the child which runs the command
+ * and send its exit code back. Only returns in the parent.
+ */
+static int daemon_request(int fd, struct handshake *hs) {
+    struct trace_span request_span, span;
+    struct timespec start;
+    trace_begin(&request_span, "request");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *pts_slave = hs->pts_slave;
 
     struct ucred credentials;
     int ucred_length = sizeof(struct ucred);
     /* fill in the user data structure */
     if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, (unsigned int *)&ucred_length)) {
         LOGE("could obtain credentials from unix domain socket");
+        STATS_INC(request_failures);
         exit(-1);
     }
     // if the credentials on the other side of the wire are NOT root,
@@ -264,36 +331,73 @@ static int daemon_accept(int fd) {
     }
 */
 
-    // The the FDs for each of the streams
-    int infd  = recv_fd(fd);
-    int outfd = recv_fd(fd);
-    int errfd = recv_fd(fd);
-
-    int argc = read_int(fd);
-    if (argc < 0 || argc > 512) {
-        LOGE("unable to allocate args: %d", argc);
-        exit(-1);
-    }
-    LOGD("remote args: %d", argc);
-    char** argv = (char**)malloc(sizeof(char*) * (argc + 1));
-    argv[argc] = NULL;
-    int i;
-    for (i = 0; i < argc; i++) {
-        argv[i] = read_string(fd);
+    // Stdio sent over the socket goes through pipes or a PTY of our
+    // own, relayed by mux_serve() while the command runs
+    struct mux_stdio mux;
+    int muxed = hs->flags & HANDSHAKE_MUX;
+    if (muxed) {
+        int i;
+        for (i = 0; i < 3; i++) {
+            if (hs->fds[i] >= 0) close(hs->fds[i]);
+        }
+        if (mux_stdio_open(&mux, hs->flags & HANDSHAKE_PTY)) {
+            PLOGE("mux stdio");
+            STATS_INC(request_failures);
+            exit(-1);
+        }
+        memcpy(hs->fds, mux.child, sizeof(hs->fds));
+        hs->pts_slave = pts_slave = mux.pts_slave;
     }
 
+    int infd  = hs->fds[0];
+    int outfd = hs->fds[1];
+    int errfd = hs->fds[2];
+
+    int argc = hs->argc;
+    char** argv = hs->argv;
+
+    struct audit_record audit;
+    request_begin(hs, &audit);
+
     // ack
     write_int(fd, 1);
 
-    // Fork the child process. The fork has to happen before calling
-    // setsid() and opening the pseudo-terminal so that the parent
-    // is not affected
-    int child = fork();
+    // Requests which end up in an exec are spawned directly, anything
+    // else still needs su_main() in a forked child. That one inherits
+    // where su_prepare() found the command, see pathcache.h.
+    struct su_exec exec;
+    int child, prepared;
+    trace_begin(&span, "su_prepare");
+    prepared = su_prepare(argc, argv, &exec) == 0;
+    trace_end(&span);
+    if (prepared && spawn_with_vfork()) {
+        child = spawn_request(fd, hs, &exec);
+        su_exec_free(&exec);
+    } else {
+        if (prepared)
+            su_exec_free(&exec);
+        // Fork the child process. The fork has to happen before calling
+        // setsid() and opening the pseudo-terminal so that the parent
+        // is not affected
+        trace_begin(&span, "fork");
+        child = fork();
+        if (child != 0)
+            trace_end(&span);
+    }
     if (child < 0) {
         // fork failed, send a return code and bail out
         PLOGE("unable to fork");
+        STATS_INC(fork_failures);
+        if (infd >= 0)  close(infd);
+        if (outfd >= 0) close(outfd);
+        if (errfd >= 0) close(errfd);
+        if (muxed) {
+            mux_stdio_close(mux.relay);
+            if (mux.slave != -1) close(mux.slave);
+        }
+        handshake_free(hs);
         write(fd, &child, sizeof(int));
-        close(fd);
+        audit_commit(&audit, child, elapsed_us(&start));
         return child;
     }
 
@@ -302,23 +406,30 @@ static int daemon_accept(int fd) {
         // across the wire.
         int status, code;
 
-        free(pts_slave);
+        if (infd >= 0)  close(infd);
+        if (outfd >= 0) close(outfd);
+        if (errfd >= 0) close(errfd);
+        handshake_free(hs);
 
         LOGD("waiting for child exit");
-        if (waitpid(child, &status, 0) > 0) {
-            code = WEXITSTATUS(status);
+        su_log_flush();
+        trace_begin(&span, muxed ? "mux" : "wait");
+        if (muxed) {
+            code = mux_serve(fd, &mux, child);
+        }
+        else if (waitpid(child, &status, 0) > 0) {
+            code = exit_code(status);
         }
         else {
             code = -1;
         }
+        trace_end(&span);
 
-        // Pass the return code back to the client
-        LOGD("sending code");
-        if (write(fd, &code, sizeof(int)) != sizeof(int)) {
-            PLOGE("unable to write exit code");
-        }
+        // Pass the return code back to the client, which got it in a
+        // frame already when muxed
+        request_finish(muxed ? -1 : fd, code, &audit, &start);
+        trace_end(&request_span);
 
-        close(fd);
         LOGD("child exited");
         return code;
     }
@@ -326,14 +437,21 @@ static int daemon_accept(int fd) {
     // We are in the child now
     // Close the unix socket file descriptor
     close (fd);
+    if (muxed) {
+        mux_stdio_close(mux.relay);
+        if (mux.slave != -1) close(mux.slave);
+    }
 
     // Become session leader
+    trace_begin(&span, "setsid");
     if (setsid() == (pid_t) -1) {
         PLOGE("setsid");
     }
+    trace_end(&span);
 
     int ptsfd;
     if (pts_slave[0]) {
+        trace_begin(&span, "pts_open");
         // Opening the TTY has to occur after the
         // fork() and setsid() so that it becomes
         // our controlling TTY and not the daemon's
@@ -355,15 +473,68 @@ static int daemon_accept(int fd) {
             LOGD("daemon: stderr using PTY");
             errfd = ptsfd;
         }
+        trace_end(&span);
     } else {
         // If a TTY was sent directly, make it the CTTY.
         if (isatty(infd)) {
             ioctl(infd, TIOCSCTTY, 1);
         }
     }
-    free(pts_slave);
 
-    return run_daemon_child(infd, outfd, errfd, argc, argv);
+    // Never return into the session loop of the handler
+    exit(run_daemon_child(infd, outfd, errfd, argc, argv));
+}
+
+/*
+ * Tag what follows with the id of the request in "hs", making one up
+ * for clients which predate request ids.
+ */
+static void daemon_trace_request(struct handshake *hs) {
+    if (hs->request_id == 0)
+        hs->request_id = trace_new_request();
+    trace_request(hs->request_id);
+}
+
+/*
+ * Serve the request received in "hs" and, for a persistent session,
+ * every one which follows it into the same arena, which goes away
+ * with the session. Returns the exit code of the last one.
+ */
+static int daemon_serve(int fd, struct handshake *hs) {
+    struct trace_span span;
+    int ret, code;
+
+    code = daemon_request(fd, hs);
+    if (hs->flags & HANDSHAKE_RELAY)
+        relay_count(fd, handshake_timeout);
+
+    // A persistent session keeps sending requests until it hangs up
+    while (hs->flags & HANDSHAKE_SESSION) {
+        trace_begin(&span, "handshake");
+        ret = handshake_recv(fd, hs, hs->arena);
+        if (ret == 1)
+            break;
+        if (ret) {
+            STATS_INC(handshake_failures);
+            code = -1;
+            break;
+        }
+        daemon_trace_request(hs);
+        trace_end(&span);
+        code = daemon_request(fd, hs);
+    }
+
+    close(fd);
+    arena_release(hs->arena);
+    STATS_ADD(active_sessions, -1);
+    return code;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
 void redirectStd(int old_fd) {
@@ -391,144 +562,1498 @@ static void move_cgroup(int dpid) {
     close(fd);
 }
 
-int run_daemon() {
-    int fd;
-    struct sockaddr_in sun;
+/*
+ * Name of the daemon Unix socket: "@name" in the abstract namespace,
+ * or a filesystem path. Empty when the Unix socket is disabled.
+ */
+static const char *daemon_socket_name(void) {
+    const char *name = getenv("SUD_SOCKET");
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        PLOGE("socket");
-        return -1;
+    return name ? name : DAEMON_SOCKET;
+}
+
+/*
+ * Fill in the Unix socket address for "name", see daemon_socket_name().
+ *
+ * Returns the length of the address, or 0 if the name doesn't fit.
+ */
+static socklen_t unix_address(const char *name, struct sockaddr_un *addr) {
+    size_t len = strlen(name);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (len >= sizeof(addr->sun_path))
+        return 0;
+
+    memcpy(addr->sun_path, name, len);
+    if (name[0] == '@') {
+        // Abstract names are not NUL terminated
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
     }
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+// Unix listener, shared by every acceptor
+static int unix_fd = -1;
+// TCP listeners, one per acceptor bound with SO_REUSEPORT so that the
+// kernel spreads connections across them
+static int tcp_fds[DAEMON_MAX_ACCEPTORS];
+static int tcp_count = 0;
+
+// Sockets this process accepts connections on, see use_acceptor()
+static int listen_fds[2];
+static int listen_count = 0;
+
+// Connections taken per wakeup, and those not handed out yet
+static int accept_batch = 1;
+static int pending[DAEMON_MAX_ACCEPT_BATCH];
+static int pending_count = 0, pending_next = 0;
+
+// A process an acceptor waits for: a forked handler, which sends the
+// exit code of its request itself, or the command of a request the
+// acceptor served itself, whose exit code goes to "client"
+struct child {
+    pid_t pid;
+    int pidfd;
+    int client;
+    // the client sends the count of its relay after the exit code, and
+    // has until "deadline", in CLOCK_MONOTONIC ms, to do so
+    int relay;
+    long long deadline;
+    uint64_t request_id;
+    struct timespec start;
+    struct trace_span request_span;
+    struct trace_span wait_span;
+    struct audit_record audit;
+};
+
+// Children of this acceptor which haven't been reaped yet, or whose
+// client still has to send the count of its relay, up to max_children
+// of them. Free slots have a pid and a deadline of 0.
+static struct child *children;
+static int max_children = DAEMON_MAX_HANDLERS, child_count = 0;
+
+// Children are watched through pidfds, which need Linux 5.3. Before
+// that SIGCHLD is blocked and read from child_sigfd instead, and every
+// request goes to a handler.
+static int use_pidfd = 0;
+static int child_sigfd = -1;
+
+// Children a pidfd couldn't be opened for, which are polled on the
+// handshake timer every UNWATCHED_POLL_MS instead
+static int unwatched_children = 0;
+#define UNWATCHED_POLL_MS 100
+
+// epoll set of the listeners of this process and of its children, and
+// whether the listeners are armed in it
+static int epoll_fd = -1;
+static int listening = 0;
+
+// io_uring engine of an acceptor, see SUD_IO_ENGINE: a multishot
+// accept for each listener, tagged with its index and the generation
+// it was armed in, and a multishot poll of epoll_fd for the children
+// and handshakes
+static struct uring ring = { .fd = -1 };
+static int use_ring = 0;
+static int ring_accepting[2], ring_generation[2];
+static int ring_watching = 0;
+#define RING_CHILDREN   (~0ULL)
+#define RING_CANCEL     (~1ULL)
+
+// A connection of an acceptor whose request is still arriving, which
+// has until "deadline", in CLOCK_MONOTONIC ms, to send the rest. The
+// deadline is 0 until it has to wait, and free slots have a client
+// of -1.
+struct handshake_slot {
+    int client;
+    long long deadline;
+    struct trace_span span;
+    struct handshake_reader reader;
+    // reset for each request, a forked handler takes it along for the
+    // rest of its session
+    struct arena arena;
+};
+
+// Requests this acceptor is receiving, up to max_handshakes of them,
+// and a timerfd in the epoll set armed for the earliest deadline, or
+// the next poll of the unwatched children
+static struct handshake_slot *handshakes;
+static int max_handshakes = DAEMON_MAX_HANDSHAKES, handshake_count = 0;
+static int handshake_timerfd = -1;
+static long long handshake_timer_deadline = 0;
+
+static int daemon_listen(int fd, const struct sockaddr *addr, socklen_t len) {
     if (fcntl(fd, F_SETFD, FD_CLOEXEC)) {
         PLOGE("fcntl FD_CLOEXEC");
         goto err;
     }
 
-    sun.sin_family = AF_INET;
-    sun.sin_addr.s_addr = INADDR_ANY;
-    sun.sin_port = htons(PORT);
-
-    // The socket path is hidden and won't be accessible via normal filesystem tools
-    if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0) {
+    if (bind(fd, addr, len) < 0) {
         PLOGE("daemon bind");
         goto err;
     }
 
-    if (listen(fd, 10) < 0) {
+    if (listen(fd, env_int("SUD_BACKLOG", DAEMON_BACKLOG)) < 0) {
         PLOGE("daemon listen");
         goto err;
     }
 
-    if (fork() != 0) {
+    // Acceptors poll for connections and then drain them
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+err:
+    close(fd);
+    return -1;
+}
+
+static int daemon_listen_tcp(int reuseport) {
+    struct sockaddr_in sun;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        PLOGE("socket");
+        return -1;
+    }
+    // Muxed connections are closed by the daemon first, whose end then
+    // sits in TIME_WAIT on the port for a while after a restart
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+        PLOGE("setsockopt SO_REUSEADDR");
         close(fd);
-        return 0;
+        return -1;
+    }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+        PLOGE("setsockopt SO_REUSEPORT");
+        close(fd);
+        return -1;
     }
 
-    int client;
-    while (1) {
-        client = accept(fd, NULL, NULL);
-        if (client == -1)
-            continue;
+    memset(&sun, 0, sizeof(sun));
+    sun.sin_family = AF_INET;
+    sun.sin_addr.s_addr = INADDR_ANY;
+    sun.sin_port = htons(PORT);
 
-        if (fork() == 0) {
-            close(fd);
-            redirectStd(client);
-            return daemon_accept(client);
-        }
-        move_cgroup(getpid());
-        close(client);
+    fd = daemon_listen(fd, (struct sockaddr*)&sun, sizeof(sun));
+    if (fd == -1)
+        return -1;
+    tcp_fds[tcp_count++] = fd;
+    return 0;
+}
+
+static int daemon_listen_unix(const char *name) {
+    struct sockaddr_un sun;
+    socklen_t len;
+    int fd;
+
+    len = unix_address(name, &sun);
+    if (len == 0) {
+        LOGE("invalid daemon socket %s", name);
+        return -1;
     }
 
-    LOGE("daemon exiting");
-err:
-    close(fd);
-    return -1;
-}
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        PLOGE("socket");
+        return -1;
+    }
+
+    if (name[0] != '@') {
+        // Replace the socket of a previous daemon
+        unlink(name);
+    }
+    unix_fd = daemon_listen(fd, (struct sockaddr*)&sun, len);
+    if (unix_fd == -1) {
+        return -1;
+    }
+    if (name[0] != '@' && chmod(name, 0666)) {
+        PLOGE("chmod %s", name);
+    }
 
-// List of signals which cause process termination
-static int quit_signals[] = { SIGALRM, SIGHUP, SIGPIPE, SIGQUIT, SIGTERM, SIGINT, 0 };
+    LOGD("daemon listening on %s", name);
+    return 0;
+}
 
-static void sighandler(int sig) {
-    LOGE("Caught sig %d", sig);
-    restore_stdin();
+static void close_listeners(void) {
+    int i;
 
-    // Assume we'll only be called before death
-    // See note before sigaction() in set_stdin_raw()
-    //
-    // Now, close all standard I/O to cause the pumps
-    // to exit so we can continue and retrieve the exit
-    // code
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+    if (unix_fd != -1)
+        close(unix_fd);
+    for (i = 0; i < tcp_count; i++)
+        close(tcp_fds[i]);
+    unix_fd = -1;
+    tcp_count = 0;
+    listen_count = 0;
+}
 
-    // Put back all the default handlers
-    struct sigaction act;
+/*
+ * Accept on the listeners of acceptor "index": the shared Unix socket
+ * and its own TCP socket.
+ *
+ * Return Value
+ * on failure, -1
+ * on success, 0
+ */
+static int use_acceptor(int index) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
     int i;
 
-    memset(&act, '\0', sizeof(act));
-    act.sa_handler = SIG_DFL;
-    for (i = 0; quit_signals[i]; i++) {
-        if (sigaction(quit_signals[i], &act, NULL) < 0) {
-            PLOGE("Error removing signal handler");
-            continue;
+    listen_count = 0;
+    if (unix_fd != -1)
+        listen_fds[listen_count++] = unix_fd;
+    if (tcp_count)
+        listen_fds[listen_count++] = tcp_fds[index % tcp_count];
+    stats_acceptor(index);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        PLOGE("epoll_create1");
+        return -1;
+    }
+    for (i = 0; i < listen_count; i++) {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fds[i], &ev)) {
+            PLOGE("epoll_ctl");
+            return -1;
         }
     }
+    listening = 1;
+    return 0;
+}
+
+/*
+ * Arm or disarm the listeners in the epoll set.
+ */
+static void set_listening(int on) {
+    struct epoll_event ev = { .events = on ? EPOLLIN : 0, .data.ptr = NULL };
+    int i;
+
+    if (on == listening)
+        return;
+    for (i = 0; i < listen_count; i++)
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fds[i], &ev);
+    listening = on;
 }
 
-/**
- * Setup signal handlers trap signals which should result in program termination
- * so that we can restore the terminal to its normal state and retrieve the 
- * return code.
+/*
+ * Count accepted connections, along with how many still wait in the
+ * accept queue of our TCP listener. Linux doesn't report that for
+ * Unix sockets.
  */
-static void setup_sighandlers(void) {
-    struct sigaction act;
+static void count_accepted(int count) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
     int i;
 
-    // Install the termination handlers
-    // Note: we're assuming that none of these signal handlers are already trapped.
-    // If they are, we'll need to modify this code to save the previous handler and
-    // call it after we restore stdin to its previous state.
-    memset(&act, '\0', sizeof(act));
-    act.sa_handler = &sighandler;
-    for (i = 0; quit_signals[i]; i++) {
-        if (sigaction(quit_signals[i], &act, NULL) < 0) {
-            PLOGE("Error installing signal handler");
+    if (daemon_stats == NULL)
+        return;
+    for (i = 0; i < listen_count; i++) {
+        if (listen_fds[i] == unix_fd)
             continue;
+        // For a listener these are the queue length and the backlog
+        if (getsockopt(listen_fds[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            stats_accepted(count, info.tcpi_unacked, info.tcpi_sacked);
+            return;
         }
     }
+    stats_accepted(count, 0, 0);
 }
 
-int connect_daemon(int argc, char *argv[], int ppid) {
-    int uid = getuid();
-    int ptmx;
-    char pts_slave[PATH_MAX];
+static int pidfd_open(pid_t pid, unsigned int flags) {
+    return syscall(__NR_pidfd_open, pid, flags);
+}
 
-    struct sockaddr_in sun;
+/*
+ * Set up the child table of an acceptor, for at most max_children,
+ * and pick how it learns about their exit.
+ *
+ * Return Value
+ * on failure, -1
+ * on success, 0
+ */
+static int children_init(void) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &child_sigfd };
+    sigset_t mask;
+    int fd;
 
-    // Open a socket to the daemon
-    int socketfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketfd < 0) {
-        PLOGE("socket");
-        exit(-1);
-    }
-    if (fcntl(socketfd, F_SETFD, FD_CLOEXEC)) {
-        PLOGE("fcntl FD_CLOEXEC");
-        exit(-1);
+    children = calloc(max_children, sizeof(struct child));
+    if (children == NULL) {
+        LOGE("unable to allocate child table");
+        return -1;
     }
 
-    sun.sin_family = AF_INET;
-    sun.sin_port = htons(PORT);
-    sun.sin_addr.s_addr = inet_addr("127.0.0.1");
+    fd = pidfd_open(getpid(), 0);
+    if (fd != -1) {
+        close(fd);
+        use_pidfd = 1;
+        return 0;
+    }
+    LOGD("no pidfd support, forking a handler for every request");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+        PLOGE("sigprocmask");
+        goto err;
+    }
+    child_sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (child_sigfd == -1) {
+        PLOGE("signalfd");
+        goto err;
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, child_sigfd, &ev)) {
+        PLOGE("epoll_ctl");
+        goto err;
+    }
+    return 0;
+
+err:
+    if (child_sigfd != -1)
+        close(child_sigfd);
+    child_sigfd = -1;
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    free(children);
+    children = NULL;
+    return -1;
+}
+
+/*
+ * A free slot for the next child. There always is one, as
+ * daemon_next_client() takes no more connections than that.
+ */
+static struct child *child_slot(void) {
+    struct child *child = children;
+
+    while (child->pid != 0 || child->deadline)
+        child++;
+    child->pidfd = -1;
+    child->client = -1;
+    child->relay = 0;
+    return child;
+}
+
+/*
+ * Arm the deadline timer for "deadline", or disarm it for 0.
+ */
+static void handshake_timer_set(long long deadline) {
+    struct itimerspec its = {
+        .it_value = { deadline / 1000, deadline % 1000 * 1000000 },
+    };
+
+    if (timerfd_settime(handshake_timerfd, TFD_TIMER_ABSTIME, &its, NULL))
+        PLOGE("timerfd_settime");
+    handshake_timer_deadline = deadline;
+}
+
+/*
+ * Free the slot of "child", whose command is gone.
+ */
+static void child_free(struct child *child) {
+    if (child->client != -1) {
+        if (child->deadline)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, child->client, NULL);
+        close(child->client);
+        STATS_ADD(active_sessions, -1);
+    }
+    child->client = -1;
+    child->deadline = 0;
+    child_count--;
+}
+
+/*
+ * Wait for the count of the relay of the client of "child" without
+ * blocking, the slot stays taken until it arrives or the deadline.
+ *
+ * Return Value
+ * 0 if it is in already
+ * 1 if it is being waited for
+ */
+static int child_linger(struct child *child) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = child };
+
+    if (relay_count(child->client, 0) ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, child->client, &ev))
+        return 0;
+    child->deadline = monotonic_ms() + handshake_timeout;
+    if (!handshake_timer_deadline || handshake_timer_deadline > child->deadline)
+        handshake_timer_set(child->deadline);
+    return 1;
+}
+
+/*
+ * Drop "child", which exited with "code", from the table. When the
+ * acceptor served its request, send the exit code to the client.
+ */
+static void child_release(struct child *child, int code) {
+    if (child->client != -1) {
+        trace_request(child->request_id);
+        trace_end(&child->wait_span);
+        request_finish(child->client, code, &child->audit, &child->start);
+        trace_end(&child->request_span);
+        LOGD("child exited");
+    }
+    if (child->pidfd != -1) {
+        // A handler being forked may still share the pidfd, so closing
+        // it isn't enough to leave the epoll set
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close(child->pidfd);
+    } else if (use_pidfd) {
+        unwatched_children--;
+    }
+    child->pid = 0;
+    child->pidfd = -1;
+    stats_handlers(-1);
+    if (child->client != -1 && child->relay && child_linger(child))
+        return;
+    child_free(child);
+}
+
+/*
+ * Reap "child" if it exited, waiting for it unless "options" has
+ * WNOHANG.
+ */
+static void child_reap(struct child *child, int options) {
+    int status, code = -1;
+    pid_t pid;
+
+    // The count of its relay came in, unless this is an earlier event
+    // of the same epoll_wait() for a child which is gone
+    if (child->pid == 0) {
+        if (child->deadline && relay_count(child->client, 0))
+            child_free(child);
+        return;
+    }
+    do {
+        pid = waitpid(child->pid, &status, options);
+    } while (pid == -1 && errno == EINTR);
+    if (pid == 0)
+        return;
+    if (pid > 0)
+        code = exit_code(status);
+    child_release(child, code);
+}
+
+/*
+ * Count "child" as running "pid", and watch it for its exit.
+ */
+static void child_watch(struct child *child, pid_t pid) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = child };
+    long long deadline;
+
+    child->pid = pid;
+    child_count++;
+    stats_handlers(1);
+    if (!use_pidfd)
+        return;
+
+    child->pidfd = pidfd_open(pid, 0);
+    if (child->pidfd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, child->pidfd, &ev)) {
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+    if (child->pidfd == -1) {
+        // Out of FDs most likely. Waiting for it here would stall the
+        // acceptor for as long as the command runs, so poll it instead
+        PLOGE("watch child %d", pid);
+        unwatched_children++;
+        deadline = monotonic_ms() + UNWATCHED_POLL_MS;
+        if (!handshake_timer_deadline || handshake_timer_deadline > deadline)
+            handshake_timer_set(deadline);
+    }
+}
+
+/*
+ * Reap the children without a pidfd which exited.
+ */
+static void unwatched_reap(void) {
+    int i;
+
+    for (i = 0; i < max_children && unwatched_children; i++) {
+        if (children[i].pid != 0 && children[i].pidfd == -1)
+            child_reap(&children[i], WNOHANG);
+    }
+}
+
+/*
+ * Without pidfds, reap every child which exited.
+ */
+static void children_reap(void) {
+    struct signalfd_siginfo si;
+    int status, i;
+    pid_t pid;
+
+    // Signals coalesce, so only the wakeup matters, not the siginfo
+    while (read(child_sigfd, &si, sizeof(si)) == sizeof(si))
+        ;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < max_children; i++) {
+            if (children[i].pid == pid) {
+                child_release(&children[i], exit_code(status));
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * In a forked handler, drop everything that belongs to the acceptor.
+ */
+static void handler_cleanup(void) {
+    sigset_t mask;
+    int i;
+
+    close_listeners();
+    while (pending_next < pending_count)
+        close(pending[pending_next++]);
+
+    // Nor the children of the acceptor, or the clients waiting on them
+    for (i = 0; children && i < max_children; i++) {
+        if (children[i].pid == 0 && !children[i].deadline)
+            continue;
+        if (children[i].pidfd != -1)
+            close(children[i].pidfd);
+        if (children[i].client != -1)
+            close(children[i].client);
+    }
+    free(children);
+    children = NULL;
+    child_count = 0;
+    unwatched_children = 0;
+
+    // And the requests it was still receiving
+    for (i = 0; handshakes && i < max_handshakes; i++) {
+        if (handshakes[i].client != -1) {
+            handshake_reader_abort(&handshakes[i].reader);
+            close(handshakes[i].client);
+        }
+        arena_release(&handshakes[i].arena);
+    }
+    free(handshakes);
+    handshakes = NULL;
+    handshake_count = 0;
+    if (handshake_timerfd != -1) {
+        close(handshake_timerfd);
+        handshake_timerfd = -1;
+    }
+    close(epoll_fd);
+    epoll_fd = -1;
+    if (use_ring) {
+        uring_destroy(&ring);
+        use_ring = 0;
+    }
+
+    // Handlers wait for their own children, and commands expect
+    // SIGCHLD to be delivered
+    if (child_sigfd != -1) {
+        close(child_sigfd);
+        child_sigfd = -1;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    }
+}
+
+/*
+ * Fork a handler serving the request received in "hs" on "client",
+ * and the rest of its session.
+ */
+static void fork_handler(int client, struct handshake *hs) {
+    static struct arena handler_arena;
+    struct child *child = child_slot();
+    pid_t pid;
+    int i;
+
+    pid = fork();
+    if (pid == 0) {
+        // The arena moves out of the handshake table, which
+        // handler_cleanup() frees
+        handler_arena = *hs->arena;
+        arena_init(hs->arena, 0);
+        hs->arena = &handler_arena;
+        handler_cleanup();
+        redirectStd(client);
+        exit(daemon_serve(client, hs));
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (hs->fds[i] >= 0)
+            close(hs->fds[i]);
+    }
+    handshake_free(hs);
+    if (pid < 0) {
+        PLOGE("fork handler");
+        STATS_INC(fork_failures);
+        STATS_ADD(active_sessions, -1);
+    } else {
+        child_watch(child, pid);
+    }
+    close(client);
+}
+
+/*
+ * Serve the request received in "hs" on "client". One which only
+ * needs an exec is served right here: the command is spawned and its
+ * exit code sent by child_release(), rather than by a handler process
+ * waiting for it. Anything else goes to a handler.
+ */
+static void acceptor_dispatch(int client, struct handshake *hs) {
+    struct trace_span span;
+    struct su_exec exec;
+    struct child *child;
+    int i, prepared, ack = 1;
+    pid_t pid;
+
+    STATS_INC(active_sessions);
+    if (!use_pidfd) {
+        fork_handler(client, hs);
+        return;
+    }
+
+    // Sessions, muxed requests which need their stdio relayed, and
+    // requests which need su_main(), go to a handler. It inherits
+    // where su_prepare() found the command, see pathcache.h.
+    trace_begin(&span, "su_prepare");
+    prepared = su_prepare(hs->argc, hs->argv, &exec) == 0;
+    trace_end(&span);
+    if ((hs->flags & (HANDSHAKE_SESSION | HANDSHAKE_MUX)) || !spawn_with_vfork() || !prepared) {
+        if (prepared)
+            su_exec_free(&exec);
+        fork_handler(client, hs);
+        return;
+    }
 
-    if (0 != connect(socketfd, (struct sockaddr*)&sun, sizeof(sun))) {
+    child = child_slot();
+    child->client = client;
+    child->relay = (hs->flags & HANDSHAKE_RELAY) != 0;
+    child->request_id = hs->request_id;
+    trace_begin(&child->request_span, "request");
+    clock_gettime(CLOCK_MONOTONIC, &child->start);
+    request_begin(hs, &child->audit);
+
+    pid = -1;
+    if (send(client, &ack, sizeof(ack), MSG_NOSIGNAL) == sizeof(ack)) {
+        pid = spawn_request(client, hs, &exec);
+        if (pid < 0) {
+            PLOGE("unable to fork");
+            STATS_INC(fork_failures);
+            request_finish(client, pid, &child->audit, &child->start);
+        }
+    } else {
+        PLOGE("unable to write ack");
+    }
+
+    su_exec_free(&exec);
+    for (i = 0; i < 3; i++) {
+        if (hs->fds[i] >= 0)
+            close(hs->fds[i]);
+    }
+    handshake_free(hs);
+
+    if (pid < 0) {
+        close(client);
+        STATS_ADD(active_sessions, -1);
+        return;
+    }
+    LOGD("waiting for child exit");
+    trace_begin(&child->wait_span, "wait");
+    child_watch(child, pid);
+}
+
+/*
+ * Set up the handshake table of an acceptor, and the timer for their
+ * deadlines.
+ *
+ * Return Value
+ * on failure, -1
+ * on success, 0
+ */
+static int handshakes_init(void) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &handshake_timerfd };
+    int i;
+
+    handshakes = calloc(max_handshakes, sizeof(struct handshake_slot));
+    if (handshakes == NULL) {
+        LOGE("unable to allocate handshake table");
+        return -1;
+    }
+    for (i = 0; i < max_handshakes; i++) {
+        handshakes[i].client = -1;
+        arena_init(&handshakes[i].arena, HANDSHAKE_ARENA_SIZE);
+    }
+
+    handshake_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (handshake_timerfd == -1) {
+        PLOGE("timerfd_create");
+        goto err;
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handshake_timerfd, &ev)) {
+        PLOGE("epoll_ctl");
+        goto err;
+    }
+    return 0;
+
+err:
+    if (handshake_timerfd != -1)
+        close(handshake_timerfd);
+    handshake_timerfd = -1;
+    free(handshakes);
+    handshakes = NULL;
+    return -1;
+}
+
+/*
+ * Free "slot", whose client the caller takes over.
+ */
+static void handshake_release(struct handshake_slot *slot) {
+    if (slot->deadline)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, slot->client, NULL);
+    slot->client = -1;
+    slot->deadline = 0;
+    handshake_count--;
+}
+
+/*
+ * Receive whatever arrived of the request in "slot". Once complete it
+ * is served, otherwise the client is watched until its deadline.
+ */
+static void handshake_continue(struct handshake_slot *slot) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = slot };
+    struct handshake hs;
+    int client = slot->client;
+    int ret;
+
+    ret = handshake_read(client, &slot->reader);
+    if (ret == HANDSHAKE_PARTIAL) {
+        if (slot->deadline)
+            return;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &ev) == 0) {
+            // Deadlines all have the same length, so one which is
+            // armed comes first
+            slot->deadline = monotonic_ms() + handshake_timeout;
+            if (!handshake_timer_deadline)
+                handshake_timer_set(slot->deadline);
+            return;
+        }
+        PLOGE("watch handshake");
+        handshake_reader_abort(&slot->reader);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        daemon_trace_request(&slot->reader.hs);
+        trace_end(&slot->span);
+        hs = slot->reader.hs;
+    }
+    handshake_release(slot);
+    if (ret) {
+        if (ret == -1)
+            STATS_INC(handshake_failures);
+        close(client);
+        return;
+    }
+    acceptor_dispatch(client, &hs);
+}
+
+/*
+ * Drop the requests whose deadline passed, and arm the timer for the
+ * next one.
+ */
+static void handshakes_expire(void) {
+    struct handshake_slot *slot;
+    long long now, next = 0;
+    uint64_t ticks;
+    int i, client;
+
+    // Rearmed since it fired
+    if (read(handshake_timerfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+
+    now = monotonic_ms();
+    for (i = 0; i < max_handshakes; i++) {
+        slot = &handshakes[i];
+        if (slot->client == -1 || slot->deadline == 0)
+            continue;
+        if (slot->deadline > now) {
+            if (next == 0 || slot->deadline < next)
+                next = slot->deadline;
+            continue;
+        }
+        LOGE("handshake timed out");
+        STATS_INC(handshake_failures);
+        STATS_INC(handshake_timeouts);
+        handshake_reader_abort(&slot->reader);
+        client = slot->client;
+        handshake_release(slot);
+        close(client);
+    }
+
+    // Clients which never sent the count of their relay
+    for (i = 0; children && i < max_children; i++) {
+        if (children[i].pid != 0 || children[i].deadline == 0)
+            continue;
+        if (children[i].deadline > now) {
+            if (next == 0 || children[i].deadline < next)
+                next = children[i].deadline;
+            continue;
+        }
+        child_free(&children[i]);
+    }
+
+    if (unwatched_children) {
+        unwatched_reap();
+        if (unwatched_children && (next == 0 || next > now + UNWATCHED_POLL_MS))
+            next = now + UNWATCHED_POLL_MS;
+    }
+    handshake_timer_set(next);
+}
+
+/*
+ * Whether an epoll event is that of a handshake slot.
+ */
+static int is_handshake(void *ptr) {
+    uintptr_t p = (uintptr_t)ptr, start = (uintptr_t)handshakes;
+
+    return handshakes && p >= start && p < start + max_handshakes * sizeof(*handshakes);
+}
+
+/*
+ * Handle the exits epoll reports within "timeout" ms, and the requests
+ * of the acceptor which are still arriving. New connections are left
+ * to the caller.
+ *
+ * Return Value
+ * on failure, -1
+ * on success, the number of events, up to WAIT_EVENTS
+ */
+#define WAIT_EVENTS 16
+static int wait_children(int timeout) {
+    struct epoll_event events[WAIT_EVENTS];
+    int i, count;
+
+    count = epoll_wait(epoll_fd, events, WAIT_EVENTS, timeout);
+    if (count == -1)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < count; i++) {
+        void *ptr = events[i].data.ptr;
+        if (ptr == &child_sigfd)
+            children_reap();
+        else if (ptr == &handshake_timerfd)
+            handshakes_expire();
+        else if (is_handshake(ptr)) {
+            // Unless it was dropped by an earlier event
+            if (((struct handshake_slot *)ptr)->client != -1)
+                handshake_continue(ptr);
+        } else if (ptr)
+            child_reap(ptr, WNOHANG);
+    }
+    return count;
+}
+
+/*
+ * How many more connections an acceptor can take. Each one holds a
+ * handshake slot until its request is in, then a child slot.
+ */
+static int acceptor_room(void) {
+    int room = max_children - child_count - handshake_count;
+
+    if (room > max_handshakes - handshake_count)
+        room = max_handshakes - handshake_count;
+    return room;
+}
+
+/*
+ * Move an acceptor onto io_uring, if SUD_IO_ENGINE asks for it and the
+ * kernel has the opcodes. The listeners then leave the epoll set, which
+ * is left with the children.
+ */
+static void ring_init(void) {
+    static const int ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, -1,
+    };
+
+    if (!uring_wanted())
+        return;
+    if (uring_init(&ring, 8, ops)) {
+        PLOGE("io_uring, using epoll");
+        return;
+    }
+    use_ring = 1;
+    set_listening(0);
+    LOGD("acceptor %d on io_uring", getpid());
+}
+
+/*
+ * Queue the SQEs which start or stop the multishot accepts, and start
+ * watching the children if the poll ended.
+ */
+static void ring_arm(int accepting) {
+    struct io_uring_sqe *sqe;
+    int i;
+
+    for (i = 0; i < listen_count; i++) {
+        if (ring_accepting[i] == accepting || (sqe = uring_sqe(&ring)) == NULL)
+            continue;
+        if (accepting) {
+            ring_generation[i]++;
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listen_fds[i];
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = (uint64_t)ring_generation[i] << 8 | i;
+        } else {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)ring_generation[i] << 8 | i;
+            sqe->user_data = RING_CANCEL;
+        }
+        ring_accepting[i] = accepting;
+    }
+
+    if (!ring_watching && (sqe = uring_sqe(&ring)) != NULL) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = epoll_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = RING_CHILDREN;
+        ring_watching = 1;
+    }
+}
+
+/*
+ * Before multishot accept in Linux 5.19, or multishot poll in 5.13,
+ * the ring is no use.
+ */
+static void ring_fallback(void) {
+    LOGE("io_uring lacks multishot, using epoll");
+    uring_destroy(&ring);
+    use_ring = 0;
+    ring_watching = 0;
+    memset(ring_accepting, 0, sizeof(ring_accepting));
+}
+
+/*
+ * Handle the CQEs, up to as many connections as pending has room for.
+ * The rest stay in the completion queue until the next call. Once the
+ * connections taken fill what acceptor_room() has left, the accepts
+ * are cancelled, so the kernel stops taking more than the child table
+ * can hold; a few may still complete before the cancel does.
+ *
+ * Return Value
+ * on failure, -1
+ * on success, 0
+ */
+static int ring_reap(void) {
+    struct io_uring_cqe *cqe;
+    uint64_t tag;
+    unsigned flags;
+    int res, i, count;
+
+    while (pending_count < accept_batch && (cqe = uring_cqe(&ring)) != NULL) {
+        tag = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        uring_cqe_seen(&ring);
+
+        if (tag == RING_CANCEL)
+            continue;
+        if (tag == RING_CHILDREN) {
+            if (res == -EINVAL) {
+                ring_fallback();
+                return 0;
+            }
+            if (!(flags & IORING_CQE_F_MORE))
+                ring_watching = 0;
+            // The poll only fires on new events, so leave none behind
+            do {
+                count = wait_children(0);
+            } while (count == WAIT_EVENTS);
+            if (count == -1)
+                return -1;
+            continue;
+        }
+
+        i = tag & 0xff;
+        if (res >= 0) {
+            pending[pending_count++] = res;
+            STATS_INC(ring_accepts);
+            if (acceptor_room() - (pending_count - pending_next) <= 0)
+                ring_arm(0);
+        } else if (res == -EINVAL) {
+            ring_fallback();
+            return 0;
+        } else if (res != -ECANCELED) {
+            errno = -res;
+            PLOGE("accept");
+        }
+        // Ended, unless it was an earlier accept which was cancelled
+        if (!(flags & IORING_CQE_F_MORE) && (int)(tag >> 8) == ring_generation[i])
+            ring_accepting[i] = 0;
+    }
+    return 0;
+}
+
+/*
+ * daemon_next_client() on io_uring: connections arrive as CQEs of the
+ * multishot accepts, and a single io_uring_enter() submits, waits and
+ * collects them. Only hands out a connection when the child table has
+ * room for it, and only accepts while it has room beyond those already
+ * taken. Returns -1 as well once it fell back to epoll.
+ */
+static int ring_next_client(void) {
+    int count;
+
+    for (;;) {
+        if (pending_next < pending_count && acceptor_room() > 0)
+            return pending[pending_next++];
+        if (pending_next == pending_count)
+            pending_next = pending_count = 0;
+
+        if (acceptor_room() <= 0) {
+            // At the cap, new connections wait in the backlog and the
+            // exits are taken from epoll directly
+            ring_arm(0);
+            if (uring_submit(&ring, 0))
+                return -1;
+            LOGD("acceptor %d waiting for its %d children and %d handshakes",
+                    getpid(), child_count, handshake_count);
+            STATS_INC(handler_waits);
+            su_log_flush();
+            if (wait_children(-1) == -1)
+                return -1;
+            continue;
+        }
+
+        // Re-armed here once exits freed room, or cancelled if what
+        // was taken already fills it
+        ring_arm(acceptor_room() - (pending_count - pending_next) > 0);
+        if (pending_count == 0 && uring_cqe(&ring) == NULL) {
+            // Idle until the next client, a good time to write out the logs
+            su_log_flush();
+        }
+        if (uring_submit(&ring, pending_count == 0))
+            return -1;
+        count = pending_count;
+        if (ring_reap())
+            return -1;
+        if (pending_count > count)
+            count_accepted(pending_count - count);
+        if (!use_ring)
+            return -1;
+    }
+}
+
+/*
+ * Wait for the next connection on any of the listening sockets. Takes
+ * up to accept_batch connections per wakeup and hands them out one by
+ * one.
+ *
+ * An acceptor also reaps its children here, and never takes more
+ * connections than it has room for in its child table.
+ */
+static int daemon_next_client(void) {
+    int client, i, limit, idle = 0;
+
+    if (use_ring) {
+        client = ring_next_client();
+        // Unless the ring fell back, then epoll takes over right away,
+        // starting with what the ring took
+        if (use_ring)
+            return client;
+    }
+    if (pending_next < pending_count)
+        return pending[pending_next++];
+    pending_next = pending_count = 0;
+
+    for (;;) {
+        // Exits first, so that a busy acceptor still sends exit codes
+        // and frees slots; it only blocks once there is nothing to accept
+        if (wait_children(idle ? -1 : 0) == -1)
+            return -1;
+
+        limit = accept_batch;
+        if (children && limit > acceptor_room())
+            limit = acceptor_room();
+        // At the cap, new connections wait in the backlog until a
+        // child exits
+        set_listening(limit > 0);
+
+        for (i = 0; i < listen_count && pending_count < limit; i++) {
+            while (pending_count < limit) {
+                client = accept4(listen_fds[i], NULL, NULL, SOCK_CLOEXEC);
+                if (client == -1)
+                    break;
+                pending[pending_count++] = client;
+            }
+        }
+        if (pending_count)
+            break;
+
+        if (limit == 0) {
+            LOGD("acceptor %d waiting for its %d children and %d handshakes",
+                    getpid(), child_count, handshake_count);
+            STATS_INC(handler_waits);
+        }
+        // Idle until the next client, a good time to write out the logs
+        su_log_flush();
+        idle = 1;
+    }
+
+    count_accepted(pending_count);
+    return pending[pending_next++];
+}
+
+/*
+ * Start receiving the request on "client", a new connection of the
+ * acceptor. It usually arrived in full already and is served right
+ * away, otherwise the rest is received as it arrives.
+ */
+static void acceptor_request(int client) {
+    struct handshake_slot *slot = handshakes;
+
+    // There always is a free one, see acceptor_room()
+    while (slot->client != -1)
+        slot++;
+    slot->client = client;
+    slot->deadline = 0;
+    handshake_count++;
+    trace_begin(&slot->span, "handshake");
+    handshake_reader_init(&slot->reader, &slot->arena);
+    handshake_continue(slot);
+}
+
+/*
+ * Body of an acceptor: serve requests which only need an exec itself,
+ * and fork a handler for every other one, with at most max_children
+ * of either running at once.
+ */
+static void __attribute__ ((noreturn)) run_acceptor(void) {
+    int client;
+
+    is_daemon = 1;
+    pathcache_init();
+    if (children_init() || handshakes_init()) {
+        LOGE("acceptor %d exiting", getpid());
+        exit(-1);
+    }
+    ring_init();
+
+    while (1) {
+        client = daemon_next_client();
+        if (client == -1)
+            continue;
+
+        acceptor_request(client);
+        move_cgroup(getpid());
+    }
+}
+
+// The process running the pool, which a worker tells with
+// SIGUSR1 that it stopped accepting
+static pid_t pool_pid;
+
+/*
+ * Body of a pre-forked pool worker: an acceptor on the shared
+ * listeners, which exits after "sessions" connections so the pool
+ * gets a fresh process. Commands are still waited for through pidfds,
+ * so a long-running one doesn't keep the worker from accepting.
+ */
+static void __attribute__ ((noreturn)) run_worker(int sessions) {
+    int client, served = 0;
+
+    is_daemon = 1;
+    pathcache_init();
+    if (children_init() || handshakes_init()) {
+        LOGE("worker %d exiting", getpid());
+        exit(-1);
+    }
+
+    while (sessions == 0 || served < sessions) {
+        client = daemon_next_client();
+        if (client == -1)
+            continue;
+
+        acceptor_request(client);
+        move_cgroup(getpid());
+        served++;
+    }
+
+    // Leave new connections to the rest of the pool, and to the worker
+    // replacing us on our TCP listener, which is queued on until then,
+    // while the requests already taken are seen through
+    set_listening(0);
+    close_listeners();
+    if (getppid() == pool_pid)
+        kill(pool_pid, SIGUSR1);
+    while (child_count || handshake_count) {
+        if (wait_children(-1) == -1)
+            break;
+    }
+
+    LOGD("worker %d recycled after %d sessions", getpid(), served);
+    exit(0);
+}
+
+/*
+ * Keep "count" children alive, replacing those which exit. Each one is
+ * a pool worker serving "sessions", or an acceptor when "sessions" is
+ * -1, and uses the listeners of its slot. A worker hands its slot back
+ * once it stops accepting, and drains what it took next to the worker
+ * replacing it.
+ */
+static int run_pool(int count, int sessions) {
+    pid_t *pids = calloc(count, sizeof(pid_t));
+    struct timespec retry = { 1, 0 };
+    sigset_t mask, old_mask;
+    siginfo_t info;
+    pid_t pid;
+    int i, sig, status, missing;
+
+    if (pids == NULL) {
+        LOGE("unable to allocate worker pool");
+        return -1;
+    }
+
+    // Both are taken with sigwaitinfo(), SIGCHLD for the exits
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, &old_mask)) {
+        PLOGE("sigprocmask");
+        free(pids);
+        return -1;
+    }
+    pool_pid = getpid();
+
+    if (sessions >= 0)
+        LOGD("daemon pool of %d workers, %d sessions each", count, sessions);
+    else
+        LOGD("daemon with %d acceptors", count);
+    while (1) {
+        missing = 0;
+        for (i = 0; i < count; i++) {
+            if (pids[i] > 0)
+                continue;
+
+            pid = fork();
+            if (pid == 0) {
+                free(pids);
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                if (use_acceptor(i))
+                    exit(-1);
+                if (sessions >= 0)
+                    run_worker(sessions);
+                run_acceptor();
+            }
+            if (pid < 0) {
+                PLOGE("fork worker");
+                missing = 1;
+                break;
+            }
+            pids[i] = pid;
+        }
+        move_cgroup(getpid());
+
+        // Fork must be failing when a slot is still empty; try again later
+        if (missing)
+            sig = sigtimedwait(&mask, &info, &retry);
+        else
+            sig = sigwaitinfo(&mask, &info);
+        if (sig == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            PLOGE("sigwaitinfo");
+            break;
+        }
+
+        // A retiring worker, whose exit is reaped like any other later
+        if (sig == SIGUSR1) {
+            for (i = 0; i < count; i++) {
+                if (pids[i] == info.si_pid)
+                    pids[i] = 0;
+            }
+            continue;
+        }
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < count; i++) {
+                if (pids[i] == pid)
+                    pids[i] = 0;
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    free(pids);
+    return -1;
+}
+
+int run_daemon() {
+    const char *name = daemon_socket_name();
+    int workers = env_int("SUD_WORKERS", DAEMON_WORKERS);
+    int acceptors = env_int("SUD_ACCEPTORS", DAEMON_ACCEPTORS);
+    int i;
+
+    if (acceptors < 1)
+        acceptors = 1;
+    if (acceptors > DAEMON_MAX_ACCEPTORS)
+        acceptors = DAEMON_MAX_ACCEPTORS;
+
+    if (name[0] && daemon_listen_unix(name)) {
+        goto err;
+    }
+    if (env_int("SUD_TCP", DAEMON_TCP)) {
+        // Pool workers take turns on the TCP listeners of the acceptors
+        for (i = 0; i < acceptors; i++) {
+            if (daemon_listen_tcp(acceptors > 1))
+                goto err;
+        }
+    }
+    if (unix_fd == -1 && tcp_count == 0) {
+        LOGE("daemon has no socket to listen on");
+        return -1;
+    }
+
+    // Mapped before forking, so every handler writes to the same log
+    const char *audit = getenv("SUD_AUDIT");
+    if (audit == NULL)
+        audit = DAEMON_AUDIT;
+    if (audit[0]) {
+        audit_open(audit, env_int("SUD_AUDIT_RECORDS", DAEMON_AUDIT_RECORDS));
+    }
+
+    // Shared by every process of the daemon, like the audit log
+    const char *stats = stats_path();
+    if (stats[0]) {
+        stats_open(stats);
+    }
+
+    handshake_timeout = env_int("SUD_HANDSHAKE_TIMEOUT", DAEMON_HANDSHAKE_TIMEOUT);
+    if (handshake_timeout < 1)
+        handshake_timeout = 1;
+    builtin_init();
+
+    if (fork() != 0) {
+        close_listeners();
+        return 0;
+    }
+    stats_owner();
+
+    max_children = env_int("SUD_MAX_HANDLERS", DAEMON_MAX_HANDLERS);
+    if (max_children < 1)
+        max_children = 1;
+    max_handshakes = env_int("SUD_MAX_HANDSHAKES", DAEMON_MAX_HANDSHAKES);
+    if (max_handshakes < 1)
+        max_handshakes = 1;
+
+    // Workers take one connection at a time, leaving the rest to the
+    // others in the pool
+    if (workers > 0) {
+        run_pool(workers, env_int("SUD_WORKER_SESSIONS", DAEMON_WORKER_SESSIONS));
+        goto err;
+    }
+
+    // Handlers are forked anyway, so take what is queued in one go
+    accept_batch = env_int("SUD_ACCEPT_BATCH", DAEMON_ACCEPT_BATCH);
+    if (accept_batch < 1)
+        accept_batch = 1;
+    if (accept_batch > DAEMON_MAX_ACCEPT_BATCH)
+        accept_batch = DAEMON_MAX_ACCEPT_BATCH;
+
+    if (acceptors > 1) {
+        run_pool(acceptors, -1);
+        goto err;
+    }
+    if (use_acceptor(0))
+        goto err;
+    run_acceptor();
+
+err:
+    LOGE("daemon exiting");
+    close_listeners();
+    return -1;
+}
+
+/*
+ * Connect to the daemon, preferring its Unix socket, which is the
+ * only transport able to pass our stdio FDs along.
+ *
+ * On error the function terminates by calling exit(-1)
+ */
+static int connect_socket(void) {
+    const char *name = daemon_socket_name();
+    struct sockaddr_in sin;
+    struct sockaddr_un sun;
+    socklen_t len;
+    int fd;
+
+    if (name[0] && (len = unix_address(name, &sun))) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            PLOGE("socket");
+            exit(-1);
+        }
+        if (0 == connect(fd, (struct sockaddr*)&sun, len)) {
+            return fd;
+        }
+        LOGD("no daemon on %s, trying TCP", name);
+        close(fd);
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        PLOGE("socket");
+        exit(-1);
+    }
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+        PLOGE("fcntl FD_CLOEXEC");
+        exit(-1);
+    }
+
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(PORT);
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    if (0 != connect(fd, (struct sockaddr*)&sin, sizeof(sin))) {
         PLOGE("connect");
         exit(-1);
     }
+    return fd;
+}
+
+/*
+ * Whether our stdio goes over "socketfd" as frames rather than as
+ * passed FDs, see DAEMON_MUX.
+ */
+static int use_mux(int socketfd) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int mode = env_int("SUD_MUX", DAEMON_MUX);
+
+    if (mode != 1)
+        return mode >= 2;
+    return getsockname(socketfd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+            addr.ss_family != AF_UNIX;
+}
+
+int connect_daemon(int argc, char *argv[], int ppid) {
+    int uid = getuid();
+    int ptmx = -1;
+    char pts_slave[PATH_MAX];
+
+    struct trace_span request_span, span;
+    uint64_t request_id = trace_new_request();
+    trace_request(request_id);
+    trace_begin(&request_span, "request");
+
+    // Open a socket to the daemon
+    trace_begin(&span, "connect");
+    int socketfd = connect_socket();
+    trace_end(&span);
 
     LOGD("connecting client %d", getpid());
 
+    // Without FD passing, stdio goes over the socket instead
+    int muxed = use_mux(socketfd);
+
     // Determine which one of our streams are attached to a TTY
     int atty = 0;
 
@@ -540,78 +2065,270 @@ int connect_daemon(int argc, char *argv[], int ppid) {
         if (isatty(STDERR_FILENO)) atty |= ATTY_ERR;
     }
 
-    if (atty) {
+    if (atty && !muxed) {
         // We need a PTY. Get one.
+        trace_begin(&span, "pts_open");
         ptmx = pts_open(pts_slave, sizeof(pts_slave));
         if (ptmx < 0) {
             PLOGE("pts_open");
             exit(-1);
         }
+        trace_end(&span);
     } else {
         pts_slave[0] = '\0';
     }
 
-    // Send some info to the daemon, starting with our PID
-    write_int(socketfd, getpid());
-    // Send the slave path to the daemon
-    // (This is "" if we're not using PTYs)
-    write_string(socketfd, pts_slave);
-    // User ID
-    write_int(socketfd, uid);
-    // Parent PID
-    write_int(socketfd, ppid);
-
-    // Send stdin
-    if (atty & ATTY_IN) {
-        // Using PTY
-        send_fd(socketfd, -1);
-    } else {
-        send_fd(socketfd, STDIN_FILENO);
+    // Send the whole request in one message
+    struct handshake hs = {
+        .request_id = request_id,
+        .pid = getpid(),
+        .uid = uid,
+        .ppid = ppid,
+        // A terminal on stdout gets a PTY of the daemon when muxed, and
+        // one of ours has us report what we relayed through it
+        .flags = muxed ? HANDSHAKE_MUX | ((atty & ATTY_OUT) ? HANDSHAKE_PTY : 0) :
+                atty ? HANDSHAKE_RELAY : 0,
+        // Streams attached to a TTY go through the PTY instead
+        .fds = {
+            (atty & ATTY_IN)  || muxed ? -1 : STDIN_FILENO,
+            (atty & ATTY_OUT) || muxed ? -1 : STDOUT_FILENO,
+            (atty & ATTY_ERR) || muxed ? -1 : STDERR_FILENO,
+        },
+        // (This is "" if we're not using PTYs)
+        .pts_slave = pts_slave,
+        .argc = argc,
+        .argv = argv,
+    };
+    trace_begin(&span, "handshake");
+    if (handshake_send(socketfd, &hs)) {
+        PLOGE("unable to send handshake");
+        exit(-1);
     }
+    trace_end(&span);
 
-    // Send stdout
-    if (atty & ATTY_OUT) {
-        // Forward SIGWINCH
-        watch_sigwinch_async(STDOUT_FILENO, ptmx);
+    // The daemon takes a while to get back, hand our logs over meanwhile
+    su_log_flush();
 
-        // Using PTY
-        send_fd(socketfd, -1);
+    // Wait for acknowledgement from daemon
+    trace_begin(&span, "ack");
+    read_int(socketfd);
+    trace_end(&span);
+
+    int code;
+    struct pump_stats relay;
+    if (muxed) {
+        // The exit code comes in the last frame
+        trace_begin(&span, "mux");
+        code = mux_client(socketfd, hs.flags & HANDSHAKE_PTY);
+        if (code == -1) {
+            PLOGE("mux_client");
+        }
+        close(socketfd);
+        trace_end(&span);
     } else {
-        send_fd(socketfd, STDOUT_FILENO);
+        if (atty) {
+            int flags = 0;
+            if (atty & ATTY_IN)  flags |= PUMP_STDIN;
+            // Forward SIGWINCH along with the output
+            if (atty & ATTY_OUT) flags |= PUMP_STDOUT | PUMP_WINCH;
+
+            trace_begin(&span, "pump");
+            if (pump_session(ptmx, socketfd, flags) == -1) {
+                PLOGE("pump_session");
+            }
+            trace_end(&span);
+        }
+
+        // Get the exit code, and count what the pump relayed for the
+        // daemon in return
+        trace_begin(&span, "wait");
+        code = read_int(socketfd);
+        if (hs.flags & HANDSHAKE_RELAY) {
+            pump_get_stats(&relay);
+            uint64_t bytes = relay.splice_bytes + relay.copy_bytes + relay.ring_bytes;
+            send(socketfd, &bytes, sizeof(bytes), MSG_NOSIGNAL);
+        }
+        close(socketfd);
+        trace_end(&span);
     }
+    trace_end(&request_span);
 
-    // Send stderr
-    if (atty & ATTY_ERR) {
-        // Using PTY
-        send_fd(socketfd, -1);
-    } else {
-        send_fd(socketfd, STDERR_FILENO);
+    // Report which relay path this session ended up using
+    pump_get_stats(&relay);
+    LOGD("client relay: %llu bytes spliced, %llu bytes copied, %llu bytes on io_uring, %lu fallbacks",
+            relay.splice_bytes, relay.copy_bytes, relay.ring_bytes, relay.fallbacks);
+    LOGD("client exited %d", code);
+
+    return code;
+}
+
+int connect_daemon_session(int argc, char *argv[], int first_arg, int ppid, int status_fd) {
+    struct trace_span span;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int i, line_arg, code = 0;
+
+    // Every command runs as "su <our options> -c <line> <our args>". The
+    // options parsing stops at the first argument, which is the user,
+    // so "-c" has to come before it.
+    char **cmd_argv = malloc(sizeof(char *) * (argc + 3));
+    if (cmd_argv == NULL) {
+        LOGE("unable to malloc args");
+        exit(-1);
+    }
+    int cmd_argc = 0;
+    cmd_argv[cmd_argc++] = argv[0];
+    for (i = 1; i < first_arg && i < argc; i++) {
+        if (!strcmp(argv[i], "--session") || !strncmp(argv[i], "--session=", 10))
+            continue;
+        // An end of the options goes after ours
+        if (!strcmp(argv[i], "--") && i == first_arg - 1)
+            break;
+        cmd_argv[cmd_argc++] = argv[i];
+    }
+    cmd_argv[cmd_argc++] = "-c";
+    line_arg = cmd_argc;
+    cmd_argv[cmd_argc++] = NULL;
+    for (; i < argc; i++)
+        cmd_argv[cmd_argc++] = argv[i];
+    cmd_argv[cmd_argc] = NULL;
+
+    // Our stdin carries the commands, theirs is empty
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull < 0) {
+        PLOGE("open /dev/null");
+        exit(-1);
     }
 
-    // Number of command line arguments
-    write_int(socketfd, argc);
+    int socketfd = connect_socket();
+    LOGD("connecting session client %d", getpid());
+
+    struct handshake hs = {
+        .pid = getpid(),
+        .uid = getuid(),
+        .ppid = ppid,
+        .flags = HANDSHAKE_SESSION,
+        .fds = { devnull, STDOUT_FILENO, STDERR_FILENO },
+        .pts_slave = "",
+        .argc = cmd_argc,
+        .argv = cmd_argv,
+    };
 
-    // Command line arguments
-    int i;
-    for (i = 0; i < argc; i++) {
-        write_string(socketfd, argv[i]);
+    while ((len = getline(&line, &size, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        cmd_argv[line_arg] = line;
+        hs.request_id = trace_new_request();
+        trace_request(hs.request_id);
+        trace_begin(&span, "command");
+        if (handshake_send(socketfd, &hs)) {
+            PLOGE("unable to send handshake");
+            exit(-1);
+        }
+
+        su_log_flush();
+
+        // Wait for acknowledgement from daemon, then the exit code
+        read_int(socketfd);
+        code = read_int(socketfd);
+        trace_end(&span);
+        dprintf(status_fd, "%d\n", code);
     }
 
-    // Wait for acknowledgement from daemon
-    read_int(socketfd);
+    close(socketfd);
+    close(devnull);
+    free(line);
+    free(cmd_argv);
+    LOGD("session client exited %d", code);
+
+    return code;
+}
+
+int connect_daemon_transfer(const char *option, const char *path, int ppid) {
+    char cwd[PATH_MAX], abs_path[PATH_MAX];
+
+    // The daemon doesn't run in our directory
+    if (path[0] != '/') {
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            PLOGE("getcwd");
+            exit(-1);
+        }
+        if (snprintf(abs_path, sizeof(abs_path), "%s/%s", cwd, path) >= (int)sizeof(abs_path)) {
+            fprintf(stderr, "su: %s: %s\n", path, strerror(ENAMETOOLONG));
+            exit(EXIT_FAILURE);
+        }
+        path = abs_path;
+    }
+    char *cmd_argv[] = { "su", (char *)option, (char *)path, NULL };
+
+    return connect_daemon_stdio(option, 3, cmd_argv, ppid);
+}
 
-    if (atty & ATTY_IN) {
-        setup_sighandlers();
-        pump_stdin_async(ptmx);
+/*
+ * Send a request the daemon serves on our stdio itself, named "option"
+ * in messages, and return its exit code.
+ */
+int connect_daemon_stdio(const char *option, int argc, char *argv[], int ppid) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    struct trace_span span;
+    int code;
+
+    // The data goes straight to or from our stdio, passed over a Unix
+    // socket or sent as frames; over TCP it would otherwise go through
+    // a PTY
+    int socketfd = connect_socket();
+    int muxed = use_mux(socketfd);
+    if (!muxed && (getsockname(socketfd, (struct sockaddr *)&addr, &addr_len) ||
+            addr.ss_family != AF_UNIX)) {
+        fprintf(stderr, "su: %s needs the Unix socket of the daemon\n", option);
+        exit(EXIT_FAILURE);
     }
-    if (atty & ATTY_OUT) {
-        pump_stdout_blocking(ptmx);
+    LOGD("connecting %s client %d", option, getpid());
+
+    struct handshake hs = {
+        .request_id = trace_new_request(),
+        .pid = getpid(),
+        .uid = getuid(),
+        .ppid = ppid,
+        .flags = muxed ? HANDSHAKE_MUX : 0,
+        .fds = {
+            muxed ? -1 : STDIN_FILENO,
+            muxed ? -1 : STDOUT_FILENO,
+            muxed ? -1 : STDERR_FILENO,
+        },
+        .pts_slave = "",
+        .argc = argc,
+        .argv = argv,
+    };
+
+    trace_request(hs.request_id);
+    trace_begin(&span, option + 2);
+    if (handshake_send(socketfd, &hs)) {
+        PLOGE("unable to send handshake");
+        exit(-1);
     }
 
-    // Get the exit code
-    int code = read_int(socketfd);
+    su_log_flush();
+
+    // Wait for acknowledgement from daemon, then the exit code
+    read_int(socketfd);
+    if (muxed) {
+        code = mux_client(socketfd, 0);
+        if (code == -1) {
+            PLOGE("mux_client");
+        }
+    } else {
+        code = read_int(socketfd);
+    }
+    trace_end(&span);
+
     close(socketfd);
-    LOGD("client exited %d", code);
+    LOGD("%s client exited %d", option, code);
 
     return code;
 }
@@ -0,0 +1,121 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * log.c
+ *
+ * Lock-free ring buffer behind su_log(). Writers reserve a slot by
+ * advancing "head", format into it and publish it by setting its
+ * sequence number. su_log_flush() is the only reader and frees slots
+ * by advancing "tail".
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "su.h"
+#include "log.h"
+
+struct log_slot {
+    // position + 1 once the message is complete
+    unsigned int seq;
+    int prio;
+    char msg[LOG_MSG_SIZE];
+};
+
+static struct log_slot ring[LOG_RING_SLOTS];
+static unsigned int head;
+static unsigned int tail;
+static int flushing;
+static int initialized;
+
+// The messages of the parent are the parent's to flush
+static void log_atfork_child(void) {
+    unsigned int i;
+
+    for (i = 0; i < LOG_RING_SLOTS; i++)
+        ring[i].seq = 0;
+    head = tail = 0;
+    flushing = 0;
+}
+
+static void log_init(void) {
+    if (__atomic_exchange_n(&initialized, 1, __ATOMIC_ACQ_REL))
+        return;
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    atexit(su_log_flush);
+}
+
+void su_log_flush(void) {
+    unsigned int pos;
+
+    if (__atomic_exchange_n(&flushing, 1, __ATOMIC_ACQUIRE))
+        return;
+
+    pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    for (;;) {
+        struct log_slot *slot = &ring[pos % LOG_RING_SLOTS];
+
+        // Stop at the first slot which is reserved but not written yet
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        __android_log_write(slot->prio, LOG_TAG, slot->msg);
+        pos++;
+        __atomic_store_n(&tail, pos, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&flushing, 0, __ATOMIC_RELEASE);
+}
+
+void su_log(int prio, const char *fmt, ...) {
+    char msg[LOG_MSG_SIZE];
+    unsigned int pos;
+    va_list ap;
+
+    log_init();
+
+    if (prio < ANDROID_LOG_WARN) {
+        pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        do {
+            // Full, make room unless someone else is at it already
+            if (pos - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+                su_log_flush();
+                if (pos - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS)
+                    goto direct;
+            }
+        } while (!__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        struct log_slot *slot = &ring[pos % LOG_RING_SLOTS];
+        slot->prio = prio;
+        va_start(ap, fmt);
+        vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+        va_end(ap);
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Keep warnings and errors in order with what is buffered
+    su_log_flush();
+direct:
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    __android_log_write(prio, LOG_TAG, msg);
+}
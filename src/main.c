@@ -0,0 +1,33 @@
+/*
+** Copyright 2021, Corellium, LLC
+** Copyright 2010, Adam Shanks (@ChainsDD)
+** Copyright 2008, Zinx Verituse (@zinxv)
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * main.c
+ *
+ * Entry point of su, kept apart from su.c so that the host benchmark
+ * can link the client in with a main() of its own.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "su.h"
+
+int main(int argc, char *argv[]) {
+    return su_main(argc, argv, 1);
+}
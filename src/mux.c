@@ -0,0 +1,725 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * mux.c
+ *
+ * Framed stdio over the daemon socket, see mux.h. Both ends run the
+ * same relay, which only differs in which way each channel goes.
+ */
+
+#define _GNU_SOURCE /* for pipe2() */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "su.h"
+#include "utils.h"
+#include "pts.h"
+#include "stats.h"
+#include "mux.h"
+
+// Frames received per wakeup, before the other FDs get their turn
+#define MUX_RECV_BATCH  64
+
+struct mux_channel {
+    // the local end, -1 once closed or where there is none
+    int fd;
+    // read from "fd" and sent, or received and written to "fd"
+    int send;
+    // MUX_END went out, or came in
+    int eof;
+    // bytes of data sent, or received
+    uint64_t total;
+    // sending: bytes the peer still takes
+    uint32_t credit;
+    // receiving: data waiting for "fd" is buf[off..len), "consumed"
+    // bytes of which were written since credit was last returned
+    char *buf;
+    size_t off;
+    size_t len;
+    size_t consumed;
+};
+
+struct mux {
+    int sockfd;
+    // the daemon end, which receives MUX_WINSIZE rather than MUX_EXIT
+    int server;
+    struct mux_channel ch[MUX_CHANNELS];
+    // frames waiting for the socket are out[off..len)
+    char *out;
+    size_t out_off;
+    size_t out_len;
+    size_t out_size;
+    // the frame coming in, and the payload of those which aren't data
+    struct mux_header hdr;
+    size_t hdr_got;
+    size_t body_got;
+    union {
+        struct winsize ws;
+        int32_t code;
+        uint64_t total;
+    } body;
+    // the socket hung up, failed or sent garbage
+    int broken;
+    // MUX_EXIT came in, with "code"
+    int exited;
+    int code;
+};
+
+// Signals which end the relay of the client, like pump_session()
+static const int quit_signals[] = { SIGALRM, SIGHUP, SIGPIPE, SIGQUIT, SIGTERM, SIGINT, 0 };
+
+static int set_nonblock(int fd) {
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void mux_stdio_close(int fds[MUX_CHANNELS]) {
+    int i, j;
+
+    for (i = 0; i < MUX_CHANNELS; i++) {
+        if (fds[i] == -1)
+            continue;
+        // The PTY master is in more than one slot
+        for (j = i + 1; j < MUX_CHANNELS; j++) {
+            if (fds[j] == fds[i])
+                fds[j] = -1;
+        }
+        close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+int mux_stdio_open(struct mux_stdio *io, int pty) {
+    int pipes[2], ptmx, i, err;
+
+    for (i = 0; i < MUX_CHANNELS; i++)
+        io->child[i] = io->relay[i] = -1;
+    io->slave = -1;
+    io->pts_slave[0] = '\0';
+
+    if (pty) {
+        ptmx = pts_open(io->pts_slave, sizeof(io->pts_slave));
+        if (ptmx < 0)
+            return -1;
+        io->relay[MUX_STDIN] = io->relay[MUX_STDOUT] = ptmx;
+        if (fcntl(ptmx, F_SETFD, FD_CLOEXEC) || set_nonblock(ptmx))
+            goto err;
+        io->slave = open(io->pts_slave, O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (io->slave == -1)
+            goto err;
+        return 0;
+    }
+
+    for (i = 0; i < MUX_CHANNELS; i++) {
+        if (pipe2(pipes, O_CLOEXEC))
+            goto err;
+        // The command reads stdin and writes the others
+        io->child[i] = pipes[i == MUX_STDIN ? 0 : 1];
+        io->relay[i] = pipes[i == MUX_STDIN ? 1 : 0];
+        if (set_nonblock(io->relay[i]))
+            goto err;
+    }
+    return 0;
+
+err:
+    err = errno;
+    mux_stdio_close(io->child);
+    mux_stdio_close(io->relay);
+    if (io->slave != -1)
+        close(io->slave);
+    io->slave = -1;
+    errno = err;
+    return -1;
+}
+
+/*
+ * Make room for "len" more bytes of frames, or mark the relay broken.
+ */
+static char *mux_reserve(struct mux *m, size_t len) {
+    char *out;
+    size_t size;
+
+    if (m->out_off == m->out_len) {
+        m->out_off = m->out_len = 0;
+    } else if (m->out_len + len > m->out_size && m->out_off) {
+        memmove(m->out, m->out + m->out_off, m->out_len - m->out_off);
+        m->out_len -= m->out_off;
+        m->out_off = 0;
+    }
+    if (m->out_len + len > m->out_size) {
+        size = m->out_size ? m->out_size : MUX_FRAME_MAX;
+        while (size < m->out_len + len)
+            size *= 2;
+        out = realloc(m->out, size);
+        if (out == NULL) {
+            LOGE("unable to grow mux queue");
+            m->broken = 1;
+            return NULL;
+        }
+        m->out = out;
+        m->out_size = size;
+    }
+    return m->out + m->out_len;
+}
+
+static void mux_queue(struct mux *m, int type, int channel, const void *data, uint32_t len) {
+    struct mux_header hdr = { .type = type, .channel = channel, .len = len };
+    char *out = mux_reserve(m, sizeof(hdr) + (data ? len : 0));
+
+    if (out == NULL)
+        return;
+    memcpy(out, &hdr, sizeof(hdr));
+    if (data)
+        memcpy(out + sizeof(hdr), data, len);
+    m->out_len += sizeof(hdr) + (data ? len : 0);
+}
+
+static size_t mux_queued(const struct mux *m) {
+    return m->out_len - m->out_off;
+}
+
+/*
+ * Forget the local end of "c", closing it unless another channel
+ * still uses it.
+ */
+static void channel_close(struct mux *m, struct mux_channel *c) {
+    int i;
+
+    if (c->fd == -1)
+        return;
+    for (i = 0; i < MUX_CHANNELS; i++) {
+        if (&m->ch[i] != c && m->ch[i].fd == c->fd)
+            break;
+    }
+    // The client only borrows our stdio
+    if (i == MUX_CHANNELS && m->server)
+        close(c->fd);
+    c->fd = -1;
+}
+
+static void channel_eof(struct mux *m, int i) {
+    mux_queue(m, MUX_END, i, &m->ch[i].total, sizeof(m->ch[i].total));
+    m->ch[i].eof = 1;
+    channel_close(m, &m->ch[i]);
+}
+
+/*
+ * Read what "fd" of the sending channel "i" has into data frames, as
+ * far as credit goes. With "drain", the writers are gone and whatever
+ * is still holding it open may never close it, so there being nothing
+ * to read is the end of the stream.
+ */
+static void channel_read(struct mux *m, int i, int drain) {
+    struct mux_channel *c = &m->ch[i];
+    struct mux_header hdr = { .type = MUX_DATA, .channel = i };
+    size_t want;
+    ssize_t len;
+    char *out;
+
+    while (!c->eof && c->fd != -1 && c->credit > 0 && mux_queued(m) < MUX_FRAME_MAX) {
+        want = c->credit < MUX_FRAME_MAX ? c->credit : MUX_FRAME_MAX;
+        out = mux_reserve(m, sizeof(hdr) + want);
+        if (out == NULL)
+            return;
+        // The header goes in front once the length is known
+        len = read(c->fd, out + sizeof(hdr), want);
+        if (len > 0) {
+            hdr.len = len;
+            memcpy(out, &hdr, sizeof(hdr));
+            m->out_len += sizeof(hdr) + len;
+            c->credit -= len;
+            c->total += len;
+            STATS_ADD(relay_bytes, len);
+            // A short read means the rest isn't there yet
+            if ((size_t)len < want && !drain)
+                return;
+            continue;
+        }
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1 && errno == EAGAIN && !drain)
+            return;
+        // EOF, EIO from a PTY whose slave is gone, or nothing left
+        channel_eof(m, i);
+    }
+}
+
+/*
+ * Write what the receiving channel "i" has buffered to its FD, and
+ * return the credit for it. Data for a closed FD is dropped.
+ */
+static void channel_write(struct mux *m, int i) {
+    struct mux_channel *c = &m->ch[i];
+    ssize_t len;
+
+    while (c->off < c->len && c->fd != -1) {
+        len = write(c->fd, c->buf + c->off, c->len - c->off);
+        if (len > 0) {
+            c->off += len;
+            c->consumed += len;
+            continue;
+        }
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1 && errno == EAGAIN)
+            break;
+        // The reader went away
+        channel_close(m, c);
+    }
+    if (c->fd == -1) {
+        c->consumed += c->len - c->off;
+        c->off = c->len;
+    }
+    if (c->off == c->len) {
+        c->off = c->len = 0;
+        // The command gets its EOF once it read everything
+        if (c->eof)
+            channel_close(m, c);
+    }
+
+    // Returned in batches, unless there is nothing more to write
+    if (!c->eof && c->consumed && (c->consumed >= MUX_WINDOW / 4 || c->len == 0)) {
+        mux_queue(m, MUX_CREDIT, i, NULL, c->consumed);
+        c->consumed = 0;
+    }
+}
+
+/*
+ * Bytes following the header "hdr", which for credit is none.
+ */
+static uint32_t frame_size(const struct mux_header *hdr) {
+    return hdr->type == MUX_CREDIT ? 0 : hdr->len;
+}
+
+/*
+ * Check the header of the frame in m->hdr, and make room for its data.
+ *
+ * Return Value
+ * on a protocol error, -1
+ * else 0
+ */
+static int frame_begin(struct mux *m) {
+    struct mux_header *hdr = &m->hdr;
+    struct mux_channel *c;
+
+    if (hdr->channel >= MUX_CHANNELS)
+        return -1;
+    c = &m->ch[hdr->channel];
+    switch (hdr->type) {
+    case MUX_DATA:
+        if (c->send || c->eof || hdr->len == 0 || hdr->len > MUX_FRAME_MAX ||
+                c->len - c->off + hdr->len > MUX_WINDOW)
+            return -1;
+        if (c->len + hdr->len > MUX_WINDOW) {
+            memmove(c->buf, c->buf + c->off, c->len - c->off);
+            c->len -= c->off;
+            c->off = 0;
+        }
+        return 0;
+    case MUX_CREDIT:
+        if (!c->send || (uint64_t)c->credit + hdr->len > MUX_WINDOW)
+            return -1;
+        return 0;
+    case MUX_WINSIZE:
+        return m->server && hdr->len == sizeof(m->body.ws) ? 0 : -1;
+    case MUX_EXIT:
+        return !m->server && !m->exited && hdr->len == sizeof(m->body.code) ? 0 : -1;
+    case MUX_END:
+        return !c->send && !c->eof && hdr->len == sizeof(m->body.total) ? 0 : -1;
+    }
+    return -1;
+}
+
+/*
+ * Act on the frame which just came in completely.
+ */
+static void frame_end(struct mux *m) {
+    struct mux_header *hdr = &m->hdr;
+    struct mux_channel *c = &m->ch[hdr->channel];
+
+    switch (hdr->type) {
+    case MUX_END:
+        if (m->body.total != c->total) {
+            LOGE("mux channel %d ended after %llu of %llu bytes", hdr->channel,
+                    (unsigned long long)c->total, (unsigned long long)m->body.total);
+            errno = EPROTO;
+            m->broken = 1;
+            break;
+        }
+        c->eof = 1;
+        break;
+    case MUX_CREDIT:
+        c->credit += hdr->len;
+        break;
+    case MUX_WINSIZE:
+        if (m->ch[MUX_STDIN].fd != -1)
+            ioctl(m->ch[MUX_STDIN].fd, TIOCSWINSZ, &m->body.ws);
+        break;
+    case MUX_EXIT:
+        m->exited = 1;
+        m->code = m->body.code;
+        break;
+    }
+}
+
+/*
+ * Receive what the socket has, data straight into the buffer of its
+ * channel.
+ */
+static void mux_recv(struct mux *m) {
+    struct mux_channel *c;
+    ssize_t len;
+    int frames = 0;
+    char *dst;
+    size_t want;
+
+    while (!m->broken && !m->exited && frames < MUX_RECV_BATCH) {
+        if (m->hdr_got < sizeof(m->hdr)) {
+            dst = (char *)&m->hdr + m->hdr_got;
+            want = sizeof(m->hdr) - m->hdr_got;
+        } else if (m->hdr.type == MUX_DATA) {
+            c = &m->ch[m->hdr.channel];
+            dst = c->buf + c->len;
+            want = m->hdr.len - m->body_got;
+        } else {
+            dst = (char *)&m->body + m->body_got;
+            want = frame_size(&m->hdr) - m->body_got;
+        }
+
+        if (want) {
+            len = recv(m->sockfd, dst, want, MSG_DONTWAIT);
+            if (len == -1 && errno == EINTR)
+                continue;
+            if (len == -1 && errno == EAGAIN)
+                return;
+            if (len <= 0) {
+                if (len == 0)
+                    errno = ECONNRESET;
+                m->broken = 1;
+                return;
+            }
+            STATS_ADD(bytes_in, len);
+            if (m->hdr_got < sizeof(m->hdr)) {
+                m->hdr_got += len;
+                if (m->hdr_got < sizeof(m->hdr))
+                    continue;
+                if (frame_begin(m)) {
+                    LOGE("bad mux frame %d on channel %d", m->hdr.type, m->hdr.channel);
+                    errno = EPROTO;
+                    m->broken = 1;
+                    return;
+                }
+                if (frame_size(&m->hdr))
+                    continue;
+            } else {
+                m->body_got += len;
+                if (m->hdr.type == MUX_DATA) {
+                    m->ch[m->hdr.channel].len += len;
+                    m->ch[m->hdr.channel].total += len;
+                    STATS_ADD(relay_bytes, len);
+                }
+                if (m->body_got < frame_size(&m->hdr))
+                    continue;
+            }
+        }
+
+        frame_end(m);
+        m->hdr_got = m->body_got = 0;
+        frames++;
+    }
+}
+
+static void mux_send(struct mux *m) {
+    ssize_t len;
+
+    while (mux_queued(m) && !m->broken) {
+        len = send(m->sockfd, m->out + m->out_off, mux_queued(m), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (len > 0) {
+            m->out_off += len;
+            STATS_ADD(bytes_out, len);
+            continue;
+        }
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1 && errno == EAGAIN)
+            return;
+        m->broken = 1;
+    }
+}
+
+/*
+ * Set up the channels on "fds", each of them sending when "send" has
+ * its bit set. Those without a local end are over from the start.
+ */
+static int mux_init(struct mux *m, int sockfd, int server, const int fds[MUX_CHANNELS], int send) {
+    int i;
+
+    memset(m, 0, sizeof(*m));
+    m->sockfd = sockfd;
+    m->server = server;
+    for (i = 0; i < MUX_CHANNELS; i++) {
+        m->ch[i].fd = fds[i];
+        m->ch[i].send = (send >> i) & 1;
+    }
+    for (i = 0; i < MUX_CHANNELS; i++) {
+        if (m->ch[i].send) {
+            m->ch[i].credit = MUX_WINDOW;
+            if (fds[i] == -1)
+                channel_eof(m, i);
+        } else {
+            m->ch[i].buf = malloc(MUX_WINDOW);
+            if (m->ch[i].buf == NULL) {
+                LOGE("unable to allocate mux buffers");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void mux_destroy(struct mux *m) {
+    int i;
+
+    for (i = 0; i < MUX_CHANNELS; i++)
+        free(m->ch[i].buf);
+    free(m->out);
+}
+
+/*
+ * Wait for the socket, the channels and "sigfd", and move whatever is
+ * ready. Returns whether "sigfd" is readable.
+ */
+static int mux_step(struct mux *m, int sigfd) {
+    struct pollfd pfds[2 + MUX_CHANNELS];
+    int chans[2 + MUX_CHANNELS];
+    struct mux_channel *c;
+    int nfds = 0, i;
+
+    pfds[nfds].fd = sigfd;
+    pfds[nfds++].events = POLLIN;
+    pfds[nfds].fd = m->sockfd;
+    pfds[nfds++].events = (m->exited ? 0 : POLLIN) | (mux_queued(m) ? POLLOUT : 0);
+    for (i = 0; i < MUX_CHANNELS; i++) {
+        c = &m->ch[i];
+        if (c->fd == -1)
+            continue;
+        if (c->send && !c->eof && !m->exited && c->credit > 0 && mux_queued(m) < MUX_FRAME_MAX)
+            pfds[nfds].events = POLLIN;
+        else if (!c->send && c->off < c->len)
+            pfds[nfds].events = POLLOUT;
+        else
+            continue;
+        pfds[nfds].fd = c->fd;
+        chans[nfds++] = i;
+    }
+
+    if (poll(pfds, nfds, -1) == -1) {
+        if (errno != EINTR)
+            m->broken = 1;
+        return 0;
+    }
+
+    if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        mux_recv(m);
+    for (i = 2; i < nfds; i++) {
+        if (!pfds[i].revents)
+            continue;
+        if (m->ch[chans[i]].send)
+            channel_read(m, chans[i], 0);
+        else
+            channel_write(m, chans[i]);
+    }
+    // Received data may be writable right away, and returns credit
+    for (i = 0; i < MUX_CHANNELS; i++) {
+        if (!m->ch[i].send && (m->ch[i].off < m->ch[i].len || m->ch[i].eof))
+            channel_write(m, i);
+    }
+    mux_send(m);
+    return pfds[0].revents != 0;
+}
+
+int mux_serve(int sockfd, struct mux_stdio *io, pid_t child) {
+    struct signalfd_siginfo si;
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old_pipe;
+    sigset_t mask, old_mask;
+    int sigfd, status, exited = 0, sent_exit = 0, code = -1, i;
+    struct mux m;
+
+    // Exits arrive through a signalfd, a command which closed its
+    // stdin shows as EPIPE
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    sigaction(SIGPIPE, &ign, &old_pipe);
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1)
+        PLOGE("signalfd");
+
+    if (mux_init(&m, sockfd, 1, io->relay, (1 << MUX_STDOUT) | (1 << MUX_STDERR)) || sigfd == -1)
+        m.broken = 1;
+    // The relay ends belong to the channels now
+    for (i = 0; i < MUX_CHANNELS; i++)
+        io->relay[i] = -1;
+
+    while (!m.broken && !(sent_exit && !mux_queued(&m))) {
+        if (!exited && waitpid(child, &status, WNOHANG) == child) {
+            exited = 1;
+            code = exit_code(status);
+            // Let the master hang up once the rest of the slaves close
+            if (io->slave != -1)
+                close(io->slave);
+            io->slave = -1;
+        }
+        if (exited) {
+            // Take what is left of the output, then the exit code
+            for (i = 0; i < MUX_CHANNELS; i++) {
+                if (m.ch[i].send)
+                    channel_read(&m, i, 1);
+            }
+            if (!sent_exit && m.ch[MUX_STDOUT].eof && m.ch[MUX_STDERR].eof) {
+                int32_t exit_code = code;
+                mux_queue(&m, MUX_EXIT, 0, &exit_code, sizeof(exit_code));
+                sent_exit = 1;
+            }
+            mux_send(&m);
+            if (sent_exit && !mux_queued(&m))
+                break;
+        }
+        if (mux_step(&m, sigfd))
+            while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+    }
+
+    if (m.broken) {
+        LOGE("mux client went away: %s", strerror(errno));
+        // Hung up before its stdin closes, so the command can't take
+        // what came of it for all there was
+        if (!exited)
+            kill(-child, SIGHUP);
+        for (i = 0; i < MUX_CHANNELS; i++)
+            channel_close(&m, &m.ch[i]);
+        if (!exited)
+            waitpid(child, &status, 0);
+        code = -1;
+    }
+    for (i = 0; i < MUX_CHANNELS; i++)
+        channel_close(&m, &m.ch[i]);
+    if (io->slave != -1)
+        close(io->slave);
+    io->slave = -1;
+
+    mux_destroy(&m);
+    if (sigfd != -1)
+        close(sigfd);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return code;
+}
+
+/*
+ * Send the window size of stdout as the one of the PTY.
+ */
+static void queue_winsize(struct mux *m) {
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+        mux_queue(m, MUX_WINSIZE, 0, &ws, sizeof(ws));
+}
+
+/*
+ * Our own stdio FD "fd", or -1 when it isn't open.
+ */
+static int stdio_fd(int fd) {
+    return fcntl(fd, F_GETFD) == -1 ? -1 : fd;
+}
+
+int mux_client(int sockfd, int pty) {
+    struct signalfd_siginfo si;
+    sigset_t mask, old_mask;
+    int fds[MUX_CHANNELS] = {
+        stdio_fd(STDIN_FILENO), stdio_fd(STDOUT_FILENO), stdio_fd(STDERR_FILENO)
+    };
+    int sigfd, quit = 0, i, err, ret = -1;
+    struct mux m;
+
+    // Signals are received through a signalfd instead of handlers
+    sigemptyset(&mask);
+    for (i = 0; quit_signals[i]; i++)
+        sigaddset(&mask, quit_signals[i]);
+    if (pty)
+        sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, &old_mask) == -1)
+        return -1;
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1) {
+        err = errno;
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        errno = err;
+        return -1;
+    }
+
+    if (mux_init(&m, sockfd, 0, fds, 1 << MUX_STDIN)) {
+        errno = ENOMEM;
+        goto out;
+    }
+    if (pty) {
+        queue_winsize(&m);
+        if (isatty(STDIN_FILENO))
+            set_stdin_raw();
+    }
+    mux_send(&m);
+
+    while (!m.broken && !quit) {
+        // Done once the exit code came, and everything before it is out
+        if (m.exited && m.ch[MUX_STDOUT].off == m.ch[MUX_STDOUT].len &&
+                m.ch[MUX_STDERR].off == m.ch[MUX_STDERR].len) {
+            ret = m.code;
+            break;
+        }
+        if (!mux_step(&m, sigfd))
+            continue;
+        while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+            if (si.ssi_signo == SIGWINCH)
+                queue_winsize(&m);
+            else
+                quit = 1;
+        }
+        mux_send(&m);
+    }
+    if (quit)
+        errno = EINTR;
+
+out:
+    err = errno;
+    restore_stdin();
+    mux_destroy(&m);
+    close(sigfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,227 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * pathcache.c
+ *
+ * Cache of where commands are on PATH, see pathcache.h
+ */
+
+#define _GNU_SOURCE /* for strchrnul() */
+
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "su.h"
+#include "utils.h"
+#include "stats.h"
+#include "pathcache.h"
+
+#define PATH_CACHE_SIZE 32
+
+// Anything which could change what execvp() finds in a directory
+#define PATH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+        IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct cached_path {
+    char *path;
+    // the name it was looked up by, at the end of path
+    const char *name;
+    unsigned long used;
+};
+
+static struct cached_path cache[PATH_CACHE_SIZE];
+static int cache_count;
+static unsigned long cache_clock;
+
+// SUD_PATH_CACHE, and the process which owns the cache and reads the
+// inotify instance watching PATH, see pathcache_init()
+static int cache_enabled;
+static pid_t watch_owner;
+static int watch_fd = -1;
+// PATH it watches, and how many of its directories from the first one
+static char *watch_path;
+static int watched_dirs;
+// inotify isn't available, e.g. denied by SELinux
+static int watch_broken;
+
+static void cache_reset(void) {
+    while (cache_count > 0)
+        free(cache[--cache_count].path);
+    if (watch_fd != -1)
+        close(watch_fd);
+    watch_fd = -1;
+    free(watch_path);
+    watch_path = NULL;
+    watched_dirs = 0;
+}
+
+/*
+ * Watch the directory "dir" of "len" bytes. One which doesn't exist yet
+ * would shadow the later ones once it does, so then the closest parent
+ * which exists is watched for it.
+ */
+static int watch_dir(const char *dir, size_t len) {
+    char buf[PATH_MAX];
+    char *slash;
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, dir, len);
+    buf[len] = 0;
+
+    while (inotify_add_watch(watch_fd, buf, PATH_EVENTS | IN_ONLYDIR) == -1) {
+        if (errno != ENOENT)
+            return -1;
+        slash = strrchr(buf, '/');
+        if (slash == buf && buf[1] == 0)
+            return -1;
+        slash[slash == buf] = 0;
+    }
+    return 0;
+}
+
+/*
+ * Watch the directories of "path" up to the first relative one, which
+ * depends on the working directory, or the first one which can't be
+ * watched. Only what is found before it can be cached.
+ */
+static int watch_start(const char *path) {
+    const char *dir, *end;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd == -1) {
+        PLOGE("inotify_init1");
+        watch_broken = 1;
+        return -1;
+    }
+    watch_path = strdup(path);
+    if (watch_path == NULL) {
+        cache_reset();
+        return -1;
+    }
+
+    for (dir = path; ; dir = end + 1) {
+        end = strchrnul(dir, ':');
+        if (*dir != '/' || watch_dir(dir, end - dir))
+            break;
+        watched_dirs++;
+        if (*end == 0)
+            break;
+    }
+    LOGD("watching %d directories of PATH %s", watched_dirs, path);
+    return 0;
+}
+
+/*
+ * Whether anything happened in the watched directories. A forked process
+ * only peeks, reading would take the events from the owner.
+ */
+static int watch_changed(int owner) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = watch_fd, .events = POLLIN };
+    ssize_t len;
+
+    if (!owner)
+        return poll(&pfd, 1, 0) != 0;
+    len = read(watch_fd, buf, sizeof(buf));
+    return len > 0 || (len == -1 && errno != EAGAIN);
+}
+
+/*
+ * Find "name" in the watched directories of PATH like execvp(), which
+ * carries on past files it can't execute.
+ */
+static char *resolve(const char *name) {
+    char buf[PATH_MAX];
+    const char *dir, *end;
+    struct stat st;
+    int i;
+
+    for (i = 0, dir = watch_path; i < watched_dirs; i++, dir = end + 1) {
+        end = strchrnul(dir, ':');
+        if (snprintf(buf, sizeof(buf), "%.*s/%s", (int)(end - dir), dir, name) >= (int)sizeof(buf))
+            continue;
+        if (access(buf, X_OK) == 0 && stat(buf, &st) == 0 && S_ISREG(st.st_mode))
+            return strdup(buf);
+    }
+    return NULL;
+}
+
+void pathcache_init(void) {
+    cache_enabled = env_int("SUD_PATH_CACHE", DAEMON_PATH_CACHE);
+    watch_owner = getpid();
+}
+
+const char *pathcache_lookup(const char *name) {
+    const char *path = getenv("PATH");
+    int owner = watch_owner == getpid();
+    struct cached_path *entry;
+    char *found;
+    int i;
+
+    if (watch_broken || !cache_enabled || path == NULL || *name == 0 || strchr(name, '/'))
+        return NULL;
+
+    // Anyone else only takes what the owner has, while it is current,
+    // and leaves the rest to execvp() rather than watching PATH itself
+    if (!owner) {
+        if (watch_fd == -1 || strcmp(watch_path, path) || watch_changed(0))
+            return NULL;
+    } else if (watch_fd != -1 && (strcmp(watch_path, path) || watch_changed(1))) {
+        cache_reset();
+    }
+    if (watch_fd == -1 && watch_start(path))
+        return NULL;
+
+    for (i = 0; i < cache_count; i++) {
+        entry = &cache[i];
+        if (!strcmp(entry->name, name)) {
+            entry->used = ++cache_clock;
+            STATS_INC(path_hits);
+            return entry->path;
+        }
+    }
+
+    STATS_INC(path_misses);
+    if (!owner)
+        return NULL;
+    found = resolve(name);
+    if (found == NULL)
+        return NULL;
+
+    if (cache_count < PATH_CACHE_SIZE) {
+        entry = &cache[cache_count++];
+    } else {
+        entry = &cache[0];
+        for (i = 1; i < cache_count; i++)
+            if (cache[i].used < entry->used)
+                entry = &cache[i];
+        free(entry->path);
+    }
+    entry->path = found;
+    entry->name = found + strlen(found) - strlen(name);
+    entry->used = ++cache_clock;
+    return entry->path;
+}
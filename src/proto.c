@@ -0,0 +1,606 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * proto.c
+ *
+ * Single message handshake between connect_daemon() and the daemon
+ */
+
+#define _GNU_SOURCE /* for MSG_CMSG_CLOEXEC */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "su.h"
+#include "proto.h"
+
+/*
+ * Write out everything described by "msg", attaching its control
+ * message of "msg" to the first chunk only.
+ */
+static int sendmsg_all(int sockfd, struct msghdr *msg) {
+    ssize_t ret;
+
+    while (msg->msg_iovlen > 0) {
+        ret = sendmsg(sockfd, msg, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        // The FDs went out with the first chunk
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+
+        while (msg->msg_iovlen > 0 && (size_t)ret >= msg->msg_iov->iov_len) {
+            ret -= msg->msg_iov->iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+        if (msg->msg_iovlen > 0) {
+            msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + ret;
+            msg->msg_iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+int handshake_send(int sockfd, const struct handshake *hs) {
+    struct handshake_header hdr = {
+        .magic   = HANDSHAKE_MAGIC,
+        .version = PROTO_VERSION,
+        .pid     = hs->pid,
+        .uid     = hs->uid,
+        .ppid    = hs->ppid,
+        .flags   = hs->flags,
+        .argc    = hs->argc,
+        .request_id = hs->request_id,
+    };
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * 3)];
+    struct msghdr msg = { 0 };
+    struct iovec *iov;
+    int fds[3], nfds = 0;
+    size_t size = 0;
+    int i, ret;
+
+    if (hs->argc < 0 || hs->argc > HANDSHAKE_MAX_ARGS) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    // Only send the FDs which are actually open, or sendmsg will EBADF
+    for (i = 0; i < 3; i++) {
+        if (hs->fds[i] == -1)
+            continue;
+        if (fcntl(hs->fds[i], F_GETFD) == -1) {
+            if (errno != EBADF)
+                return -1;
+            continue;
+        }
+        hdr.fds |= 1 << i;
+        fds[nfds++] = hs->fds[i];
+    }
+
+    iov = malloc(sizeof(*iov) * (hs->argc + 2));
+    if (iov == NULL)
+        return -1;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = hs->pts_slave;
+    iov[1].iov_len  = strlen(hs->pts_slave) + 1;
+    size += iov[1].iov_len;
+    for (i = 0; i < hs->argc; i++) {
+        iov[i + 2].iov_base = hs->argv[i];
+        iov[i + 2].iov_len  = strlen(hs->argv[i]) + 1;
+        size += iov[i + 2].iov_len;
+    }
+    if (size > HANDSHAKE_MAX_SIZE) {
+        free(iov);
+        errno = E2BIG;
+        return -1;
+    }
+    hdr.size = size;
+
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = hs->argc + 2;
+    if (nfds) {
+        msg.msg_control    = cmsgbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    ret = sendmsg_all(sockfd, &msg);
+    free(iov);
+    return ret;
+}
+
+static void close_fds(const int *fds, int nfds) {
+    int i;
+
+    for (i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+}
+
+/*
+ * Add the FDs attached to "msg" to the "nfds" in "fds", which has room
+ * for 3. Any beyond that are closed.
+ *
+ * Return Value
+ * on failure, -1: too many FDs arrived
+ * on success, 0
+ */
+static int take_fds(struct msghdr *msg, int *fds, int *nfds) {
+    struct cmsghdr *cmsg;
+    int i, count, ret = 0;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+            if (*nfds < 3) {
+                fds[(*nfds)++] = fd;
+            } else {
+                close(fd);
+                ret = -1;
+            }
+        }
+    }
+    if (ret || (msg->msg_flags & MSG_CTRUNC)) {
+        LOGE("handshake carried too many fds");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check a received header before anything it announces is read.
+ */
+static int check_header(const struct handshake_header *hdr) {
+    if (hdr->magic != HANDSHAKE_MAGIC || hdr->version < 2 || hdr->version > PROTO_VERSION) {
+        LOGE("unsupported handshake version %u", hdr->version);
+        return -1;
+    }
+    if (hdr->argc > HANDSHAKE_MAX_ARGS || hdr->size == 0 || hdr->size > HANDSHAKE_MAX_SIZE) {
+        LOGE("invalid handshake: %u args, %u bytes", hdr->argc, hdr->size);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Allocate room for the strings of "hdr" in the arena of "hs", with
+ * argv right after them, suitably aligned, to point into them.
+ *
+ * Returns where the strings go, or NULL on failure.
+ */
+static char *alloc_strings(struct handshake *hs, const struct handshake_header *hdr) {
+    size_t argv_off = (hdr->size + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+    char *buf;
+
+    buf = arena_alloc(hs->arena, argv_off + sizeof(char *) * (hdr->argc + 1));
+    if (buf == NULL) {
+        LOGE("unable to allocate handshake");
+        return NULL;
+    }
+    hs->argv = (char **)(buf + argv_off);
+    return buf;
+}
+
+/*
+ * Fill in "hs" from "hdr", the strings received into "buf" and the
+ * "nfds" FDs which came along.
+ *
+ * Return Value
+ * on failure, -1. The FDs are left to the caller.
+ * on success, 0. The FDs belong to "hs".
+ */
+static int parse_request(struct handshake *hs, const struct handshake_header *hdr,
+        char *buf, const int *fds, int nfds) {
+    char *p = buf, *end = buf + hdr->size;
+    int i, j, expected = 0;
+
+    if (buf[hdr->size - 1] != '\0') {
+        LOGE("unable to read handshake strings");
+        return -1;
+    }
+
+    // FDs can't travel over TCP, in which case none arrive at all
+    for (i = 0; i < 3; i++) {
+        if (hdr->fds & (1 << i))
+            expected++;
+    }
+    if (nfds != 0 && nfds != expected) {
+        LOGE("handshake announced %d fds, got %d", expected, nfds);
+        return -1;
+    }
+
+    hs->pts_slave = p;
+    p += strlen(p) + 1;
+    for (i = 0; i < (int)hdr->argc; i++) {
+        if (p >= end) {
+            LOGE("handshake is missing args");
+            return -1;
+        }
+        hs->argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    hs->argv[hdr->argc] = NULL;
+
+    if (nfds) {
+        for (i = 0, j = 0; i < 3; i++) {
+            if (hdr->fds & (1 << i))
+                hs->fds[i] = fds[j++];
+        }
+    }
+    hs->version = hdr->version;
+    hs->pid  = hdr->pid;
+    hs->uid  = hdr->uid;
+    hs->ppid = hdr->ppid;
+    hs->flags = hdr->flags;
+    hs->argc = hdr->argc;
+    return 0;
+}
+
+static void handshake_init(struct handshake *hs, struct arena *arena) {
+    memset(hs, 0, sizeof(*hs));
+    hs->fds[0] = hs->fds[1] = hs->fds[2] = -1;
+    hs->arena = arena;
+    arena_reset(arena);
+}
+
+int handshake_recv(int sockfd, struct handshake *hs, struct arena *arena) {
+    struct handshake_header hdr = { 0 };
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * 3)];
+    int version = hs->version;
+    struct iovec iov = {
+        .iov_base = &hdr,
+        .iov_len  = version >= 5 ? sizeof(hdr) : HANDSHAKE_HEADER_V2_SIZE,
+    };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = cmsgbuf,
+        .msg_controllen = sizeof(cmsgbuf),
+    };
+    int fds[3], nfds = 0;
+    ssize_t len;
+    char *buf;
+
+    handshake_init(hs, arena);
+
+    do {
+        len = recvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (len == -1 && errno == EINTR);
+
+    if (len > 0 && take_fds(&msg, fds, &nfds))
+        goto err;
+    if (len == 0 && nfds == 0) {
+        return 1;
+    }
+    if (len != (ssize_t)iov.iov_len) {
+        LOGE("unable to read handshake: %zd", len);
+        goto err;
+    }
+    if (check_header(&hdr))
+        goto err;
+    if ((hdr.version >= 5) != (version >= 5)) {
+        LOGE("handshake version changed from %d to %u", version, hdr.version);
+        goto err;
+    }
+    if (hdr.version >= 5) {
+        hs->request_id = hdr.request_id;
+    } else if (hdr.version >= 3) {
+        do {
+            len = recv(sockfd, &hs->request_id, sizeof(hs->request_id), MSG_WAITALL);
+        } while (len == -1 && errno == EINTR);
+        if (len != sizeof(hs->request_id)) {
+            LOGE("unable to read request id");
+            goto err;
+        }
+    }
+
+    buf = alloc_strings(hs, &hdr);
+    if (buf == NULL)
+        goto err;
+    do {
+        len = recv(sockfd, buf, hdr.size, MSG_WAITALL);
+    } while (len == -1 && errno == EINTR);
+    if (len != (ssize_t)hdr.size) {
+        LOGE("unable to read handshake strings");
+        goto err;
+    }
+    if (parse_request(hs, &hdr, buf, fds, nfds))
+        goto err;
+    return 0;
+
+err:
+    close_fds(fds, nfds);
+    handshake_free(hs);
+    hs->fds[0] = hs->fds[1] = hs->fds[2] = -1;
+    return -1;
+}
+
+// What handshake_read() is waiting for. The legacy handshake is a
+// sequence of ints and strings, each string length first, with each
+// stdio FD attached to a byte of its own.
+enum {
+    READ_START,
+    READ_HEADER,
+    READ_REQUEST_ID,
+    READ_STRINGS,
+    READ_PTS,
+    READ_UID,
+    READ_PPID,
+    READ_FD,
+    READ_ARGC,
+    READ_ARG_LEN,
+    READ_ARG,
+};
+
+static void expect(struct handshake_reader *r, int state, void *field, size_t len) {
+    r->state = state;
+    r->field = field;
+    r->want = len;
+    r->got = 0;
+}
+
+void handshake_reader_init(struct handshake_reader *r, struct arena *arena) {
+    handshake_init(&r->hs, arena);
+    memset(&r->hdr, 0, sizeof(r->hdr));
+    r->nfds = 0;
+    // The magic and version, or the pid and PTS length of the legacy
+    // handshake, which are as long
+    expect(r, READ_START, &r->hdr, 2 * sizeof(uint32_t));
+}
+
+/*
+ * Receive what has arrived of the field being read, along with any
+ * FDs attached to it.
+ *
+ * Return Value
+ * on failure, -1
+ * once the field is complete, 0
+ * if the client hung up, 1
+ * if the rest hasn't arrived yet, HANDSHAKE_PARTIAL
+ */
+static int read_field(int sockfd, struct handshake_reader *r) {
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov;
+    struct msghdr msg = {
+        .msg_iov    = &iov,
+        .msg_iovlen = 1,
+    };
+    ssize_t len;
+
+    while (r->got < r->want) {
+        iov.iov_base = r->field + r->got;
+        iov.iov_len = r->want - r->got;
+        msg.msg_control = cmsgbuf;
+        msg.msg_controllen = sizeof(cmsgbuf);
+        len = recvmsg(sockfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return HANDSHAKE_PARTIAL;
+            PLOGE("unable to read handshake");
+            return -1;
+        }
+        if (take_fds(&msg, r->fds, &r->nfds))
+            return -1;
+        if (len == 0)
+            return 1;
+        r->got += len;
+    }
+    return 0;
+}
+
+/*
+ * Read a string of the legacy handshake next, whose length just
+ * arrived, into "state".
+ */
+static char *legacy_string(struct handshake_reader *r, int state) {
+    char *val;
+
+    if (r->value < 0) {
+        LOGE("invalid string length %d", r->value);
+        return NULL;
+    }
+    val = arena_alloc(r->hs.arena, (size_t)r->value + 1);
+    if (val == NULL) {
+        LOGE("handshake larger than %zu bytes", r->hs.arena->limit);
+        return NULL;
+    }
+    val[r->value] = '\0';
+    expect(r, state, val, r->value);
+    return val;
+}
+
+/*
+ * Take in the field which was just read, and pick the next one.
+ *
+ * Return Value
+ * on failure, -1
+ * once the request is complete, 0
+ * if there is another field to read, 1
+ */
+static int read_next(struct handshake_reader *r) {
+    struct handshake *hs = &r->hs;
+    int i, count;
+
+    switch (r->state) {
+    case READ_START:
+        if (r->hdr.magic == HANDSHAKE_MAGIC) {
+            expect(r, READ_HEADER, (char *)&r->hdr + r->got,
+                    (r->hdr.version >= 5 ? sizeof(r->hdr) : HANDSHAKE_HEADER_V2_SIZE) - r->got);
+            return 1;
+        }
+        // The legacy handshake starts with the client pid
+        hs->pid = (int32_t)r->hdr.magic;
+        r->value = (int32_t)r->hdr.version;
+        hs->pts_slave = legacy_string(r, READ_PTS);
+        return hs->pts_slave ? 1 : -1;
+
+    case READ_HEADER:
+        if (check_header(&r->hdr))
+            return -1;
+        if (r->hdr.version >= 5) {
+            hs->request_id = r->hdr.request_id;
+        } else if (r->hdr.version >= 3) {
+            expect(r, READ_REQUEST_ID, &hs->request_id, sizeof(hs->request_id));
+            return 1;
+        }
+        /* fall through */
+    case READ_REQUEST_ID:
+        r->strings = alloc_strings(hs, &r->hdr);
+        if (r->strings == NULL)
+            return -1;
+        expect(r, READ_STRINGS, r->strings, r->hdr.size);
+        return 1;
+
+    case READ_STRINGS:
+        if (parse_request(hs, &r->hdr, r->strings, r->fds, r->nfds))
+            return -1;
+        r->nfds = 0;
+        return 0;
+
+    case READ_PTS:
+        expect(r, READ_UID, &hs->uid, sizeof(hs->uid));
+        return 1;
+
+    case READ_UID:
+        expect(r, READ_PPID, &hs->ppid, sizeof(hs->ppid));
+        return 1;
+
+    case READ_PPID:
+        r->next = -1;
+        /* fall through */
+    case READ_FD:
+        if (r->next >= 0) {
+            // The byte of a closed stream comes without an FD
+            count = r->nfds - r->mark;
+            if (count > 1) {
+                LOGE("unable to read fd");
+                return -1;
+            }
+            if (count == 1)
+                hs->fds[r->next] = r->fds[r->nfds - 1];
+        }
+        if (++r->next < 3) {
+            r->mark = r->nfds;
+            expect(r, READ_FD, &r->byte, 1);
+            return 1;
+        }
+        expect(r, READ_ARGC, &hs->argc, sizeof(hs->argc));
+        return 1;
+
+    case READ_ARGC:
+        if (hs->argc < 0 || hs->argc > HANDSHAKE_MAX_ARGS) {
+            LOGE("unable to allocate args: %d", hs->argc);
+            return -1;
+        }
+        hs->argv = arena_alloc(hs->arena, sizeof(char *) * (hs->argc + 1));
+        if (hs->argv == NULL) {
+            LOGE("unable to allocate args");
+            return -1;
+        }
+        hs->argv[hs->argc] = NULL;
+        r->next = -1;
+        /* fall through */
+    case READ_ARG:
+        if (++r->next < hs->argc) {
+            expect(r, READ_ARG_LEN, &r->value, sizeof(r->value));
+            return 1;
+        }
+        // Only the FDs the request took are expected
+        for (i = 0, count = 0; i < 3; i++) {
+            if (hs->fds[i] != -1)
+                count++;
+        }
+        if (count != r->nfds) {
+            LOGE("handshake carried stray fds");
+            return -1;
+        }
+        r->nfds = 0;
+        return 0;
+
+    case READ_ARG_LEN:
+        hs->argv[r->next] = legacy_string(r, READ_ARG);
+        return hs->argv[r->next] ? 1 : -1;
+    }
+    return -1;
+}
+
+int handshake_read(int sockfd, struct handshake_reader *r) {
+    int ret;
+
+    for (;;) {
+        ret = read_field(sockfd, r);
+        if (ret == HANDSHAKE_PARTIAL)
+            return ret;
+        if (ret == 1) {
+            if (r->state == READ_START && r->got == 0 && r->nfds == 0)
+                return 1;
+            LOGE("client hung up during the handshake");
+            goto err;
+        }
+        if (ret)
+            goto err;
+
+        ret = read_next(r);
+        if (ret == 0)
+            return 0;
+        if (ret == -1)
+            goto err;
+    }
+
+err:
+    handshake_reader_abort(r);
+    return -1;
+}
+
+void handshake_reader_abort(struct handshake_reader *r) {
+    close_fds(r->fds, r->nfds);
+    r->nfds = 0;
+    handshake_free(&r->hs);
+}
+
+void handshake_free(struct handshake *hs) {
+    if (hs->arena)
+        arena_reset(hs->arena);
+    hs->argv = NULL;
+    hs->pts_slave = NULL;
+}
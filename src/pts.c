@@ -22,76 +22,163 @@
  * helper functions to handle raw input mode and terminal window resizing
  */
 
+#define _GNU_SOURCE /* for splice() */
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <termios.h>
 #include <errno.h>
-#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <poll.h>
 
 #include "pts.h"
+#include "uring.h"
+
+// Counters for the two relay paths, see pump_get_stats()
+static struct pump_stats stats;
+
+#define PUMP_COPY_SIZE      4096
+#define PUMP_SPLICE_SIZE    65536
+#define PUMP_RING_SIZE      65536
 
 /**
- * Helper functions
+ * State of a single relay from input FD to output FD.
+ *
+ * When both endpoints support it, data is moved through a pipe
+ * with splice() and never copied into userspace. Otherwise
+ * pipefd is -1 and data is copied through buf.
+ *
+ * Data read from the input but not yet written to the output
+ * is kept in the pipe (piped) or in buf (off to len), so the
+ * relay can be driven by a non-blocking output.
  */
-// Ensures all the data is written out
-static int write_blocking(int fd, char *buf, ssize_t bufsz) {
-    ssize_t ret, written;
+struct relay {
+    int input;
+    int output;
+    int pipefd[2];
+    int splice_out;
+    size_t piped;
+    size_t off;
+    size_t len;
+    char buf[PUMP_COPY_SIZE];
+};
+
+static void relay_use_copy(struct relay *r) {
+    if (r->pipefd[0] != -1) {
+        close(r->pipefd[0]);
+        close(r->pipefd[1]);
+        r->pipefd[0] = r->pipefd[1] = -1;
+        __atomic_fetch_add(&stats.fallbacks, 1, __ATOMIC_RELAXED);
+    }
+}
 
-    written = 0;
-    do {
-        ret = write(fd, buf + written, bufsz - written);
-        if (ret == -1) return -1;
-        written += ret;
-    } while (written < bufsz);
+static void relay_init(struct relay *r, int input, int output) {
+    r->input = input;
+    r->output = output;
+    r->splice_out = 1;
+    r->piped = r->off = r->len = 0;
+    if (pipe2(r->pipefd, O_CLOEXEC) == -1) {
+        r->pipefd[0] = r->pipefd[1] = -1;
+    }
+}
 
-    return 0;
+static void relay_destroy(struct relay *r) {
+    if (r->pipefd[0] != -1) {
+        close(r->pipefd[0]);
+        close(r->pipefd[1]);
+    }
 }
 
-/**
- * Pump data from input FD to output FD. If close_output is
- * true, then close the output FD when we're done.
- */
-static void pump_ex(int input, int output, int close_output) {
-    char buf[4096];
-    int len;
-    while ((len = read(input, buf, 4096)) > 0) {
-        if (write_blocking(output, buf, len) == -1) break;
-    }
-    close(input);
-    if (close_output) close(output);
+static int relay_pending(const struct relay *r) {
+    return r->piped > 0 || r->off < r->len;
 }
 
 /**
- * Pump data from input FD to output FD. Will close the
- * output FD when done.
+ * Read the next chunk of data from the input FD. Must only be
+ * called once the previous chunk has been flushed.
+ *
+ * Return Value
+ * the number of bytes read, 0 at the end of input, or -1 on error
  */
-static void pump(int input, int output) {
-    pump_ex(input, output, 1);
-}
+static ssize_t relay_fill(struct relay *r) {
+    ssize_t len;
+
+    if (r->pipefd[0] != -1) {
+        len = splice(r->input, NULL, r->pipefd[1], NULL, PUMP_SPLICE_SIZE, SPLICE_F_MOVE);
+        if (len > 0) {
+            r->piped = len;
+            __atomic_fetch_add(&stats.splice_bytes, len, __ATOMIC_RELAXED);
+            return len;
+        }
+        if (len == 0 || (errno != EINVAL && errno != ENOSYS)) return len;
 
-static void* pump_thread(void* data) {
-    int* files = (int*)data;
-    int input = files[0];
-    int output = files[1];
-    pump(input, output);
-    free(data);
-    return NULL;
-}
+        // The input can't be spliced, fall back for good
+        relay_use_copy(r);
+    }
 
-static void pump_async(int input, int output) {
-    pthread_t writer;
-    int* files = (int*)malloc(sizeof(int) * 2);
-    if (files == NULL) {
-        exit(-1);
+    len = read(r->input, r->buf, sizeof(r->buf));
+    if (len > 0) {
+        r->off = 0;
+        r->len = len;
+        __atomic_fetch_add(&stats.copy_bytes, len, __ATOMIC_RELAXED);
     }
-    files[0] = input;
-    files[1] = output;
-    pthread_create(&writer, NULL, pump_thread, files);
+    return len;
 }
 
+/**
+ * Write out the pending chunk. If the output FD does not support
+ * splice(), the data already in the pipe is copied out and the
+ * relay switches to the copy path.
+ *
+ * Return Value
+ * 0 once everything was written, 1 if the output would block,
+ * or -1 on error
+ */
+static int relay_flush(struct relay *r) {
+    ssize_t ret;
+
+    for (;;) {
+        if (r->off < r->len) {
+            ret = write(r->output, r->buf + r->off, r->len - r->off);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1 && errno == EAGAIN) return 1;
+            if (ret == -1) return -1;
+            r->off += ret;
+            continue;
+        }
+        r->off = r->len = 0;
+
+        if (r->piped == 0) return 0;
+
+        if (r->splice_out) {
+            ret = splice(r->pipefd[0], NULL, r->output, NULL, r->piped, SPLICE_F_MOVE);
+            if (ret > 0) {
+                r->piped -= ret;
+                continue;
+            }
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1 && errno == EAGAIN) return 1;
+            if (ret == -1 && errno == EINVAL) {
+                r->splice_out = 0;
+                continue;
+            }
+            return -1;
+        }
+
+        // The output can't be spliced, copy out what is left in the pipe
+        ret = read(r->pipefd[0], r->buf, r->piped < sizeof(r->buf) ? r->piped : sizeof(r->buf));
+        if (ret <= 0) return -1;
+        r->piped -= ret;
+        r->len = ret;
+        if (r->piped == 0) relay_use_copy(r);
+    }
+}
 
 /**
  * pts_open
@@ -204,134 +291,485 @@ int restore_stdin(void) {
     return 0;
 }
 
-// Flag indicating whether the sigwinch watcher should terminate.
-volatile static int closing_time = 0;
+// List of signals which cause process termination
+static const int quit_signals[] = { SIGALRM, SIGHUP, SIGPIPE, SIGQUIT, SIGTERM, SIGINT, 0 };
 
 /**
- * Thread process. Wait for a SIGWINCH to be received, then update 
- * the terminal size.
+ * Copy the terminal window size of "master" onto "slave".
  */
-static void *watch_sigwinch(void *data) {
-    sigset_t winch;
-    int sig;
-    int master = ((int *)data)[0];
-    int slave = ((int *)data)[1];
-
-    sigemptyset(&winch);
-    sigaddset(&winch, SIGWINCH);
+static void copy_winsize(int master, int slave) {
+    struct winsize w;
 
-    do {
-        // Wait for a SIGWINCH
-        sigwait(&winch, &sig);
+    if (ioctl(master, TIOCGWINSZ, &w) == -1) {
+        return;
+    }
+    ioctl(slave, TIOCSWINSZ, &w);
+}
 
-        if (closing_time) break;
+static int epoll_set(int epfd, int fd, uint32_t events, int *registered) {
+    struct epoll_event ev = {
+        .events = events,
+        .data.fd = fd,
+    };
 
-        // Get the new terminal size
-        struct winsize w;
-        if (ioctl(master, TIOCGWINSZ, &w) == -1) {
-            continue;
-        }
+    if (!events) {
+        if (*registered && epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) return -1;
+        *registered = 0;
+        return 0;
+    }
+    if (epoll_ctl(epfd, *registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+    *registered = 1;
+    return 0;
+}
 
-        // Set the new terminal size
-        ioctl(slave, TIOCSWINSZ, &w);
+/**
+ * Move one chunk of data through the relay, finishing off the
+ * previous chunk first if the output was not ready for it.
+ *
+ * Return Value
+ * 0 if data was moved, 1 if either side would block,
+ * or -1 once the input has ended or either side failed
+ */
+static int pump_chunk(struct relay *r) {
+    if (!relay_pending(r)) {
+        ssize_t len = relay_fill(r);
+        if (len == -1 && errno == EAGAIN) return 1;
+        if (len <= 0) return -1;
+    }
+    return relay_flush(r);
+}
 
-    } while (1);
+static void quit_sigset(sigset_t *set) {
+    int i;
 
-    free(data);
-    return NULL;
+    sigemptyset(set);
+    for (i = 0; quit_signals[i]; i++) {
+        sigaddset(set, quit_signals[i]);
+    }
 }
 
 /**
- * watch_sigwinch_async
- *
- * After calling this function, if the application receives
- * SIGWINCH, the terminal window size will be read from 
- * "input" and set on "output".
- *
- * NOTE: This function blocks SIGWINCH and spawns a thread.
- * NOTE 2: This function must be called before any of the
- *         pump functions.
- *
- * Arguments
- * master   A file descriptor of the TTY window size to follow
- * slave    A file descriptor of the TTY window size which is
- *          to be set on SIGWINCH
+ * Handle the signals queued on "sigfd".
  *
  * Return Value
- * on failure, -1 and errno will be set. In this case, no
- *      thread has been spawned and SIGWINCH will not be 
- *      blocked.
- * on success, 0
+ * 1 if this was the first quit signal and relaying has to stop, else 0
  */
-int watch_sigwinch_async(int master, int slave) {
-    pthread_t watcher;
-    int *files = (int *) malloc(sizeof(int) * 2);
-    if (files == NULL) {
-        return -1;
+static int pump_signals(int sigfd, int ptmx, int *quitting) {
+    struct signalfd_siginfo si;
+    sigset_t quit;
+    int stop = 0;
+
+    while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGWINCH) {
+            copy_winsize(STDOUT_FILENO, ptmx);
+        } else if (!*quitting) {
+            // Stop relaying and only wait for the exit code. A
+            // second quit signal takes its default action.
+            *quitting = stop = 1;
+            restore_stdin();
+            quit_sigset(&quit);
+            sigprocmask(SIG_UNBLOCK, &quit, NULL);
+        }
     }
+    return stop;
+}
 
-    // Block SIGWINCH so sigwait can later receive it
-    sigset_t winch;
-    sigemptyset(&winch);
-    sigaddset(&winch, SIGWINCH);
-    if (sigprocmask(SIG_BLOCK, &winch, NULL) == -1) {
-        free(files);
-        return -1;
-    }
+/**
+ * Take what the PTY has buffered once the session is over. The PTY may
+ * never hang up if the command left background processes holding the
+ * slave, so don't wait for more.
+ */
+static void pump_drain(int ptmx) {
+    struct relay out;
 
-    // Initialize some variables, then start the thread
-    closing_time = 0;
-    files[0] = master;
-    files[1] = slave;
-    int ret = pthread_create(&watcher, NULL, &watch_sigwinch, files);
-    if (ret != 0) {
-        free(files);
-        errno = ret;
-        return -1;
-    }
+    relay_init(&out, ptmx, STDOUT_FILENO);
+    while (pump_chunk(&out) == 0);
+    relay_destroy(&out);
+}
 
-    // Set the initial terminal size
-    raise(SIGWINCH);
-    return 0;
+// What the CQEs of pump_ring() are for: one of the operations of a
+// relay, numbered RING_OPS apart, or one of the session
+enum {
+    RING_READ,
+    RING_WRITE,
+    RING_POLL_IN,
+    RING_POLL_OUT,
+    RING_OPS,
+};
+#define RING_SOCKET (2 * RING_OPS)
+#define RING_SIGNAL (2 * RING_OPS + 1)
+#define RING_CANCEL (2 * RING_OPS + 2)
+
+/**
+ * A relay of pump_ring(), through registered buffer "index". Data read
+ * but not written yet is buf[off..len).
+ */
+struct ring_relay {
+    int input;
+    int output;
+    int index;
+    int open;
+    // SQEs without a CQE yet, the next step waits for all of them
+    int inflight;
+    // The last read or write would have blocked, poll before the next
+    int wait_in;
+    int wait_out;
+    size_t off;
+    size_t len;
+    char *buf;
+};
+
+static struct io_uring_sqe *ring_op(struct uring *ring, int opcode, int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    if (sqe) {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = tag;
+    }
+    return sqe;
 }
 
 /**
- * watch_sigwinch_cleanup
+ * Cancel the operations tagged "from" up to "to", those which are in
+ * flight anyway.
  *
- * Cause the SIGWINCH watcher thread to terminate
+ * Return Value
+ * the number of SQEs queued, or -1 if the ring was full
  */
-void watch_sigwinch_cleanup(void) {
-    closing_time = 1;
-    raise(SIGWINCH);
+static int ring_cancel(struct uring *ring, int from, int to) {
+    struct io_uring_sqe *sqe;
+    int tag;
+
+    for (tag = from; tag < to; tag++) {
+        if ((sqe = ring_op(ring, IORING_OP_ASYNC_CANCEL, -1, RING_CANCEL)) == NULL) return -1;
+        sqe->addr = tag;
+    }
+    return to - from;
 }
 
 /**
- * pump_stdin_async
+ * Queue the next step of relay "dir": write out what is left, or read
+ * the next chunk linked to writing all of it out, either of them behind
+ * a poll if the previous attempt would have blocked. A short read
+ * breaks the link and cancels the write, which then is queued with the
+ * actual length.
  *
- * Forward data from STDIN to the given FD
- * in a seperate thread
+ * Return Value
+ * the number of SQEs queued, or -1 if the ring was full
  */
-void pump_stdin_async(int outfd) {
-    // Put stdin into raw mode
-    set_stdin_raw();
+static int ring_step(struct uring *ring, struct ring_relay *r, int dir) {
+    struct io_uring_sqe *sqe;
+    int writing = r->off < r->len;
+    int base = dir * RING_OPS, count = 0;
+
+    if (writing ? r->wait_out : r->wait_in) {
+        sqe = ring_op(ring, IORING_OP_POLL_ADD, writing ? r->output : r->input,
+                base + (writing ? RING_POLL_OUT : RING_POLL_IN));
+        if (!sqe) return -1;
+        sqe->poll32_events = writing ? POLLOUT : POLLIN;
+        sqe->flags = IOSQE_IO_LINK;
+        count++;
+    }
+    if (!writing) {
+        sqe = ring_op(ring, IORING_OP_READ_FIXED, r->input, base + RING_READ);
+        if (!sqe) return -1;
+        sqe->addr = (uintptr_t)r->buf;
+        sqe->len = PUMP_RING_SIZE;
+        sqe->off = -1;
+        sqe->buf_index = r->index;
+        sqe->flags = IOSQE_IO_LINK;
+        count++;
+    }
+    sqe = ring_op(ring, IORING_OP_WRITE_FIXED, r->output, base + RING_WRITE);
+    if (!sqe) return -1;
+    sqe->addr = (uintptr_t)(r->buf + r->off);
+    sqe->len = writing ? r->len - r->off : PUMP_RING_SIZE;
+    sqe->off = -1;
+    sqe->buf_index = r->index;
+    count++;
+
+    r->wait_in = r->wait_out = 0;
+    r->inflight = count;
+    return count;
+}
 
-    // Pump data from stdin to the PTY
-    pump_async(STDIN_FILENO, outfd);
+/**
+ * Account for the CQE of operation "op" of relay "r".
+ */
+static void ring_complete(struct ring_relay *r, int op, int res) {
+    r->inflight--;
+    switch (op) {
+    case RING_READ:
+        if (res > 0) {
+            r->off = 0;
+            r->len = res;
+        } else if (res == -EAGAIN) {
+            r->wait_in = 1;
+        } else if (res != -ECANCELED) {
+            // End of input, or the slave hung up
+            r->open = 0;
+        }
+        break;
+    case RING_WRITE:
+        if (res > 0) {
+            r->off += res;
+            __atomic_fetch_add(&stats.ring_bytes, res, __ATOMIC_RELAXED);
+        } else if (res == -EAGAIN) {
+            r->wait_out = 1;
+        } else if (res != -ECANCELED) {
+            r->open = 0;
+        }
+        break;
+    default:
+        if (res < 0 && res != -ECANCELED) r->open = 0;
+        break;
+    }
+    if (r->off >= r->len) r->off = r->len = 0;
 }
 
 /**
- * pump_stdout_blocking
+ * The loop of pump_session() on io_uring, see SUD_IO_ENGINE. Each
+ * relay has a registered buffer, and every round of the loop submits
+ * the next operations and waits for their completions in a single
+ * io_uring_enter().
  *
- * Forward data from the FD to STDOUT.
- * Returns when the remote end of the FD closes.
+ * Return Value
+ * -2 if the kernel can't do it, otherwise like pump_session()
+ */
+static int pump_ring(int ptmx, int sockfd, int sigfd, int flags) {
+    static const int ops[] = {
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_POLL_ADD,
+        IORING_OP_ASYNC_CANCEL, -1,
+    };
+    static char bufs[2][PUMP_RING_SIZE];
+    struct iovec iov[2] = {
+        { bufs[0], PUMP_RING_SIZE },
+        { bufs[1], PUMP_RING_SIZE },
+    };
+    struct ring_relay relays[2] = {
+        { .input = STDIN_FILENO, .output = ptmx, .index = 0, .buf = bufs[0],
+          .open = flags & PUMP_STDIN },
+        { .input = ptmx, .output = STDOUT_FILENO, .index = 1, .buf = bufs[1],
+          .open = flags & PUMP_STDOUT },
+    };
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    struct uring ring;
+    int inflight = 0, quitting = 0, done = 0;
+    int i, n, tag, res;
+
+    if (uring_init(&ring, 32, ops)) return -2;
+    // Pinned memory, which older kernels count against a small RLIMIT_MEMLOCK
+    if (uring_register_buffers(&ring, iov, 2)) {
+        uring_destroy(&ring);
+        return -2;
+    }
+
+    if ((sqe = ring_op(&ring, IORING_OP_POLL_ADD, sockfd, RING_SOCKET)) == NULL) goto err;
+    sqe->poll32_events = POLLIN;
+    if ((sqe = ring_op(&ring, IORING_OP_POLL_ADD, sigfd, RING_SIGNAL)) == NULL) goto err;
+    sqe->poll32_events = POLLIN;
+    inflight += 2;
+
+    while (!done || inflight > 0) {
+        for (i = 0; i < 2 && !done; i++) {
+            if (!relays[i].open || relays[i].inflight) continue;
+            if ((n = ring_step(&ring, &relays[i], i)) == -1) goto err;
+            inflight += n;
+        }
+
+        if (uring_submit(&ring, 1)) goto err;
+
+        while ((cqe = uring_cqe(&ring)) != NULL) {
+            tag = cqe->user_data;
+            res = cqe->res;
+            uring_cqe_seen(&ring);
+            inflight--;
+
+            if (tag == RING_CANCEL) continue;
+            if (tag == RING_SIGNAL) {
+                if (pump_signals(sigfd, ptmx, &quitting)) {
+                    relays[0].open = relays[1].open = 0;
+                    if ((n = ring_cancel(&ring, 0, 2 * RING_OPS)) == -1) goto err;
+                    inflight += n;
+                }
+                if (!done) {
+                    if ((sqe = ring_op(&ring, IORING_OP_POLL_ADD, sigfd, RING_SIGNAL)) == NULL) goto err;
+                    sqe->poll32_events = POLLIN;
+                    inflight++;
+                }
+                continue;
+            }
+            if (tag == RING_SOCKET) {
+                // The exit code is ready, or the daemon went away.
+                // Either way, the session is over.
+                done = 1;
+                if ((n = ring_cancel(&ring, 0, 2 * RING_OPS)) == -1 ||
+                        ring_cancel(&ring, RING_SIGNAL, RING_SIGNAL + 1) == -1) goto err;
+                inflight += n + 1;
+                continue;
+            }
+            ring_complete(&relays[tag / RING_OPS], tag % RING_OPS, res);
+        }
+    }
+
+    // Output read before the end which didn't make it out yet
+    if (relays[1].open) {
+        struct ring_relay *r = &relays[1];
+        while (r->off < r->len) {
+            ssize_t len = write(STDOUT_FILENO, r->buf + r->off, r->len - r->off);
+            if (len == -1 && errno == EINTR) continue;
+            if (len <= 0) break;
+            r->off += len;
+        }
+    }
+    uring_destroy(&ring);
+
+    if (relays[1].open) {
+        fcntl(ptmx, F_SETFL, fcntl(ptmx, F_GETFL) | O_NONBLOCK);
+        pump_drain(ptmx);
+    }
+    return 0;
+
+err:
+    uring_destroy(&ring);
+    return -1;
+}
+
+/**
+ * pump_session
  *
- * Before returning, restores stdin settings.
+ * Relay a PTY session from a single thread. See pts.h.
  */
-void pump_stdout_blocking(int infd) {
-    // Pump data from stdout to PTY
-    pump_ex(infd, STDOUT_FILENO, 0 /* Don't close output when done */);
+int pump_session(int ptmx, int sockfd, int flags) {
+    sigset_t mask, old_mask;
+    struct epoll_event events[4];
+    struct relay in, out;
+    int sigfd, epfd, i, n;
+    int ptmx_registered = 0, stdin_registered = 0;
+    int stdin_open = flags & PUMP_STDIN;
+    int stdout_open = flags & PUMP_STDOUT;
+    int quitting = 0, done = 0, ret = -1;
+
+    // Signals are received through a signalfd instead of handlers
+    quit_sigset(&mask);
+    if (flags & PUMP_WINCH) {
+        sigaddset(&mask, SIGWINCH);
+    }
+    if (sigprocmask(SIG_BLOCK, &mask, &old_mask) == -1) {
+        return -1;
+    }
+
+    sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sigfd == -1) {
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+    if (flags & PUMP_WINCH) {
+        // Set the initial terminal size
+        copy_winsize(STDOUT_FILENO, ptmx);
+    }
+    if (stdin_open) {
+        // Put stdin into raw mode
+        set_stdin_raw();
+    }
+
+    if (uring_wanted()) {
+        ret = pump_ring(ptmx, sockfd, sigfd, flags);
+        if (ret != -2) goto out_sigfd;
+        ret = -1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        goto out_sigfd;
+    }
+
+    // Only the PTY master is ours to make non-blocking, stdin and
+    // stdout are shared with whoever started us
+    if (fcntl(ptmx, F_SETFL, fcntl(ptmx, F_GETFL) | O_NONBLOCK) == -1) {
+        goto out_epfd;
+    }
 
-    // Cleanup
+    relay_init(&in, STDIN_FILENO, ptmx);
+    relay_init(&out, ptmx, STDOUT_FILENO);
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = sigfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) == -1) goto out_relays;
+    ev.data.fd = sockfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) goto out_relays;
+
+    while (!done) {
+        // Stop reading stdin while the PTY can't take more input
+        if (epoll_set(epfd, STDIN_FILENO,
+                (stdin_open && !relay_pending(&in)) ? EPOLLIN : 0, &stdin_registered) == -1) {
+            break;
+        }
+        if (epoll_set(epfd, ptmx,
+                (stdout_open ? EPOLLIN : 0) | (stdin_open && relay_pending(&in) ? EPOLLOUT : 0),
+                &ptmx_registered) == -1) {
+            break;
+        }
+
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            uint32_t revents = events[i].events;
+
+            if (fd == sigfd) {
+                if (pump_signals(sigfd, ptmx, &quitting)) {
+                    stdin_open = stdout_open = 0;
+                }
+            } else if (fd == sockfd) {
+                // The exit code is ready, or the daemon went away.
+                // Either way, the session is over. The PTY may never
+                // hang up if the command left background processes
+                // holding the slave, so only take what is buffered.
+                while (stdout_open && pump_chunk(&out) == 0);
+                done = 1;
+                ret = 0;
+            } else if (fd == STDIN_FILENO) {
+                if (pump_chunk(&in) == -1) stdin_open = 0;
+            } else if (fd == ptmx) {
+                if ((revents & EPOLLOUT) && relay_flush(&in) == -1) {
+                    stdin_open = 0;
+                }
+                if (stdout_open && (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                        pump_chunk(&out) == -1) {
+                    // The slave hung up, or stdout went away
+                    stdout_open = 0;
+                }
+            }
+        }
+    }
+
+out_relays:
+    relay_destroy(&in);
+    relay_destroy(&out);
+out_epfd:
+    close(epfd);
+out_sigfd:
     restore_stdin();
-    watch_sigwinch_cleanup();
+    close(sigfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return ret;
+}
+
+/**
+ * pump_get_stats
+ *
+ * Copy the relay counters of this process into "out".
+ */
+void pump_get_stats(struct pump_stats *out) {
+    out->splice_bytes = __atomic_load_n(&stats.splice_bytes, __ATOMIC_RELAXED);
+    out->copy_bytes = __atomic_load_n(&stats.copy_bytes, __ATOMIC_RELAXED);
+    out->fallbacks = __atomic_load_n(&stats.fallbacks, __ATOMIC_RELAXED);
+    out->ring_bytes = __atomic_load_n(&stats.ring_bytes, __ATOMIC_RELAXED);
 }
@@ -0,0 +1,204 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * stats.c
+ *
+ * Shared counters of the daemon, see stats.h
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "su.h"
+#include "stats.h"
+
+struct daemon_stats *daemon_stats;
+
+_Static_assert(STATS_ACCEPTORS == DAEMON_MAX_ACCEPTORS, "an acceptor slot each");
+
+// Slot of the calling process in daemon_stats->acceptors, or NULL
+static struct stats_acceptor *acceptor;
+
+const char *stats_path(void) {
+    const char *path = getenv("SUD_STATS");
+
+    return path ? path : DAEMON_STATS;
+}
+
+int stats_open(const char *path) {
+    struct daemon_stats *stats;
+    int fd;
+
+    // Start from scratch, every daemon has its own counters
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0644);
+    if (fd == -1) {
+        PLOGE("open(%s)", path);
+        return -1;
+    }
+    // Readable by the unprivileged callers of su --daemon-stats, but
+    // only the daemon writes to it
+    fchmod(fd, 0644);
+    if (ftruncate(fd, sizeof(*stats))) {
+        PLOGE("ftruncate(%s)", path);
+        close(fd);
+        return -1;
+    }
+    stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        PLOGE("mmap(%s)", path);
+        return -1;
+    }
+
+    stats->version = STATS_VERSION;
+    stats->started = time(NULL);
+    daemon_stats = stats;
+    stats_owner();
+    __atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void stats_owner(void) {
+    if (daemon_stats)
+        __atomic_store_n(&daemon_stats->pid, getpid(), __ATOMIC_RELAXED);
+}
+
+void stats_acceptor(int index) {
+    uint32_t orphans;
+
+    if (daemon_stats == NULL || index < 0 || index >= STATS_ACCEPTORS)
+        return;
+    acceptor = &daemon_stats->acceptors[index];
+    __atomic_store_n(&acceptor->pid, getpid(), __ATOMIC_RELAXED);
+    // The handlers of the acceptor we replace went to init with it
+    orphans = __atomic_exchange_n(&acceptor->handlers, 0, __ATOMIC_RELAXED);
+    STATS_ADD(handlers, -(int64_t)orphans);
+}
+
+void stats_accepted(int count, unsigned int queue, unsigned int backlog) {
+    STATS_ADD(accepts, count);
+    if (acceptor == NULL)
+        return;
+    __atomic_add_fetch(&acceptor->accepts, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&acceptor->queue, queue, __ATOMIC_RELAXED);
+    __atomic_store_n(&acceptor->backlog, backlog, __ATOMIC_RELAXED);
+}
+
+void stats_handlers(int delta) {
+    STATS_ADD(handlers, delta);
+    if (acceptor)
+        __atomic_add_fetch(&acceptor->handlers, delta, __ATOMIC_RELAXED);
+}
+
+void stats_request(int code, long long duration_us) {
+    int bucket = 0;
+
+    if (daemon_stats == NULL)
+        return;
+
+    STATS_INC(requests);
+    STATS_INC(exit_codes[(code < 0 || code > 255) ? 256 : code]);
+    while (bucket < STATS_LATENCY_BUCKETS - 1 &&
+            duration_us >= (long long)STATS_LATENCY_BASE_US << bucket)
+        bucket++;
+    STATS_INC(latency[bucket]);
+}
+
+#define STATS_LOAD(field) __atomic_load_n(&stats->field, __ATOMIC_RELAXED)
+
+int stats_print(const char *path) {
+    const struct daemon_stats *stats;
+    int fd, alive, i;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED ||
+        __atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        stats->version != STATS_VERSION) {
+        fprintf(stderr, "%s: no daemon counters\n", path);
+        return 1;
+    }
+
+    // EPERM still means there is such a process
+    alive = stats->pid > 0 && (kill(stats->pid, 0) == 0 || errno == EPERM);
+
+    printf("alive %d\n", alive);
+    printf("pid %d\n", stats->pid);
+    printf("uptime %lld\n", (long long)(time(NULL) - stats->started));
+    printf("accepts %llu\n", (unsigned long long)STATS_LOAD(accepts));
+    printf("ring_accepts %llu\n", (unsigned long long)STATS_LOAD(ring_accepts));
+    printf("handshake_failures %llu\n", (unsigned long long)STATS_LOAD(handshake_failures));
+    printf("handshake_timeouts %llu\n", (unsigned long long)STATS_LOAD(handshake_timeouts));
+    printf("requests %llu\n", (unsigned long long)STATS_LOAD(requests));
+    printf("fork_failures %llu\n", (unsigned long long)STATS_LOAD(fork_failures));
+    printf("request_failures %llu\n", (unsigned long long)STATS_LOAD(request_failures));
+    printf("active_sessions %lld\n", (long long)STATS_LOAD(active_sessions));
+    printf("handlers %lld\n", (long long)STATS_LOAD(handlers));
+    printf("handler_waits %llu\n", (unsigned long long)STATS_LOAD(handler_waits));
+    printf("builtin_hits %llu\n", (unsigned long long)STATS_LOAD(builtin_hits));
+    printf("builtin_misses %llu\n", (unsigned long long)STATS_LOAD(builtin_misses));
+    printf("path_hits %llu\n", (unsigned long long)STATS_LOAD(path_hits));
+    printf("path_misses %llu\n", (unsigned long long)STATS_LOAD(path_misses));
+    printf("bytes_in %llu\n", (unsigned long long)STATS_LOAD(bytes_in));
+    printf("bytes_out %llu\n", (unsigned long long)STATS_LOAD(bytes_out));
+    printf("relay_bytes %llu\n", (unsigned long long)STATS_LOAD(relay_bytes));
+    for (i = 0; i < STATS_EXIT_CODES; i++) {
+        unsigned long long count = STATS_LOAD(exit_codes[i]);
+        if (count == 0)
+            continue;
+        if (i < 256)
+            printf("exit_code %d %llu\n", i, count);
+        else
+            printf("exit_code other %llu\n", count);
+    }
+    for (i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        if (i < STATS_LATENCY_BUCKETS - 1)
+            printf("latency_us_lt %d", STATS_LATENCY_BASE_US << i);
+        else
+            printf("latency_us_lt inf");
+        printf(" %llu\n", (unsigned long long)STATS_LOAD(latency[i]));
+    }
+
+    for (i = 0; i < STATS_ACCEPTORS; i++) {
+        const struct stats_acceptor *acc = &stats->acceptors[i];
+        if (acc->pid == 0)
+            continue;
+        printf("acceptor %d pid %d accepts %llu handlers %u queue %u backlog %u\n",
+                i, acc->pid,
+                (unsigned long long)__atomic_load_n(&acc->accepts, __ATOMIC_RELAXED),
+                __atomic_load_n(&acc->handlers, __ATOMIC_RELAXED),
+                __atomic_load_n(&acc->queue, __ATOMIC_RELAXED),
+                __atomic_load_n(&acc->backlog, __ATOMIC_RELAXED));
+    }
+
+    munmap((void *)stats, sizeof(*stats));
+    return alive ? 0 : 1;
+}
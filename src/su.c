@@ -16,6 +16,8 @@
 ** limitations under the License.
 */
 
+#define _GNU_SOURCE /* for asprintf() */
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -30,36 +32,275 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <pwd.h>
+#include <grp.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <time.h>
 #include <sys/types.h>
 #include <netinet/in.h> 
 
 #include "su.h"
 #include "utils.h"
+#include "trace.h"
+#include "stats.h"
+#include "builtin.h"
+#include "transfer.h"
+#include "pathcache.h"
+#include "batch.h"
 
 extern int is_daemon;
 extern int daemon_from_uid;
 extern int daemon_from_pid;
 
-static void populate_environment(const struct su_context *ctx) {
-    struct passwd *pw;
+// Sanitize all secure environment variables (from linker_environ.c in AOSP linker).
+/* The same list than GLibc at this point */
+static const char* const unsec_vars[] = {
+    "GCONV_PATH",
+    "GETCONF_DIR",
+    "HOSTALIASES",
+    "LD_AUDIT",
+    "LD_DEBUG",
+    "LD_DEBUG_OUTPUT",
+    "LD_DYNAMIC_WEAK",
+    "LD_LIBRARY_PATH",
+    "LD_ORIGIN_PATH",
+    "LD_PRELOAD",
+    "LD_PROFILE",
+    "LD_SHOW_AUXV",
+    "LD_USE_LOAD_BIAS",
+    "LOCALDOMAIN",
+    "LOCPATH",
+    "MALLOC_TRACE",
+    "MALLOC_CHECK_",
+    "NIS_PATH",
+    "NLSPATH",
+    "RESOLV_HOST_CONF",
+    "RES_OPTIONS",
+    "TMPDIR",
+    "TZDIR",
+    "LD_AOUT_LIBRARY_PATH",
+    "LD_AOUT_PRELOAD",
+    // not listed in linker, used due to system() call
+    "IFS",
+};
+
+/*
+ * Target users looked up before, with the environment their commands
+ * get, so that the long-lived daemon processes need neither a passwd
+ * lookup nor a new environment for a user they have seen. The daemon's
+ * own environment never changes, which leaves the uid and whether USER
+ * and LOGNAME are set as all that decides it, for the default shell and
+ * without --preserve-environment. Anything else is built per request.
+ */
+#define USER_CACHE_SIZE 8
+// How often the passwd files are looked at, at most
+#define USER_CACHE_CHECK_MS 1000
+
+struct cached_user {
+    uid_t uid;
+    // from getpwnam(), which may differ from what getpwuid() says
+    int by_name;
+    char *name;
+    char *dir;
+    // see build_environment(), without and with USER and LOGNAME
+    char **envp[2];
+    unsigned long used;
+};
+
+static struct cached_user user_cache[USER_CACHE_SIZE];
+static int user_cache_count;
+static unsigned long user_cache_clock;
+
+// Where getpwuid() and getpwnam() get users besides the built-in ones
+static const char *const passwd_files[] = {
+#ifdef __ANDROID__
+    "/system/etc/passwd",
+    "/vendor/etc/passwd",
+    "/odm/etc/passwd",
+    "/product/etc/passwd",
+    "/system_ext/etc/passwd",
+#else
+    "/etc/passwd",
+#endif
+};
+#define PASSWD_FILES (sizeof(passwd_files) / sizeof(passwd_files[0]))
+
+static struct stat passwd_stamps[PASSWD_FILES];
+// CLOCK_MONOTONIC ms after which they are looked at again
+static long long passwd_next_check;
+
+static void user_forget(struct cached_user *user) {
+    // dir shares the allocation of name
+    free(user->name);
+    free(user->envp[0]);
+    free(user->envp[1]);
+    memset(user, 0, sizeof(*user));
+}
 
-    if (ctx->to.keepenv)
+/*
+ * Drop the cached users if any passwd file changed since it was last
+ * looked at, or appeared or went away. That is at most every
+ * USER_CACHE_CHECK_MS, rather than a stat() of each file per request.
+ */
+static void user_cache_check(void) {
+    struct timespec now;
+    struct stat st;
+    long long now_ms;
+    int changed = 0;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    if (now_ms < passwd_next_check)
+        return;
+    passwd_next_check = now_ms + USER_CACHE_CHECK_MS;
+
+    for (i = 0; i < PASSWD_FILES; i++) {
+        struct stat *stamp = &passwd_stamps[i];
+
+        if (stat(passwd_files[i], &st))
+            memset(&st, 0, sizeof(st));
+        if (st.st_dev != stamp->st_dev || st.st_ino != stamp->st_ino ||
+                st.st_size != stamp->st_size ||
+                st.st_mtim.tv_sec != stamp->st_mtim.tv_sec ||
+                st.st_mtim.tv_nsec != stamp->st_mtim.tv_nsec ||
+                st.st_ctim.tv_sec != stamp->st_ctim.tv_sec ||
+                st.st_ctim.tv_nsec != stamp->st_ctim.tv_nsec)
+            changed = 1;
+        *stamp = st;
+    }
+    if (!changed || user_cache_count == 0)
         return;
 
-    pw = getpwuid(ctx->to.uid);
-    if (pw) {
-        setenv("HOME", pw->pw_dir, 1);
-        if (ctx->to.shell)
-            setenv("SHELL", ctx->to.shell, 1);
-        else
-            setenv("SHELL", DEFAULT_SHELL, 1);
-        if (ctx->to.login || ctx->to.uid) {
-            setenv("USER", pw->pw_name, 1);
-            setenv("LOGNAME", pw->pw_name, 1);
+    LOGD("passwd changed, forgetting %d users", user_cache_count);
+    while (user_cache_count > 0)
+        user_forget(&user_cache[--user_cache_count]);
+}
+
+/*
+ * The user "name", or "uid" when "name" is NULL, from the cache or else
+ * from getpwnam() or getpwuid(), replacing the least recently used one.
+ *
+ * Returns NULL if there is no such user, or no memory to cache it.
+ */
+static struct cached_user *user_lookup(uid_t uid, const char *name) {
+    struct cached_user *user;
+    struct passwd *pw;
+    size_t name_len, dir_len;
+    int i;
+
+    for (i = 0; i < user_cache_count; i++) {
+        user = &user_cache[i];
+        if (name ? user->by_name && !strcmp(user->name, name) :
+                !user->by_name && user->uid == uid) {
+            user->used = ++user_cache_clock;
+            return user;
         }
     }
+
+    pw = name ? getpwnam(name) : getpwuid(uid);
+    if (pw == NULL)
+        return NULL;
+
+    if (user_cache_count < USER_CACHE_SIZE) {
+        user = &user_cache[user_cache_count++];
+    } else {
+        user = &user_cache[0];
+        for (i = 1; i < user_cache_count; i++)
+            if (user_cache[i].used < user->used)
+                user = &user_cache[i];
+        user_forget(user);
+    }
+
+    name_len = strlen(pw->pw_name ? pw->pw_name : "");
+    dir_len = strlen(pw->pw_dir ? pw->pw_dir : "");
+    user->name = malloc(name_len + dir_len + 2);
+    if (user->name == NULL) {
+        // Hand the slot to the last one, so that the cache has no holes
+        *user = user_cache[--user_cache_count];
+        memset(&user_cache[user_cache_count], 0, sizeof(*user));
+        return NULL;
+    }
+    memcpy(user->name, pw->pw_name ? pw->pw_name : "", name_len + 1);
+    user->dir = user->name + name_len + 1;
+    memcpy(user->dir, pw->pw_dir ? pw->pw_dir : "", dir_len + 1);
+    user->uid = pw->pw_uid;
+    user->by_name = name != NULL;
+    user->used = ++user_cache_clock;
+    return user;
+}
+
+/*
+ * The environment of this process minus unsec_vars, with HOME and SHELL
+ * set unless "dir" is NULL, and USER and LOGNAME too with "user_vars".
+ * A single allocation with copies of the strings, so free() is all it
+ * takes, and a later setenv() can't pull them from under a cached one.
+ */
+static char **make_environment(const char *dir, const char *name, const char *shell,
+        int user_vars) {
+    extern char **environ;
+    static const char *const names[] = { "HOME", "SHELL", "USER", "LOGNAME" };
+    const char *values[] = { dir, shell, name, name };
+    int nset = dir == NULL ? 0 : user_vars ? 4 : 2;
+    int count = 0, n = 0, i, j;
+    size_t strings = 0, len;
+    char **envp, *p;
+
+    for (j = 0; j < nset; j++)
+        strings += strlen(names[j]) + strlen(values[j]) + 2;
+    for (count = 0; environ[count]; count++)
+        strings += strlen(environ[count]) + 1;
+    envp = malloc(sizeof(char *) * (count + nset + 1) + strings);
+    if (envp == NULL)
+        return NULL;
+    p = (char *)(envp + count + nset + 1);
+
+    for (i = 0; i < count; i++) {
+        const char *eq = strchr(environ[i], '=');
+        int skip = 0;
+
+        len = eq ? (size_t)(eq - environ[i]) : strlen(environ[i]);
+        for (j = 0; j < (int)(sizeof(unsec_vars)/sizeof(unsec_vars[0])) && !skip; j++)
+            skip = strlen(unsec_vars[j]) == len && !strncmp(environ[i], unsec_vars[j], len);
+        for (j = 0; j < nset && !skip; j++)
+            skip = strlen(names[j]) == len && !strncmp(environ[i], names[j], len);
+        if (skip)
+            continue;
+        len = strlen(environ[i]) + 1;
+        envp[n++] = memcpy(p, environ[i], len);
+        p += len;
+    }
+    for (j = 0; j < nset; j++) {
+        envp[n++] = p;
+        p += sprintf(p, "%s=%s", names[j], values[j]) + 1;
+    }
+    envp[n] = NULL;
+
+    return envp;
+}
+
+/*
+ * The environment to run the command of ctx in, starting from the one of
+ * this process without changing it. Sets "cached" when it belongs to the
+ * user cache rather than the caller.
+ */
+static char **build_environment(const struct su_context *ctx, int *cached) {
+    const char *shell = ctx->to.shell ? ctx->to.shell : DEFAULT_SHELL;
+    int user_vars = ctx->to.login || ctx->to.uid;
+    struct cached_user *user = NULL;
+
+    *cached = 0;
+    if (!ctx->to.keepenv)
+        user = user_lookup(ctx->to.uid, NULL);
+    if (user == NULL)
+        return make_environment(NULL, NULL, NULL, 0);
+    if (strcmp(shell, DEFAULT_SHELL))
+        return make_environment(user->dir, user->name, shell, user_vars);
+
+    if (user->envp[user_vars] == NULL)
+        user->envp[user_vars] = make_environment(user->dir, user->name, shell, user_vars);
+    *cached = user->envp[user_vars] != NULL;
+    return user->envp[user_vars];
 }
 
 static void socket_cleanup(struct su_context *ctx) {
@@ -211,13 +452,26 @@ static void usage(int status) {
     fprintf(stream,
     "Usage: su [options] [--] [-] [LOGIN] [--] [args...]\n\n"
     "Options:\n"
+    "  --batch FILE                  run each line of FILE, or stdin for -, as a\n"
+    "                                command, several at once, and write their exit\n"
+    "                                codes and durations to stdout\n"
+    "  --capture                     with --batch, also write the output of each\n"
+    "                                command\n"
     "  --daemon                      start the su daemon agent\n"
+    "  --daemon-stats                print the counters of the daemon and exit,\n"
+    "                                non-zero if it isn't running\n"
     "  -c, --command COMMAND         pass COMMAND to the invoked shell\n"
     "  -h, --help                    display this help message and exit\n"
+    "  --jobs N                      with --batch, run at most N commands at once\n"
     "  -, -l, --login                pretend the shell to be a login shell\n"
     "  -m, -p,\n"
     "  --preserve-environment        do not change environment variables\n"
     "  -s, --shell SHELL             use SHELL instead of the default " DEFAULT_SHELL "\n"
+    "  --pull PATH                   write the file PATH to stdout as root\n"
+    "  --push PATH                   write stdin to the file PATH as root\n"
+    "  --session[=FD]                run each line of stdin as a command over a single\n"
+    "                                daemon connection, writing each exit code to FD\n"
+    "                                (default 2)\n"
     "  -v, --version                 display version number and exit\n"
     "  -V                            display version code and exit,\n");
     exit(status);
@@ -231,11 +485,16 @@ static __attribute__ ((noreturn)) void fail(struct su_context *ctx) {
     exit(EXIT_FAILURE);
 }
 
-static __attribute__ ((noreturn)) void allow(struct su_context *ctx) {
+/*
+ * Work out the binary to run for ctx and the argv to run it with,
+ * which is built in place in front of ctx->to.optind.
+ *
+ * Returns the binary. *arg0 is set to the login argv[0], which
+ * the caller has to free, or NULL.
+ */
+static char *exec_args(struct su_context *ctx, char ***argvp, char **login_arg0) {
     char *arg0;
-    int argc, err;
-
-    umask(ctx->umask);
+    int argc;
 
     char *binary;
     argc = ctx->to.optind;
@@ -256,6 +515,7 @@ static __attribute__ ((noreturn)) void allow(struct su_context *ctx) {
         }
     }
 
+    *login_arg0 = NULL;
     arg0 = strrchr (binary, '/');
     arg0 = (arg0) ? arg0 + 1 : binary;
     if (ctx->to.login) {
@@ -263,15 +523,14 @@ static __attribute__ ((noreturn)) void allow(struct su_context *ctx) {
         char *p = malloc(s);
 
         if (!p)
-            exit(EXIT_FAILURE);
+            return NULL;
 
         *p = '-';
         strcpy(p + 1, arg0);
         arg0 = p;
+        *login_arg0 = p;
     }
 
-    populate_environment(ctx);
-
     #define PARG(arg)                                    \
         (argc + (arg) < ctx->to.argc) ? " " : "",                    \
         (argc + (arg) < ctx->to.argc) ? ctx->to.argv[argc + (arg)] : ""
@@ -283,13 +542,107 @@ static __attribute__ ((noreturn)) void allow(struct su_context *ctx) {
             (ctx->to.optind + 6 < ctx->to.argc) ? " ..." : "");
 
     ctx->to.argv[--argc] = arg0;
-    execvp(binary, ctx->to.argv + argc);
+    *argvp = ctx->to.argv + argc;
+    return binary;
+}
+
+static __attribute__ ((noreturn)) void allow(struct su_context *ctx) {
+    char *binary, *login_arg0;
+    const char *path;
+    struct builtin_call call;
+    struct trace_span span;
+    char **argv, **envp;
+    int err, cached;
+
+    trace_begin(&span, "allow");
+    umask(ctx->umask);
+
+    binary = exec_args(ctx, &argv, &login_arg0);
+    if (!binary)
+        exit(EXIT_FAILURE);
+
+    // Simple commands don't need the exec, see SUD_BUILTINS
+    if (builtin_match(binary, argv, &call) == 0) {
+        err = builtin_run(&call);
+        if (err >= 0) {
+            trace_end(&span);
+            su_log_flush();
+            exit(err);
+        }
+    }
+
+    envp = build_environment(ctx, &cached);
+    if (!envp) {
+        PLOGE("environment");
+        exit(EXIT_FAILURE);
+    }
+
+    trace_end(&span);
+    trace_mark("exec");
+
+    path = pathcache_lookup(binary);
+
+    // exec would throw away whatever is still buffered
+    su_log_flush();
+    if (path)
+        execve(path, argv, envp);
+    execvpe(binary, argv, envp);
     err = errno;
     PLOGE("exec");
     fprintf(stderr, "Cannot execute %s: %s\n", binary, strerror(err));
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Send su --batch with the batch file as our stdin, opened by us rather
+ * than by root in the daemon, which reads the batch from stdin whatever
+ * file argv names.
+ */
+static int connect_batch(const struct su_context *ctx, int argc, char *argv[], int ppid) {
+    struct stat st;
+    int fd;
+
+    if (strcmp(ctx->to.batch, "-")) {
+        fd = open(ctx->to.batch, O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || fstat(fd, &st)) {
+            fprintf(stderr, "su: %s: %s\n", ctx->to.batch, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "su: %s: %s\n", ctx->to.batch, strerror(EISDIR));
+            return EXIT_FAILURE;
+        }
+        if (fd != STDIN_FILENO) {
+            if (dup2(fd, STDIN_FILENO) == -1) {
+                PLOGE("dup2");
+                exit(-1);
+            }
+            close(fd);
+        }
+    }
+    return connect_daemon_stdio("--batch", argc, argv, ppid);
+}
+
+/*
+ * Run the batch of su --batch from stdin, see batch.h.
+ */
+static int run_batch(struct su_context *ctx) {
+    char **envp;
+    int cached, ret;
+
+    umask(ctx->umask);
+    envp = build_environment(ctx, &cached);
+    if (!envp) {
+        PLOGE("environment");
+        return EXIT_FAILURE;
+    }
+    ret = batch_run(STDIN_FILENO, STDOUT_FILENO, ctx->to.jobs, ctx->to.capture,
+            ctx->to.shell ? ctx->to.shell : DEFAULT_SHELL, envp);
+    if (!cached)
+        free(envp);
+    return ret;
+}
+
 static void fork_for_samsung(void)
 {
     // Samsung CONFIG_SEC_RESTRICT_SETUID wants the parent process to have
@@ -297,6 +650,10 @@ static void fork_for_samsung(void)
     // all such syscalls are executed by a child process.
     int rv;
 
+    // We don't call setresuid() ourselves, so this is opt-in
+    if (!env_int("SUD_SAMSUNG_FORK", SAMSUNG_FORK))
+        return;
+
     switch (fork()) {
     case 0:
         return;
@@ -307,65 +664,13 @@ static void fork_for_samsung(void)
         if (wait(&rv) < 0) {
             exit(1);
         } else {
-            exit(WEXITSTATUS(rv));
+            exit(exit_code(rv));
         }
     }
 }
 
-int main(int argc, char *argv[]) {
-    return su_main(argc, argv, 1);
-}
-
-int su_main(int argc, char *argv[], int need_client) {
-    // start up in daemon mode if prompted
-    if (argc == 2 && strcmp(argv[1], "--daemon") == 0) {
-        return run_daemon();
-    }
-
-    int ppid = getppid();
-    fork_for_samsung();
-
-    // Sanitize all secure environment variables (from linker_environ.c in AOSP linker).
-    /* The same list than GLibc at this point */
-    static const char* const unsec_vars[] = {
-        "GCONV_PATH",
-        "GETCONF_DIR",
-        "HOSTALIASES",
-        "LD_AUDIT",
-        "LD_DEBUG",
-        "LD_DEBUG_OUTPUT",
-        "LD_DYNAMIC_WEAK",
-        "LD_LIBRARY_PATH",
-        "LD_ORIGIN_PATH",
-        "LD_PRELOAD",
-        "LD_PROFILE",
-        "LD_SHOW_AUXV",
-        "LD_USE_LOAD_BIAS",
-        "LOCALDOMAIN",
-        "LOCPATH",
-        "MALLOC_TRACE",
-        "MALLOC_CHECK_",
-        "NIS_PATH",
-        "NLSPATH",
-        "RESOLV_HOST_CONF",
-        "RES_OPTIONS",
-        "TMPDIR",
-        "TZDIR",
-        "LD_AOUT_LIBRARY_PATH",
-        "LD_AOUT_PRELOAD",
-        // not listed in linker, used due to system() call
-        "IFS",
-    };
-    const char* const* cp   = unsec_vars;
-    const char* const* endp = cp + sizeof(unsec_vars)/sizeof(unsec_vars[0]);
-    while (cp < endp) {
-        unsetenv(*cp);
-        cp++;
-    }
-
-    LOGD("su invoked.");
-
-    struct su_context ctx = {
+static void init_context(struct su_context *ctx, int argc, char *argv[]) {
+    struct su_context init = {
         .from = {
             .pid = -1,
             .uid = 2000,
@@ -388,14 +693,29 @@ int su_main(int argc, char *argv[], int need_client) {
             .android_user_id = 0,
         },
     };
-    struct stat st;
-    int c, socket_serv_fd, fd;
-    char buf[64], *result;
+
+    *ctx = init;
+}
+
+/*
+ * Parse the options in front of the target user into ctx.
+ *
+ * Returns 0 once all of them were parsed, or the option which has
+ * to be handled by the caller: 'h', 'V', 'v' or '?'.
+ */
+static int parse_options(struct su_context *ctx, int argc, char *argv[], int *session_fd) {
+    int c;
     struct option long_opts[] = {
+        { "batch",            required_argument,    NULL, 'B' },
+        { "capture",            no_argument,        NULL, 'O' },
         { "command",            required_argument,    NULL, 'c' },
         { "help",            no_argument,        NULL, 'h' },
+        { "jobs",            required_argument,    NULL, 'j' },
         { "login",            no_argument,        NULL, 'l' },
         { "preserve-environment",    no_argument,        NULL, 'p' },
+        { "pull",            required_argument,    NULL, 'G' },
+        { "push",            required_argument,    NULL, 'P' },
+        { "session",            optional_argument,    NULL, 'S' },
         { "shell",            required_argument,    NULL, 's' },
         { "version",            no_argument,        NULL, 'v' },
         { NULL, 0, NULL, 0 },
@@ -404,71 +724,241 @@ int su_main(int argc, char *argv[], int need_client) {
     while ((c = getopt_long(argc, argv, "+c:hlmps:Vv", long_opts, NULL)) != -1) {
         switch(c) {
         case 'c':
-            ctx.to.shell = DEFAULT_SHELL;
-            ctx.to.command = optarg;
-            break;
-        case 'h':
-            usage(EXIT_SUCCESS);
+            ctx->to.shell = DEFAULT_SHELL;
+            ctx->to.command = optarg;
             break;
         case 'l':
-            ctx.to.login = 1;
+            ctx->to.login = 1;
             break;
         case 'm':
         case 'p':
-            ctx.to.keepenv = 1;
+            ctx->to.keepenv = 1;
             break;
         case 's':
-            ctx.to.shell = optarg;
+            ctx->to.shell = optarg;
+            break;
+        case 'G':
+            ctx->to.pull = optarg;
+            break;
+        case 'P':
+            ctx->to.push = optarg;
+            break;
+        case 'S':
+            *session_fd = STDERR_FILENO;
+            if (optarg) {
+                char *end;
+                long fd;
+
+                errno = 0;
+                fd = strtol(optarg, &end, 10);
+                if (errno || end == optarg || *end || fd < 0 || fd > INT_MAX ||
+                        fcntl((int)fd, F_GETFD) == -1) {
+                    if (opterr)
+                        fprintf(stderr, "%s: invalid session fd '%s'", argv[0], optarg);
+                    return '?';
+                }
+                *session_fd = (int)fd;
+            }
+            break;
+        case 'B':
+            ctx->to.batch = optarg;
+            break;
+        case 'j':
+            ctx->to.jobs = atoi(optarg);
+            if (ctx->to.jobs <= 0)
+                return '?';
+            break;
+        case 'O':
+            ctx->to.capture = 1;
             break;
-        case 'V':
-            printf("%d\n", VERSION_CODE);
-            exit(EXIT_SUCCESS);
-        case 'v':
-            exit(EXIT_SUCCESS);
         default:
-            /* Bionic getopt_long doesn't terminate its error output by newline */
-            fprintf(stderr, "\n");
-            usage(2);
+            return c;
         }
     }
+    return 0;
+}
 
-    if (need_client) {
-        LOGD("starting daemon client %d %d", getuid(), geteuid());
-        return connect_daemon(argc, argv, ppid);
-    }
-
+/*
+ * Parse the target user and the "-" and "--" around it into ctx.
+ *
+ * Returns -1 if the user is unknown, with optind pointing at it.
+ */
+static int parse_target(struct su_context *ctx, int argc, char *argv[]) {
     if (optind < argc && !strcmp(argv[optind], "-")) {
-        ctx.to.login = 1;
+        ctx->to.login = 1;
         optind++;
     }
     /* username or uid */
     if (optind < argc && strcmp(argv[optind], "--")) {
-        struct passwd *pw;
-        pw = getpwnam(argv[optind]);
+        struct cached_user *pw;
+        pw = user_lookup(0, argv[optind]);
         if (!pw) {
             char *endptr;
 
             /* It seems we shouldn't do this at all */
             errno = 0;
-            ctx.to.uid = strtoul(argv[optind], &endptr, 10);
+            ctx->to.uid = strtoul(argv[optind], &endptr, 10);
             if (errno || *endptr) {
-                LOGE("Unknown id: %s\n", argv[optind]);
-                fprintf(stderr, "Unknown id: %s\n", argv[optind]);
-                exit(EXIT_FAILURE);
+                return -1;
             }
         } else {
-            ctx.to.uid = pw->pw_uid;
-            if (pw->pw_name)
-                strncpy(ctx.to.name, pw->pw_name, sizeof(ctx.to.name));
+            ctx->to.uid = pw->uid;
+            strncpy(ctx->to.name, pw->name, sizeof(ctx->to.name));
         }
         optind++;
     }
     if (optind < argc && !strcmp(argv[optind], "--")) {
         optind++;
     }
-    ctx.to.optind = optind;
+    ctx->to.optind = optind;
+
+    return 0;
+}
+
+int su_prepare(int argc, char *argv[], struct su_exec *exec) {
+    struct su_context ctx;
+    int session_fd = -1, ret = -1;
+
+    memset(exec, 0, sizeof(*exec));
+    if (argc == 2 && (strcmp(argv[1], "--daemon") == 0 ||
+                strcmp(argv[1], "--daemon-stats") == 0))
+        return -1;
+
+    // exec_args() builds the command over argv, which su_main() may
+    // still have to parse after us
+    exec->args = malloc((argc + 1) * sizeof(*argv));
+    if (!exec->args)
+        return -1;
+    memcpy(exec->args, argv, (argc + 1) * sizeof(*argv));
+    argv = exec->args;
+
+    init_context(&ctx, argc, argv);
+    user_cache_check();
+
+    // Leave error messages to su_main(), on the stderr of the request
+    optind = 0;
+    opterr = 0;
+    if (parse_options(&ctx, argc, argv, &session_fd) || parse_target(&ctx, argc, argv))
+        goto fail;
+    // Transfers and batches are no command, su_main() does them
+    if (ctx.to.pull || ctx.to.push || ctx.to.batch)
+        goto fail;
+
+    exec->binary = exec_args(&ctx, &exec->argv, &exec->arg0);
+    if (!exec->binary)
+        goto fail;
+    exec->path = pathcache_lookup(exec->binary);
+    exec->envp = build_environment(&ctx, &exec->cached_envp);
+    if (!exec->envp) {
+        free(exec->arg0);
+        goto fail;
+    }
+    exec->umask = ctx.umask;
+    ret = 0;
+    goto out;
+fail:
+    free(exec->args);
+    memset(exec, 0, sizeof(*exec));
+out:
+    // Have the next getopt_long() user start from scratch
+    optind = 0;
+    opterr = 1;
+    return ret;
+}
+
+void su_exec_free(struct su_exec *exec) {
+    if (!exec->cached_envp)
+        free(exec->envp);
+    free(exec->arg0);
+    free(exec->args);
+    memset(exec, 0, sizeof(*exec));
+}
+
+int su_main(int argc, char *argv[], int need_client) {
+    // start up in daemon mode if prompted
+    if (argc == 2 && strcmp(argv[1], "--daemon") == 0) {
+        return run_daemon();
+    }
+    // Only reads the shared counters, doesn't even connect
+    if (argc == 2 && strcmp(argv[1], "--daemon-stats") == 0) {
+        return stats_print(stats_path());
+    }
+
+    struct trace_span span;
+    trace_begin(&span, "su_main");
+
+    int ppid = getppid();
+    fork_for_samsung();
+
+    const char* const* cp   = unsec_vars;
+    const char* const* endp = cp + sizeof(unsec_vars)/sizeof(unsec_vars[0]);
+    while (cp < endp) {
+        unsetenv(*cp);
+        cp++;
+    }
+
+    LOGD("su invoked.");
+
+    struct su_context ctx;
+    struct stat st;
+    int c, socket_serv_fd, fd;
+    int session_fd = -1;
+    char buf[64], *result;
+
+    init_context(&ctx, argc, argv);
+
+    switch (c = parse_options(&ctx, argc, argv, &session_fd)) {
+    case 0:
+        break;
+    case 'h':
+        usage(EXIT_SUCCESS);
+        break;
+    case 'V':
+        printf("%d\n", VERSION_CODE);
+        exit(EXIT_SUCCESS);
+    case 'v':
+        exit(EXIT_SUCCESS);
+    default:
+        /* Bionic getopt_long doesn't terminate its error output by newline */
+        fprintf(stderr, "\n");
+        usage(2);
+    }
+
+    if (need_client) {
+        trace_end(&span);
+        LOGD("starting daemon client %d %d", getuid(), geteuid());
+        if (ctx.to.pull)
+            return connect_daemon_transfer("--pull", ctx.to.pull, ppid);
+        if (ctx.to.push)
+            return connect_daemon_transfer("--push", ctx.to.push, ppid);
+        if (ctx.to.batch)
+            return connect_batch(&ctx, argc, argv, ppid);
+        if (session_fd >= 0)
+            return connect_daemon_session(argc, argv, optind, ppid, session_fd);
+        return connect_daemon(argc, argv, ppid);
+    }
+
+    // A handler forked from the daemon has its users, maybe stale ones
+    user_cache_check();
+    if (parse_target(&ctx, argc, argv)) {
+        LOGE("Unknown id: %s\n", argv[optind]);
+        fprintf(stderr, "Unknown id: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
 
     su_ctx = &ctx;
+    trace_end(&span);
+
+    if (ctx.to.pull || ctx.to.push) {
+        c = ctx.to.pull ? transfer_pull(ctx.to.pull) : transfer_push(ctx.to.push);
+        su_log_flush();
+        exit(c);
+    }
+    if (ctx.to.batch) {
+        c = run_batch(&ctx);
+        su_log_flush();
+        exit(c);
+    }
 
     // Allow everything
     allow(&ctx);
@@ -0,0 +1,108 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * trace.c
+ *
+ * Chrome trace event writer behind trace.h
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "su.h"
+#include "trace.h"
+
+extern int is_daemon;
+
+// -2 until SUD_TRACE was looked at, -1 when tracing is off
+static int trace_fd = -2;
+static uint64_t trace_id;
+
+static int trace_open(void) {
+    struct stat st;
+
+    if (trace_fd != -2)
+        return trace_fd;
+
+    const char *path = getenv("SUD_TRACE");
+    if (path == NULL || !path[0]) {
+        trace_fd = -1;
+        return -1;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (trace_fd == -1) {
+        PLOGE("open(%s)", path);
+        return -1;
+    }
+    // The viewers accept an array which is never closed
+    if (fstat(trace_fd, &st) == 0 && st.st_size == 0)
+        write(trace_fd, "[\n", 2);
+    return trace_fd;
+}
+
+static long long trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void trace_event(const char *name, const char *phase, long long ts, long long dur) {
+    char buf[256], extra[32] = "";
+    int len;
+
+    if (dur >= 0)
+        snprintf(extra, sizeof(extra), "\"dur\":%lld,", dur);
+    len = snprintf(buf, sizeof(buf),
+            "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%lld,%s"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"request\":\"%016llx\"}},\n",
+            name, is_daemon ? "daemon" : "client", phase, ts, extra,
+            getpid(), getpid(), (unsigned long long)trace_id);
+    if (len > 0 && len < (int)sizeof(buf))
+        write(trace_fd, buf, len);
+}
+
+void trace_request(uint64_t id) {
+    trace_id = id;
+}
+
+uint64_t trace_new_request(void) {
+    return ((uint64_t)getpid() << 32) ^ (uint64_t)trace_now();
+}
+
+void trace_begin(struct trace_span *span, const char *name) {
+    span->name = name;
+    span->start = trace_open() >= 0 ? trace_now() : 0;
+}
+
+void trace_end(struct trace_span *span) {
+    if (span->start == 0)
+        return;
+    trace_event(span->name, "X", span->start, trace_now() - span->start);
+    span->start = 0;
+}
+
+void trace_mark(const char *name) {
+    if (trace_open() < 0)
+        return;
+    trace_event(name, "i", trace_now(), -1);
+}
@@ -0,0 +1,281 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * transfer.c
+ *
+ * File push and pull, see transfer.h
+ */
+
+#define _GNU_SOURCE /* for splice() */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <linux/magic.h>
+
+#include "su.h"
+#include "utils.h"
+#include "transfer.h"
+
+// Most a single sendfile() or splice() is asked to move
+#define TRANSFER_CHUNK  (1 << 30)
+// Size of the pipe splice() goes through when neither end is one
+#define TRANSFER_PIPE   (1 << 20)
+
+enum {
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_PIPE,
+    COPY_READ,
+};
+
+/*
+ * Wait for whichever of "in" and "out" held up the last call.
+ */
+static void wait_ready(int in, int out) {
+    struct pollfd pfd = { .fd = out, .events = POLLOUT };
+
+    if (poll(&pfd, 1, 0) == 1) {
+        pfd.fd = in;
+        pfd.events = POLLIN;
+    }
+    poll(&pfd, 1, -1);
+}
+
+/*
+ * Move what is in the pipe to "out", with write() if "out" can't be
+ * spliced to.
+ */
+static int drain_pipe(int pipe_in, int out, size_t len) {
+    char buf[4096];
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = splice(pipe_in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (ret == -1 && errno == EINVAL)
+            ret = read(pipe_in, buf, len < sizeof(buf) ? len : sizeof(buf));
+        else if (ret > 0) {
+            len -= ret;
+            continue;
+        }
+        if (ret == -1) {
+            if (errno == EAGAIN)
+                wait_ready(pipe_in, out);
+            else if (errno != EINTR)
+                return -1;
+            continue;
+        }
+        if (ret == 0 || write_all(out, buf, ret))
+            return -1;
+        len -= ret;
+    }
+    return 0;
+}
+
+static ssize_t copy_pipe(int in, int out, int pipefd[2]) {
+    ssize_t len;
+
+    if (pipefd[0] == -1) {
+        if (pipe2(pipefd, O_CLOEXEC)) {
+            // Out of FDs is no reason to fail, read() still works
+            errno = EINVAL;
+            return -1;
+        }
+        fcntl(pipefd[1], F_SETPIPE_SZ, TRANSFER_PIPE);
+    }
+    len = splice(in, NULL, pipefd[1], NULL, TRANSFER_PIPE, SPLICE_F_MOVE);
+    if (len > 0 && drain_pipe(pipefd[0], out, len))
+        return -1;
+    return len;
+}
+
+int transfer_copy(int in, int out, unsigned long long *bytes) {
+    int method = COPY_SENDFILE, pipefd[2] = { -1, -1 }, ret = 0;
+    char buf[65536];
+    ssize_t len;
+
+    *bytes = 0;
+    for (;;) {
+        switch (method) {
+        case COPY_SENDFILE:
+            // From the page cache of a file
+            len = sendfile(out, in, NULL, TRANSFER_CHUNK);
+            break;
+        case COPY_SPLICE:
+            // Either end is a pipe
+            len = splice(in, NULL, out, NULL, TRANSFER_CHUNK, SPLICE_F_MOVE);
+            break;
+        case COPY_PIPE:
+            len = copy_pipe(in, out, pipefd);
+            break;
+        default:
+            // Plenty of /proc and /sys files can't be spliced
+            len = read(in, buf, sizeof(buf));
+            if (len > 0 && write_all(out, buf, len))
+                len = -1;
+            break;
+        }
+        if (len > 0) {
+            *bytes += len;
+            continue;
+        }
+        if (len == 0)
+            break;
+        if (errno == EAGAIN)
+            wait_ready(in, out);
+        else if ((errno == EINVAL || errno == ENOSYS) && method != COPY_READ)
+            method++;
+        else if (errno != EINTR) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (pipefd[0] != -1) {
+        int saved = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = saved;
+    }
+    return ret;
+}
+
+static double elapsed(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Log the throughput, and tell the user on stderr, which never carries
+ * the data.
+ */
+static void report(const char *what, const char *path, unsigned long long bytes,
+        const struct timespec *start) {
+    double secs = elapsed(start);
+    double rate = secs > 0 ? bytes / secs / (1024 * 1024) : 0;
+
+    LOGD("%s %s: %llu bytes in %.3f s, %.1f MiB/s", what, path, bytes, secs, rate);
+    fprintf(stderr, "%s %s: %llu bytes in %.3f s (%.1f MiB/s)\n", what, path,
+            bytes, secs, rate);
+}
+
+/*
+ * Whether the size of "fd" is how much there is to read. Files in /proc
+ * and /sys are generated on read and have a made up size.
+ */
+static int sized_file(int fd, const struct stat *st) {
+    struct statfs sfs;
+
+    if (!S_ISREG(st->st_mode) || fstatfs(fd, &sfs))
+        return 0;
+    return sfs.f_type != PROC_SUPER_MAGIC && sfs.f_type != SYSFS_MAGIC;
+}
+
+int transfer_pull(const char *path) {
+    unsigned long long bytes;
+    struct timespec start;
+    struct stat st;
+    int fd, sized;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st)) {
+        fprintf(stderr, "su: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "su: %s: %s\n", path, strerror(EISDIR));
+        close(fd);
+        return 1;
+    }
+
+    sized = sized_file(fd, &st);
+    if (transfer_copy(fd, STDOUT_FILENO, &bytes)) {
+        fprintf(stderr, "su: pulling %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    if (sized && bytes != (unsigned long long)st.st_size) {
+        fprintf(stderr, "su: %s changed while pulling it, %llu of %lld bytes\n",
+                path, bytes, (long long)st.st_size);
+        return 1;
+    }
+    report("pulled", path, bytes, &start);
+    return 0;
+}
+
+int transfer_push(const char *path) {
+    unsigned long long bytes;
+    long long expected = -1;
+    struct timespec start;
+    struct stat st;
+    off_t pos;
+    int fd, sized;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // A file on stdin says how much is coming, a pipe or socket doesn't
+    if (fstat(STDIN_FILENO, &st) == 0 && sized_file(STDIN_FILENO, &st) &&
+            (pos = lseek(STDIN_FILENO, 0, SEEK_CUR)) != -1)
+        expected = st.st_size - pos;
+
+    // Written in place, so an existing file keeps its owner, mode and label
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "su: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (transfer_copy(STDIN_FILENO, fd, &bytes) ||
+            (fdatasync(fd) && errno != EINVAL && errno != EROFS) ||
+            fstat(fd, &st)) {
+        fprintf(stderr, "su: pushing %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    sized = sized_file(fd, &st);
+    if (close(fd)) {
+        fprintf(stderr, "su: pushing %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (expected >= 0 && bytes != (unsigned long long)expected) {
+        fprintf(stderr, "su: stdin changed while pushing %s, %llu of %lld bytes\n",
+                path, bytes, expected);
+        return 1;
+    }
+    if (sized && bytes != (unsigned long long)st.st_size) {
+        fprintf(stderr, "su: %s is %lld bytes after pushing %llu\n",
+                path, (long long)st.st_size, bytes);
+        return 1;
+    }
+    report("pushed", path, bytes, &start);
+    return 0;
+}
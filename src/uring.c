@@ -0,0 +1,206 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * uring.c
+ *
+ * Minimal io_uring wrapper, see uring.h
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "su.h"
+#include "uring.h"
+
+// The same on every architecture, but missing from older headers
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter     426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register  427
+#endif
+
+int uring_wanted(void) {
+    const char *engine = getenv("SUD_IO_ENGINE");
+
+    if (engine == NULL || !*engine)
+        engine = DAEMON_IO_ENGINE;
+    return strcmp(engine, "uring") == 0;
+}
+
+/*
+ * Check that the kernel knows every opcode in "ops", which a ring
+ * accepts even when it can't run them.
+ */
+static int probe_ops(struct uring *ring, const int *ops) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ret = 0;
+
+    if (probe == NULL)
+        return -1;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256)) {
+        free(probe);
+        return -1;
+    }
+    for (; *ops != -1; ops++) {
+        if (*ops > probe->last_op || !(probe->ops[*ops].flags & IO_URING_OP_SUPPORTED)) {
+            LOGD("io_uring lacks opcode %d", *ops);
+            errno = EOPNOTSUPP;
+            ret = -1;
+            break;
+        }
+    }
+    free(probe);
+    return ret;
+}
+
+int uring_init(struct uring *ring, unsigned entries, const int *ops) {
+    struct io_uring_params p;
+    void *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd == -1)
+        return -1;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // Both rings share a mapping since Linux 5.4
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+    sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto err;
+    ring->sq_ring = sq;
+    if (ring->cq_ring_size) {
+        cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto err;
+        ring->cq_ring = cq;
+    } else {
+        cq = sq;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+
+    if (ops && probe_ops(ring, ops))
+        goto err;
+    return 0;
+
+err:
+    {
+        int saved = errno;
+        uring_destroy(ring);
+        errno = saved;
+    }
+    return -1;
+}
+
+void uring_destroy(struct uring *ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned count) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+    index = ring->sqe_tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, int wait) {
+    unsigned submit = ring->sqe_tail - *ring->sq_tail;
+    unsigned flags = 0;
+    long ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    if (wait && uring_cqe(ring) == NULL)
+        flags = IORING_ENTER_GETEVENTS;
+    else
+        wait = 0;
+    if (submit == 0 && !wait)
+        return 0;
+
+    // The kernel only takes what was queued, so a retry can't submit twice
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait ? 1 : 0, flags, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    return ret == -1 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,77 @@
+/*
+** Copyright 2012, The CyanogenMod Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <sys/wait.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "su.h"
+#include "utils.h"
+
+/*
+ * Read a non-negative integer setting from the environment,
+ * falling back to "def" when it is unset or malformed.
+ */
+int env_int(const char *name, int def) {
+    const char *val = getenv(name);
+    char *end;
+    long ret;
+
+    if (val == NULL || !*val)
+        return def;
+    errno = 0;
+    ret = strtol(val, &end, 10);
+    if (errno || *end || ret < 0 || ret > INT_MAX) {
+        LOGE("ignoring invalid %s=%s", name, val);
+        return def;
+    }
+    return ret;
+}
+
+/*
+ * Write all of "buf", waiting for "fd" if it was left non-blocking.
+ */
+int write_all(int fd, const char *buf, size_t len) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret == -1) {
+            if (errno == EAGAIN)
+                poll(&pfd, 1, -1);
+            else if (errno != EINTR)
+                return -1;
+            continue;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * The exit code of a process which ended with "status", the way a shell
+ * reports it: 128 plus the signal when one killed it.
+ */
+int exit_code(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    return 128 + WTERMSIG(status);
+}
@@ -0,0 +1,104 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * audit.c
+ *
+ * Decoder for the binary audit log of the daemon, see audit.h. Prints
+ * the records from oldest to newest, one per line.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audit.h"
+
+static int cmp_seq(const void *a, const void *b) {
+    const struct audit_record *x = a, *y = b;
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+int main(int argc, char *argv[]) {
+    struct audit_header hdr;
+    struct audit_record *records;
+    struct stat st;
+    uint32_t i, n = 0;
+    int fd;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: sud-audit FILE\n");
+        return 2;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st)) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        hdr.magic != AUDIT_MAGIC || hdr.version != AUDIT_VERSION ||
+        hdr.record_size != sizeof(struct audit_record) ||
+        (off_t)(sizeof(hdr) + (off_t)hdr.records * hdr.record_size) > st.st_size) {
+        fprintf(stderr, "%s: not an audit log\n", argv[1]);
+        return 1;
+    }
+
+    records = malloc(sizeof(struct audit_record) * hdr.records);
+    if (records == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < hdr.records; i++) {
+        if (read(fd, &records[n], sizeof(records[n])) != sizeof(records[n])) {
+            perror(argv[1]);
+            return 1;
+        }
+        // Skip empty slots and any record caught mid-write
+        if (records[n].seq != 0)
+            n++;
+    }
+    close(fd);
+
+    qsort(records, n, sizeof(struct audit_record), cmp_seq);
+
+    printf("%-8s %-23s %7s %7s %7s %5s %10s %8s %s\n", "seq", "time", "pid", "uid",
+            "ppid", "code", "us", "hash", "argv");
+    for (i = 0; i < n; i++) {
+        struct audit_record *rec = &records[i];
+        time_t sec = rec->time_ns / 1000000000LL;
+        char when[32];
+        struct tm tm;
+
+        localtime_r(&sec, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        rec->argv[AUDIT_ARGV_SIZE - 1] = '\0';
+        printf("%-8llu %s.%03d %7d %7d %7d %5d %10u %08x %s%s\n",
+                (unsigned long long)rec->seq, when, (int)(rec->time_ns / 1000000 % 1000),
+                rec->pid, rec->uid, rec->ppid, rec->code, rec->duration_us,
+                rec->argv_hash, rec->argv,
+                strlen(rec->argv) + 1 >= AUDIT_ARGV_SIZE ? "..." : "");
+    }
+
+    free(records);
+    return 0;
+}
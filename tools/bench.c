@@ -0,0 +1,659 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * bench.c
+ *
+ * Per-phase latency of back-to-back requests against a host build of
+ * the daemon, see "make bench".
+ *
+ * The benchmark starts its own daemon on a private socket and sends each
+ * request through connect_daemon(), the client of su linked in. Both
+ * trace to a file of the benchmark, see trace.h, which the phases are
+ * taken from: the client spans up to the ack, then until the "exec"
+ * mark of the daemon for the fork, or vfork, and the setup of the
+ * child. The command it requests is the benchmark itself in --stamp
+ * mode, which records the CLOCK_MONOTONIC time it started at, so the
+ * time from the mark to that stamp is the exec, and the rest is the
+ * command exiting and its exit code making it back. Tracing costs each
+ * side a write() per event.
+ *
+ * With -r it times the PTY relay of the client instead: the real su
+ * runs a command writing that many bytes, with a PTY of ours as its
+ * stdio, and the time until all of them arrived is measured along with
+ * the CPU time and context switches of the client. Together with -e
+ * this compares the I/O engines of both the daemon and the client.
+ * With -p the stdio is a pipe instead, and with -t the client reaches
+ * the daemon over TCP, where its stdio goes over the socket as frames,
+ * see mux.h, rather than as passed FDs.
+ */
+
+#define _GNU_SOURCE /* for ptsname_r() and pipe2() */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+
+#include "su.h"
+#include "stats.h"
+
+enum {
+    PHASE_CONNECT,
+    PHASE_HANDSHAKE,
+    PHASE_ACK,
+    PHASE_FORK,
+    PHASE_EXEC,
+    PHASE_EXIT,
+    PHASE_TOTAL,
+    PHASES
+};
+
+static const char *phase_names[PHASES] = {
+    "connect", "handshake", "ack", "fork", "exec", "exit", "total",
+};
+
+// The span of the client each phase is, where there is one
+static const char *span_names[PHASES] = {
+    [PHASE_CONNECT] = "connect", [PHASE_HANDSHAKE] = "handshake",
+    [PHASE_ACK] = "ack", [PHASE_TOTAL] = "request",
+};
+
+enum {
+    RELAY_WALL,
+    RELAY_CPU,
+    RELAY_SWITCHES,
+    RELAY_METRICS
+};
+
+static const char *relay_names[RELAY_METRICS] = {
+    "wall_us", "cpu_us", "switches",
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * The command run by the daemon: write the time it started to "path".
+ */
+static int run_stamp(const char *path) {
+    long long stamp = now_ns();
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return 1;
+    if (pwrite(fd, &stamp, sizeof(stamp), 0) != sizeof(stamp))
+        return 1;
+    close(fd);
+    return 0;
+}
+
+static int connect_bench(const char *name, int tcp) {
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    socklen_t len;
+    int fd;
+
+    if (tcp) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            return -1;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(PORT);
+        if (connect(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path + 1, name + 1, sizeof(sun.sun_path) - 2);
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(name);
+    if (connect(fd, (struct sockaddr *)&sun, len)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static pid_t start_daemon(const char *su, const char *name, int tcp, const char *workers) {
+    pid_t pid = fork();
+
+    if (pid != 0)
+        return pid;
+
+    // Own process group, so the daemon and its workers go down together
+    setpgid(0, 0);
+    setenv("SUD_SOCKET", name, 1);
+    setenv("SUD_TCP", tcp ? "1" : "0", 1);
+    if (workers)
+        setenv("SUD_WORKERS", workers, 1);
+    execl(su, su, "--daemon", (char *)NULL);
+    perror(su);
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * Print how many connections the daemon took, and how many of them
+ * through io_uring, which shows whether SUD_IO_ENGINE=uring engaged.
+ */
+static void print_accepts(const char *path) {
+    struct daemon_stats stats;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return;
+    if (pread(fd, &stats, sizeof(stats), 0) == sizeof(stats) &&
+            stats.magic == STATS_MAGIC && stats.version == STATS_VERSION)
+        printf("%llu connections accepted, %llu through io_uring\n",
+                (unsigned long long)stats.accepts, (unsigned long long)stats.ring_accepts);
+    close(fd);
+}
+
+/*
+ * Open a PTY for the request, the daemon can't use passed FDs over TCP.
+ * Returns the master, and the slave path in "slave".
+ */
+static int open_pty(char *slave, size_t len) {
+    int ptmx = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+    if (ptmx == -1)
+        return -1;
+    if (grantpt(ptmx) || unlockpt(ptmx) || ptsname_r(ptmx, slave, len)) {
+        close(ptmx);
+        return -1;
+    }
+    return ptmx;
+}
+
+/*
+ * The number after "key" in a trace event, or -1.
+ */
+static long long trace_number(const char *event, const char *key) {
+    const char *p = strstr(event, key);
+
+    return p ? strtoll(p + strlen(key), NULL, 10) : -1;
+}
+
+/*
+ * Take the events one request appended to the trace from "*offset" on.
+ * Fills in the start and end of the spans of the client in "spans", in
+ * us, and returns the time of the "exec" mark of the daemon, or -1.
+ */
+static long long read_trace(int fd, off_t *offset, long long spans[][2]) {
+    static char buf[1 << 16];
+    long long ts, dur, exec = -1;
+    char *line, *next;
+    ssize_t len;
+    int p;
+
+    len = pread(fd, buf, sizeof(buf) - 1, *offset);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+    // Only whole events, the rest is for the next call
+    next = strrchr(buf, '\n');
+    if (next == NULL)
+        return -1;
+    next[1] = '\0';
+    *offset += next + 1 - buf;
+
+    for (line = buf; (next = strchr(line, '\n')) != NULL; line = next + 1) {
+        *next = '\0';
+        ts = trace_number(line, "\"ts\":");
+        dur = trace_number(line, "\"dur\":");
+        if (strstr(line, "\"cat\":\"daemon\"")) {
+            if (strstr(line, "\"name\":\"exec\""))
+                exec = ts;
+            continue;
+        }
+        for (p = 0; p < PHASES; p++) {
+            char name[32];
+
+            if (!span_names[p])
+                continue;
+            snprintf(name, sizeof(name), "\"name\":\"%s\"", span_names[p]);
+            if (strstr(line, name)) {
+                spans[p][0] = ts;
+                spans[p][1] = ts + dur;
+            }
+        }
+    }
+    return exec;
+}
+
+/*
+ * Run one request through connect_daemon() and fill "t" with the
+ * duration of each phase, in ns.
+ */
+static int bench_one(char **argv, int argc, const char *stamp_path,
+        int trace_fd, off_t *trace_offset, long long *t) {
+    long long spans[PHASES][2] = { { 0 } };
+    long long stamp = 0, exec;
+    int fd, code, p;
+
+    code = connect_daemon(argc, argv, getppid());
+
+    exec = read_trace(trace_fd, trace_offset, spans);
+    fd = open(stamp_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || pread(fd, &stamp, sizeof(stamp), 0) != sizeof(stamp) || code != 0) {
+        fprintf(stderr, "bench: request failed with code %d\n", code);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    if (exec == -1 || spans[PHASE_ACK][1] == 0 || spans[PHASE_TOTAL][1] == 0) {
+        fprintf(stderr, "bench: request left no trace\n");
+        return -1;
+    }
+    // The stamp is in ns, the trace in us
+    stamp /= 1000;
+
+    t[PHASE_CONNECT]   = spans[PHASE_CONNECT][1] - spans[PHASE_CONNECT][0];
+    t[PHASE_HANDSHAKE] = spans[PHASE_HANDSHAKE][1] - spans[PHASE_HANDSHAKE][0];
+    t[PHASE_ACK]       = spans[PHASE_ACK][1] - spans[PHASE_ACK][0];
+    t[PHASE_FORK]      = exec - spans[PHASE_ACK][1];
+    t[PHASE_EXEC]      = stamp - exec;
+    t[PHASE_EXIT]      = spans[PHASE_TOTAL][1] - stamp;
+    t[PHASE_TOTAL]     = spans[PHASE_TOTAL][1] - spans[PHASE_TOTAL][0];
+    for (p = 0; p < PHASES; p++)
+        t[p] *= 1000;
+    return 0;
+}
+
+/*
+ * Run "cmd" through the client "su" with a PTY for its stdio, or a pipe
+ * with "pipes", and read back the "bytes" it writes. Fills "t" with the
+ * wall time and the CPU time of the client in ns, and its context
+ * switches.
+ */
+static int relay_one(const char *su, const char *cmd, long long bytes, int pipes, long long *t) {
+    char slave[PATH_MAX], buf[65536];
+    long long start, got = 0;
+    struct termios tio;
+    struct rusage ru;
+    int ptmx, fd, status, p[2];
+    ssize_t len;
+    pid_t pid;
+
+    if (pipes) {
+        if (pipe2(p, O_CLOEXEC))
+            return -1;
+        ptmx = p[0];
+    } else {
+        ptmx = open_pty(slave, sizeof(slave));
+        if (ptmx == -1)
+            return -1;
+    }
+
+    start = now_ns();
+    pid = fork();
+    if (pid == 0) {
+        if (pipes) {
+            fd = open("/dev/null", O_RDONLY);
+            if (fd == -1)
+                _exit(127);
+            dup2(fd, STDIN_FILENO);
+            dup2(p[1], STDOUT_FILENO);
+            dup2(p[1], STDERR_FILENO);
+            execl(su, su, "-c", cmd, (char *)NULL);
+            _exit(127);
+        }
+        // The PTY becomes the controlling terminal of the client
+        setsid();
+        fd = open(slave, O_RDWR);
+        if (fd == -1)
+            _exit(127);
+        if (tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+        execl(su, su, "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    if (pipes)
+        close(p[1]);
+    if (pid == -1) {
+        close(ptmx);
+        return -1;
+    }
+
+    // Until EOF or EIO, once the client and with it the last slave FD,
+    // or the last writer of the pipe, is gone
+    for (;;) {
+        len = read(ptmx, buf, sizeof(buf));
+        if (len > 0)
+            got += len;
+        else if (len == 0 || errno != EINTR)
+            break;
+    }
+    if (wait4(pid, &status, 0, &ru) != pid)
+        status = -1;
+    t[RELAY_WALL] = now_ns() - start;
+    t[RELAY_CPU] = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+            (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+    t[RELAY_SWITCHES] = ru.ru_nvcsw + ru.ru_nivcsw;
+    close(ptmx);
+
+    if (status != 0 || got != bytes) {
+        fprintf(stderr, "bench: relay got %lld of %lld bytes, status %d\n", got, bytes, status);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * A size with an optional K, M or G suffix.
+ */
+static long long parse_size(const char *arg) {
+    char *end;
+    long long size = strtoll(arg, &end, 10);
+
+    switch (*end) {
+    case 'G': size <<= 10; /* fall through */
+    case 'M': size <<= 10; /* fall through */
+    case 'K': size <<= 10; end++; break;
+    }
+    return *end || size <= 0 ? -1 : size;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const long long *sorted, int n, double q) {
+    return sorted[(int)((n - 1) * q)] / 1000.0;
+}
+
+static void print_percentiles(const char *name, long long *samples, int count, double scale) {
+    qsort(samples, count, sizeof(long long), cmp_ll);
+    printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", name,
+            percentile_us(samples, count, 0.50) * scale,
+            percentile_us(samples, count, 0.90) * scale,
+            percentile_us(samples, count, 0.99) * scale,
+            percentile_us(samples, count, 0.999) * scale);
+}
+
+/*
+ * The -r benchmark, against the daemon on "name", or on TCP with "tcp".
+ */
+static int run_relay(const char *su, const char *name, int tcp, int pipes, long long bytes,
+        int count, int warmup, const char *engine) {
+    long long *samples[RELAY_METRICS], t[RELAY_METRICS];
+    long long wall = 0, cpu = 0;
+    char cmd[64];
+    int i, m;
+
+    // Inherited by the clients, which find the daemon through it, or
+    // fall back to TCP without one
+    setenv("SUD_SOCKET", tcp ? "" : name, 1);
+    snprintf(cmd, sizeof(cmd), "head -c %lld /dev/zero", bytes);
+    for (m = 0; m < RELAY_METRICS; m++) {
+        samples[m] = malloc(sizeof(long long) * count);
+        if (samples[m] == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < warmup + count; i++) {
+        if (relay_one(su, cmd, bytes, pipes, t)) {
+            fprintf(stderr, "bench: relay %d failed\n", i);
+            return -1;
+        }
+        if (i < warmup)
+            continue;
+        for (m = 0; m < RELAY_METRICS; m++)
+            samples[m][i - warmup] = t[m];
+        wall += t[RELAY_WALL];
+        cpu += t[RELAY_CPU];
+    }
+
+    printf("%d relays of %lld bytes to a %s over %s, SUD_IO_ENGINE=%s\n", count, bytes,
+            pipes ? "pipe" : "PTY", tcp ? "TCP" : "the Unix socket", engine ? engine : "default");
+    printf("%-10s %10s %10s %10s %10s\n", "metric", "p50", "p90", "p99", "p999");
+    // The switches aren't ns, undo the scaling to us
+    for (m = 0; m < RELAY_METRICS; m++) {
+        print_percentiles(relay_names[m], samples[m], count, m == RELAY_SWITCHES ? 1000 : 1);
+        free(samples[m]);
+    }
+    printf("%.1f MiB/s, client CPU %.1f us per MiB\n",
+            (double)bytes * count / (1 << 20) / (wall / 1e9),
+            cpu / 1000.0 / ((double)bytes * count / (1 << 20)));
+    return 0;
+}
+
+static __attribute__ ((noreturn)) void usage(int status) {
+    FILE *stream = (status == EXIT_SUCCESS) ? stdout : stderr;
+
+    fprintf(stream,
+    "Usage: bench [options] SU\n\n"
+    "Options:\n"
+    "  -n COUNT          number of requests to time, default 1000\n"
+    "  -w COUNT          untimed requests to run first, default 20\n"
+    "  -t                connect over TCP loopback instead of the Unix socket\n"
+    "  -W WORKERS        SUD_WORKERS for the daemon\n"
+    "  -e ENGINE         SUD_IO_ENGINE for the daemon and the clients\n"
+    "  -r BYTES          time the PTY relay of su with BYTES of output instead,\n"
+    "                    K, M or G suffixes allowed\n"
+    "  -p                with -r, give su a pipe instead of a PTY\n"
+    "  -h                display this help message and exit\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    const char *workers = NULL, *engine = NULL;
+    long long relay = 0;
+    int count = 1000, warmup = 20, tcp = 0, pipes = 0;
+    char name[64], stamp_path[PATH_MAX], trace_path[PATH_MAX], stats_path[PATH_MAX];
+    char self[PATH_MAX];
+    long long *samples[PHASES];
+    long long t[PHASES];
+    off_t trace_offset = 0;
+    pid_t daemon;
+    int c, i, p, fd, trace_fd, null_fd, saved_out, saved_err;
+
+    if (argc == 3 && strcmp(argv[1], "--stamp") == 0)
+        return run_stamp(argv[2]);
+
+    while ((c = getopt(argc, argv, "n:w:tW:e:r:ph")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 't':
+            tcp = 1;
+            break;
+        case 'W':
+            workers = optarg;
+            break;
+        case 'e':
+            engine = optarg;
+            break;
+        case 'r':
+            relay = parse_size(optarg);
+            if (relay == -1)
+                usage(2);
+            break;
+        case 'p':
+            pipes = 1;
+            break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+        default:
+            usage(2);
+        }
+    }
+    if (optind != argc - 1 || count <= 0 || warmup < 0 || (pipes && !relay))
+        usage(2);
+    if (engine)
+        setenv("SUD_IO_ENGINE", engine, 1);
+
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len == -1) {
+        perror("readlink");
+        return 1;
+    }
+    self[len] = '\0';
+    snprintf(name, sizeof(name), "@sud-bench-%d", getpid());
+    snprintf(stamp_path, sizeof(stamp_path), "/tmp/sud-bench-%d.stamp", getpid());
+    fd = open(stamp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        perror(stamp_path);
+        return 1;
+    }
+    close(fd);
+    snprintf(trace_path, sizeof(trace_path), "/tmp/sud-bench-%d.trace", getpid());
+    trace_fd = open(trace_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (trace_fd == -1) {
+        perror(trace_path);
+        return 1;
+    }
+    // Counters of our own, to tell which engine took the connections
+    snprintf(stats_path, sizeof(stats_path), "/tmp/sud-bench-%d.stats", getpid());
+    setenv("SUD_STATS", stats_path, 1);
+    // The phases come from the trace of the daemon and of our client
+    if (!relay)
+        setenv("SUD_TRACE", trace_path, 1);
+
+    // The "--" keeps getopt in su from taking --stamp for its own
+    char *req_argv[] = { "su", "--", "0", self, "--stamp", stamp_path, NULL };
+    int req_argc = 6;
+
+    for (p = 0; p < PHASES; p++) {
+        samples[p] = malloc(sizeof(long long) * count);
+        if (samples[p] == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    daemon = start_daemon(argv[optind], name, tcp, workers);
+    if (daemon == -1) {
+        perror("fork");
+        return 1;
+    }
+
+    // Wait for the daemon to listen
+    for (i = 0; i < 200; i++) {
+        fd = connect_bench(name, tcp);
+        if (fd != -1)
+            break;
+        usleep(10000);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "bench: daemon did not come up\n");
+        kill(-daemon, SIGTERM);
+        return 1;
+    }
+    close(fd);
+
+    if (relay) {
+        i = run_relay(argv[optind], name, tcp, pipes, relay, count, warmup, engine);
+        kill(-daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+        unlink(stamp_path);
+        unlink(trace_path);
+        unlink(stats_path);
+        return i ? 1 : 0;
+    }
+
+    // The client finds the daemon like su does, and hands our stdio to
+    // the command, which writes nothing. /dev/null also keeps it from
+    // relaying a terminal, which isn't what is timed here.
+    setenv("SUD_SOCKET", tcp ? "" : name, 1);
+    null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    saved_out = dup(STDOUT_FILENO);
+    saved_err = dup(STDERR_FILENO);
+    if (null_fd == -1 || saved_out == -1 || saved_err == -1) {
+        perror("/dev/null");
+        kill(-daemon, SIGTERM);
+        return 1;
+    }
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+
+    for (i = 0; i < warmup + count; i++) {
+        if (bench_one(req_argv, req_argc, stamp_path, trace_fd, &trace_offset, t))
+            break;
+        if (i < warmup)
+            continue;
+        for (p = 0; p < PHASES; p++)
+            samples[p][i - warmup] = t[p];
+    }
+
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    kill(-daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    unlink(stamp_path);
+    unlink(trace_path);
+    if (i < warmup + count) {
+        unlink(stats_path);
+        fprintf(stderr, "bench: request %d failed\n", i);
+        return 1;
+    }
+
+    printf("%d requests over %s%s%s%s%s, in us\n", count, tcp ? "tcp" : "unix",
+            workers ? ", SUD_WORKERS=" : "", workers ? workers : "",
+            engine ? ", SUD_IO_ENGINE=" : "", engine ? engine : "");
+    printf("%-10s %10s %10s %10s %10s\n", "phase", "p50", "p90", "p99", "p999");
+    for (p = 0; p < PHASES; p++) {
+        print_percentiles(phase_names[p], samples[p], count, 1);
+        free(samples[p]);
+    }
+    print_accepts(stats_path);
+    unlink(stats_path);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * android/log.h
+ *
+ * Stand-in for liblog in host builds. Messages are appended to the file
+ * named by SUD_LOG, and dropped when it is unset. They never go to
+ * stderr, which the daemon hands to the commands it runs.
+ */
+
+#ifndef _HOST_ANDROID_LOG_H_
+#define _HOST_ANDROID_LOG_H_
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef enum android_LogPriority {
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT,
+} android_LogPriority;
+
+static inline int __android_log_print(int prio, const char *tag, const char *fmt, ...) {
+    static int fd = -2;
+    va_list ap;
+
+    (void)prio;
+    if (fd == -2) {
+        const char *path = getenv("SUD_LOG");
+        fd = path ? open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) : -1;
+    }
+    if (fd < 0)
+        return 0;
+
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf), "%d %s: ", getpid(), tag);
+    va_start(ap, fmt);
+    len += vsnprintf(buf + len, sizeof(buf) - len - 1, fmt, ap);
+    va_end(ap);
+    if (len > (int)sizeof(buf) - 2)
+        len = sizeof(buf) - 2;
+    buf[len++] = '\n';
+    return write(fd, buf, len);
+}
+
+static inline int __android_log_write(int prio, const char *tag, const char *text) {
+    return __android_log_print(prio, tag, "%s", text);
+}
+
+#endif
@@ -0,0 +1,418 @@
+/*
+** Copyright 2021, Corellium, LLC
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * stress.c
+ *
+ * Load and soak generator for a running daemon. A number of client
+ * threads send requests back to back for a while, mixing PTY and plain
+ * sessions as well as short and long commands, and every interval the
+ * throughput and failures are printed next to the process, zombie and
+ * FD counts of the daemon, so that leaks show up as growth over time.
+ */
+
+#define _GNU_SOURCE /* for ptsname_r() */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#include "su.h"
+#include "proto.h"
+
+struct stress_counters {
+    unsigned long requests;
+    unsigned long connect_errors;
+    unsigned long refused;
+    unsigned long handshake_errors;
+    unsigned long exit_errors;
+};
+
+static struct stress_counters counters;
+
+static const char *socket_name;
+static int use_tcp;
+static int pty_percent = 50;
+static int long_percent = 10;
+static const char *short_command = "true";
+static const char *long_command = "sleep 1";
+static volatile int stop;
+
+#define COUNT(field) __atomic_add_fetch(&counters.field, 1, __ATOMIC_RELAXED)
+#define READ(field)  __atomic_load_n(&counters.field, __ATOMIC_RELAXED)
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_stress(void) {
+    struct sockaddr_un sun;
+    struct sockaddr_in sin;
+    size_t len;
+    int fd;
+
+    if (use_tcp) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            return -1;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(PORT);
+        if (connect(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    len = strlen(socket_name);
+    if (len == 0 || len >= sizeof(sun.sun_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    memcpy(sun.sun_path, socket_name, len);
+    if (socket_name[0] == '@')
+        sun.sun_path[0] = '\0';
+    else
+        len++;
+    if (connect(fd, (struct sockaddr *)&sun, offsetof(struct sockaddr_un, sun_path) + len)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    ssize_t ret;
+
+    do {
+        ret = recv(fd, buf, len, MSG_WAITALL);
+    } while (ret == -1 && errno == EINTR);
+    return ret == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Send one request the way connect_daemon() does and wait for its
+ * exit code, counting whatever went wrong.
+ */
+static void stress_one(unsigned int *seed) {
+    char *argv[] = { "su", "-c", NULL, NULL };
+    struct handshake hs = { 0 };
+    char slave[PATH_MAX] = "";
+    int ptmx = -1, null_fd = -1;
+    int fd, ack, code;
+
+    argv[2] = (char *)((int)(rand_r(seed) % 100) < long_percent ? long_command : short_command);
+    hs.fds[0] = hs.fds[1] = hs.fds[2] = -1;
+    if ((int)(rand_r(seed) % 100) < pty_percent) {
+        ptmx = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (ptmx == -1 || grantpt(ptmx) || unlockpt(ptmx) ||
+                ptsname_r(ptmx, slave, sizeof(slave))) {
+            COUNT(connect_errors);
+            goto out;
+        }
+    } else if (!use_tcp) {
+        null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        hs.fds[0] = hs.fds[1] = hs.fds[2] = null_fd;
+    } else {
+        // FDs don't travel over TCP, the daemon needs a PTY then
+        COUNT(connect_errors);
+        goto out;
+    }
+    hs.pid = getpid();
+    hs.uid = getuid();
+    hs.ppid = getppid();
+    hs.pts_slave = slave;
+    hs.argc = 3;
+    hs.argv = argv;
+
+    fd = connect_stress();
+    if (fd == -1) {
+        if (errno == ECONNREFUSED || errno == EAGAIN)
+            COUNT(refused);
+        else
+            COUNT(connect_errors);
+        goto out;
+    }
+    if (handshake_send(fd, &hs) || read_all(fd, &ack, sizeof(ack))) {
+        COUNT(handshake_errors);
+    } else if (read_all(fd, &code, sizeof(code)) || code != 0) {
+        COUNT(exit_errors);
+    } else {
+        COUNT(requests);
+    }
+    close(fd);
+
+out:
+    if (ptmx != -1)    close(ptmx);
+    if (null_fd != -1) close(null_fd);
+}
+
+static void *stress_thread(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg ^ (unsigned int)time(NULL);
+
+    while (!stop)
+        stress_one(&seed);
+    return NULL;
+}
+
+struct proc_usage {
+    int procs;
+    int zombies;
+    int fds;
+};
+
+static int count_fds(int pid) {
+    char path[64];
+    struct dirent *de;
+    DIR *dir;
+    int count = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] != '.')
+            count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/*
+ * Count the processes below "root" (itself included), its zombies and
+ * the FDs they hold, by walking /proc.
+ */
+static void proc_usage(int root, struct proc_usage *usage) {
+    static int pids[65536], ppids[65536];
+    static char states[65536];
+    char path[64], buf[512];
+    struct dirent *de;
+    int n = 0, i, changed;
+    DIR *dir;
+
+    memset(usage, 0, sizeof(*usage));
+    dir = opendir("/proc");
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL && n < 65536) {
+        int pid = atoi(de->d_name), fd;
+        ssize_t len;
+        char *p;
+
+        if (pid <= 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0)
+            continue;
+        buf[len] = '\0';
+        // The command name may contain anything, skip past its last ')'
+        p = strrchr(buf, ')');
+        if (p == NULL || sscanf(p + 1, " %c %d", &states[n], &ppids[n]) != 2)
+            continue;
+        pids[n++] = pid;
+    }
+    closedir(dir);
+
+    // Mark the tree below root, reusing ppids[] as the mark
+    for (i = 0; i < n; i++) {
+        if (pids[i] == root)
+            ppids[i] = -1;
+    }
+    do {
+        changed = 0;
+        for (i = 0; i < n; i++) {
+            if (ppids[i] <= 0)
+                continue;
+            for (int j = 0; j < n; j++) {
+                if (ppids[j] == -1 && pids[j] == ppids[i]) {
+                    ppids[i] = -1;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    for (i = 0; i < n; i++) {
+        if (ppids[i] != -1)
+            continue;
+        usage->procs++;
+        if (states[i] == 'Z')
+            usage->zombies++;
+        else
+            usage->fds += count_fds(pids[i]);
+    }
+}
+
+static __attribute__ ((noreturn)) void usage(int status) {
+    FILE *stream = (status == EXIT_SUCCESS) ? stdout : stderr;
+
+    fprintf(stream,
+    "Usage: stress [options]\n\n"
+    "Load a running daemon, found like su finds it, with concurrent requests.\n\n"
+    "Options:\n"
+    "  -c CLIENTS        concurrent clients, default 16\n"
+    "  -d SECONDS        how long to run, default 10\n"
+    "  -i SECONDS        reporting interval, default 1\n"
+    "  -P PERCENT        requests using a PTY, default 50\n"
+    "  -L PERCENT        requests running the long command, default 10\n"
+    "  -s COMMAND        short command, default \"true\"\n"
+    "  -l COMMAND        long command, default \"sleep 1\"\n"
+    "  -p PID            daemon pid, to track its processes and FDs\n"
+    "  -t                connect over TCP loopback instead of the Unix socket\n"
+    "  -h                display this help message and exit\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    int clients = 16, duration = 10, interval = 1, daemon_pid = 0;
+    struct stress_counters last = { 0 };
+    struct proc_usage first, cur;
+    pthread_t *threads;
+    double start, next, t, last_t;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "c:d:i:P:L:s:l:p:th")) != -1) {
+        switch (c) {
+        case 'c': clients = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 'P': pty_percent = atoi(optarg); break;
+        case 'L': long_percent = atoi(optarg); break;
+        case 's': short_command = optarg; break;
+        case 'l': long_command = optarg; break;
+        case 'p': daemon_pid = atoi(optarg); break;
+        case 't': use_tcp = 1; break;
+        case 'h': usage(EXIT_SUCCESS);
+        default:  usage(2);
+        }
+    }
+    if (optind != argc || clients <= 0 || duration <= 0 || interval <= 0)
+        usage(2);
+    if (use_tcp && pty_percent < 100) {
+        // Plain sessions need passed FDs
+        pty_percent = 100;
+    }
+
+    socket_name = getenv("SUD_SOCKET");
+    if (socket_name == NULL)
+        socket_name = DAEMON_SOCKET;
+
+    signal(SIGPIPE, SIG_IGN);
+    threads = calloc(clients, sizeof(*threads));
+    if (threads == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    if (daemon_pid)
+        proc_usage(daemon_pid, &first);
+
+    printf("%d clients for %ds over %s, %d%% PTY, %d%% \"%s\"\n", clients, duration,
+            use_tcp ? "tcp" : socket_name, pty_percent, long_percent, long_command);
+    printf("%8s %10s %10s %10s %10s %10s", "time", "req/s", "requests", "refused",
+            "conn err", "hs err");
+    printf(" %10s", "exit err");
+    if (daemon_pid)
+        printf(" %8s %8s %8s", "procs", "zombies", "fds");
+    printf("\n");
+
+    for (i = 0; i < clients; i++) {
+        if (pthread_create(&threads[i], NULL, stress_thread, (void *)(uintptr_t)i)) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    start = last_t = now();
+    next = start + interval;
+    for (;;) {
+        t = now();
+        if (t < next) {
+            usleep((next - t) * 1e6);
+            continue;
+        }
+
+        unsigned long requests = READ(requests);
+        printf("%7.1fs %10.1f %10lu %10lu %10lu %10lu %10lu", t - start,
+                (requests - last.requests) / (t - last_t), requests,
+                READ(refused), READ(connect_errors), READ(handshake_errors),
+                READ(exit_errors));
+        if (daemon_pid) {
+            proc_usage(daemon_pid, &cur);
+            printf(" %8d %8d %8d", cur.procs, cur.zombies, cur.fds);
+        }
+        printf("\n");
+        fflush(stdout);
+        last.requests = requests;
+        last_t = t;
+
+        if (t - start >= duration)
+            break;
+        next += interval;
+    }
+
+    stop = 1;
+    for (i = 0; i < clients; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    t = now() - start;
+    printf("\n%lu requests in %.1fs, %.1f req/s\n", READ(requests), t, READ(requests) / t);
+    printf("failures: %lu refused, %lu connect, %lu handshake, %lu exit\n",
+            READ(refused), READ(connect_errors), READ(handshake_errors), READ(exit_errors));
+    if (daemon_pid) {
+        // Give the daemon a moment to reap the last requests
+        sleep(1);
+        proc_usage(daemon_pid, &cur);
+        printf("daemon growth: %+d processes, %+d zombies, %+d fds\n",
+                cur.procs - first.procs, cur.zombies - first.zombies, cur.fds - first.fds);
+    }
+
+    return READ(refused) + READ(connect_errors) + READ(handshake_errors) +
+            READ(exit_errors) ? 1 : 0;
+}